@@ -102,6 +102,44 @@ __nvme_alloc_request(struct request_queue *q,
 }
 #endif
 
+/*
+ * blk_mq_insert_request / blk_mq_run_hw_queues
+ *
+ * MEMO: blk_execute_rq_nowait() runs the hardware queue for each request,
+ * thus rings the doorbell of NVMe-SSD for each command. These symbols allow
+ * to insert multiple requests, then run the queue once. Both of them are
+ * optional; we fall back to blk_execute_rq_nowait() if not available.
+ */
+static struct module *mod_blk_mq_insert_request = NULL;
+static void (* p_blk_mq_insert_request)(
+	struct request *rq, bool at_head, bool run_queue, bool async) = NULL;
+
+static struct module *mod_blk_mq_run_hw_queues = NULL;
+static void (* p_blk_mq_run_hw_queues)(
+	struct request_queue *q, bool async) = NULL;
+
+static inline bool
+__blk_mq_batch_submit_available(void)
+{
+	return (p_blk_mq_insert_request != NULL &&
+			p_blk_mq_run_hw_queues != NULL);
+}
+
+static inline void
+__blk_mq_insert_request(struct request *rq, bool at_head,
+						bool run_queue, bool async)
+{
+	BUG_ON(!p_blk_mq_insert_request);
+	p_blk_mq_insert_request(rq, at_head, run_queue, async);
+}
+
+static inline void
+__blk_mq_run_hw_queues(struct request_queue *q, bool async)
+{
+	BUG_ON(!p_blk_mq_run_hw_queues);
+	p_blk_mq_run_hw_queues(q, async);
+}
+
 /* ext4_get_block */
 static struct module *mod_ext4_get_block = NULL;
 static int (* p_ext4_get_block)(
@@ -217,6 +255,9 @@ strom_put_all_extra_modules(void)
 	module_put(mod_nvidia_p2p_get_pages);
 	module_put(mod_nvidia_p2p_put_pages);
 	module_put(mod_nvidia_p2p_free_page_table);
+	/* block layer */
+	module_put(mod_blk_mq_insert_request);
+	module_put(mod_blk_mq_run_hw_queues);
 	/* file systems */
 	module_put(mod_ext4_get_block);
 	module_put(mod_xfs_get_blocks);
@@ -255,6 +296,9 @@ strom_init_extra_symbols(void)
 	/* nvme.ko */
 	LOOKUP_MANDATORY_EXTRA_SYMBOL(nvme_alloc_request);
 #endif
+	/* block layer is a part of the core kernel, so no need to wait for */
+	LOOKUP_OPTIONAL_EXTRA_SYMBOL(blk_mq_insert_request);
+	LOOKUP_OPTIONAL_EXTRA_SYMBOL(blk_mq_run_hw_queues);
 	/* notifier to get optional extra symbols */
 	rc = register_module_notifier(&nvme_strom_nb);
 	if (rc)
@@ -22,17 +22,25 @@
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/highmem.h>
 #include <linux/hugetlb.h>
 #include <linux/idr.h>
 #include <linux/kallsyms.h>
 #include <linux/kernel.h>
+#include <linux/llist.h>
+#include <linux/log2.h>
 #include <linux/magic.h>
+#include <linux/mempool.h>
 #include <linux/major.h>
 #include <linux/moduleparam.h>
+#include <linux/mutex.h>
 #include <linux/nvme.h>
 #include <linux/pci.h>
+#include <linux/poll.h>
 #include <linux/proc_fs.h>
 #include <linux/sched.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
 #include <linux/version.h>
 #include <uapi/linux/nvme_ioctl.h>
 #include <generated/utsrelease.h>
@@ -84,8 +92,6 @@ static atomic64_t	stat_nr_ioctl_memcpy_submit = ATOMIC64_INIT(0);
 static atomic64_t	stat_clk_ioctl_memcpy_submit = ATOMIC64_INIT(0);
 static atomic64_t	stat_nr_ioctl_memcpy_wait = ATOMIC64_INIT(0);
 static atomic64_t	stat_clk_ioctl_memcpy_wait = ATOMIC64_INIT(0);
-static atomic64_t	stat_nr_ssd2gpu = ATOMIC64_INIT(0);
-static atomic64_t	stat_clk_ssd2gpu = ATOMIC64_INIT(0);
 static atomic64_t	stat_nr_setup_prps = ATOMIC64_INIT(0);
 static atomic64_t	stat_clk_setup_prps = ATOMIC64_INIT(0);
 static atomic64_t	stat_nr_submit_dma = ATOMIC64_INIT(0);
@@ -104,6 +110,24 @@ static atomic64_t	stat_clk_debug1 = ATOMIC64_INIT(0);
 static atomic64_t	stat_clk_debug2 = ATOMIC64_INIT(0);
 static atomic64_t	stat_clk_debug3 = ATOMIC64_INIT(0);
 static atomic64_t	stat_clk_debug4 = ATOMIC64_INIT(0);
+/*
+ * statistics updated on completion of every NVMe command are kept per CPU,
+ * not to bounce the cache-line of global atomics in the interrupt handler.
+ * They are summed up on STROM_IOCTL__STAT_INFO.
+ */
+static DEFINE_PER_CPU(u64, stat_nr_ssd2gpu);
+static DEFINE_PER_CPU(u64, stat_clk_ssd2gpu);
+
+static inline u64
+stat_percpu_sum(u64 __percpu *counter)
+{
+	u64		sum = 0;
+	int		cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *per_cpu_ptr(counter, cpu);
+	return sum;
+}
 
 static inline long
 atomic64_max_return(long newval, atomic64_t *atomic_ptr)
@@ -137,13 +161,18 @@ atomic64_max_return(long newval, atomic64_t *atomic_ptr)
 	printk(KERN_ERR "nvme-strom: " fmt "\n", ##__VA_ARGS__)
 
 /*
- * NOTE: In our benchmark, DMA block size larger than 128KB has no performance
- * benefit any more. So, our wired limitation is determined 256KB based on
- * this heuristics.
- * Also note that some of NVMe-SSD does not accept DMA block size > 128KB,
- * like Intel 750 SSD series.
+ * NOTE: Max size of a single DMA request is determined by max_hw_sectors of
+ * the NVMe-SSD (MDTS of the controller), because some of NVMe-SSD does not
+ * accept DMA block size > 128KB, like Intel 750 SSD series, and recent
+ * datacenter drives reach the peak throughput with 1-2MB reads.
+ * NVMESSD_DMAREQ_LIMIT is the hard ceiling, to determine the size of PRPs
+ * list buffer. @dmareq_maxsz_override allows to restrict the size per device.
  */
-#define NVMESSD_DMAREQ_MAXSZ		(256 * 1024)
+#define NVMESSD_DMAREQ_LIMIT		(2UL << 20)		/* 2MB */
+
+static char *dmareq_maxsz_override = NULL;
+module_param(dmareq_maxsz_override, charp, 0444);
+MODULE_PARM_DESC(dmareq_maxsz_override, "max size of DMA request per device in KB (e.g, \"nvme0n1=1024,nvme1n1=256\")");
 
 /* routines for extra symbols */
 #include "extra_ksyms.c"
@@ -185,6 +214,366 @@ strom_get_block(struct inode *inode, sector_t iblock,
 		return -ENOTSUPP;
 }
 
+/*
+ * Per-inode extent cache
+ *
+ * strom_get_block() walks on the extent tree (Ext4) or B+tree (XFS) for
+ * each call, and large table scan repeats the same lookups for each pages
+ * on every scan. So, we cache the resolved extents (file block -> device
+ * block) per inode, to skip the block lookup on the second time or later.
+ *
+ * A cache entry is identified by super_block, inode number and generation.
+ * It also remembers i_size, i_mtime, i_ctime and i_version when extents were
+ * resolved. Because write(2) and truncate(2) update these attributes, cached
+ * extents are invalidated on the next lookup after any modification of the
+ * file. i_version also detects truncate and rewrite to the same size within
+ * a tick of timestamps, if filesystem maintains it (XFS v5, or Ext4 mounted
+ * with i_version). Extents resolved across modification of the file are not
+ * cached, because they may point the blocks already released.
+ * Only mapped and written blocks are cached; holes, delayed allocation or
+ * unwritten extents are always resolved by strom_get_block().
+ */
+static int	extent_cache = 1;
+module_param(extent_cache, int, 0644);
+MODULE_PARM_DESC(extent_cache, "turn on/off per-inode extent cache");
+
+typedef struct strom_extent
+{
+	sector_t		fblock;		/* head of the file block number */
+	sector_t		pblock;		/* head of the device block number */
+	unsigned int	nblocks;	/* number of blocks in this extent */
+} strom_extent;
+
+typedef struct strom_inode_stamp
+{
+	loff_t				i_size;
+	struct timespec		i_mtime;
+	struct timespec		i_ctime;
+	u64					i_version;
+} strom_inode_stamp;
+
+static inline void
+strom_inode_stamp_read(struct inode *inode, strom_inode_stamp *stamp)
+{
+	stamp->i_size		= i_size_read(inode);
+	stamp->i_mtime		= inode->i_mtime;
+	stamp->i_ctime		= inode->i_ctime;
+	stamp->i_version	= inode->i_version;
+}
+
+static inline bool
+strom_inode_stamp_equal(strom_inode_stamp *a, strom_inode_stamp *b)
+{
+	return (a->i_size == b->i_size &&
+			timespec_equal(&a->i_mtime, &b->i_mtime) &&
+			timespec_equal(&a->i_ctime, &b->i_ctime) &&
+			a->i_version == b->i_version);
+}
+
+#define STROM_EXTENT_CACHE_NITEMS		120
+struct strom_extent_cache
+{
+	struct list_head	chain;		/* chain to the strom_extent_slots[] */
+	struct super_block *i_sb;		/* super_block of the inode */
+	unsigned long		i_ino;		/* inode number */
+	__u32				i_generation; /* generation of the inode */
+	strom_inode_stamp	stamp;		/* attributes when extents were cached */
+	unsigned int		nitems;		/* number of valid extents[] */
+	strom_extent		extents[STROM_EXTENT_CACHE_NITEMS]; /* by fblock */
+};
+typedef struct strom_extent_cache	strom_extent_cache;
+
+#define STROM_EXTENT_NSLOTS_BITS	8
+#define STROM_EXTENT_NSLOTS			(1UL << STROM_EXTENT_NSLOTS_BITS)
+#define STROM_EXTENT_SLOT_DEPTH		4	/* max # of inodes per slot */
+static spinlock_t		strom_extent_locks[STROM_EXTENT_NSLOTS];
+static struct list_head	strom_extent_slots[STROM_EXTENT_NSLOTS];
+
+/*
+ * strom_extent_index - index of strom_extent_locks/slots
+ */
+static inline int
+strom_extent_index(struct inode *inode)
+{
+	return hash_long((unsigned long)inode->i_sb ^ inode->i_ino,
+					 STROM_EXTENT_NSLOTS_BITS);
+}
+
+/*
+ * __strom_extent_cache_lookup - lookup a valid cache entry of the inode,
+ * according to the attributes in @stamp. Caller must hold the slot lock.
+ */
+static strom_extent_cache *
+__strom_extent_cache_lookup(struct inode *inode, struct list_head *slot,
+							strom_inode_stamp *stamp)
+{
+	strom_extent_cache *ecache;
+
+	list_for_each_entry(ecache, slot, chain)
+	{
+		if (ecache->i_sb != inode->i_sb ||
+			ecache->i_ino != inode->i_ino ||
+			ecache->i_generation != inode->i_generation)
+			continue;
+
+		/* invalidation, if file was modified or truncated */
+		if (!strom_inode_stamp_equal(&ecache->stamp, stamp))
+		{
+			ecache->stamp	= *stamp;
+			ecache->nitems	= 0;
+		}
+		/* move to the head, as a recently used entry */
+		list_move(&ecache->chain, slot);
+		return ecache;
+	}
+	return NULL;
+}
+
+/*
+ * __strom_extent_cache_search - binary search on the cached extents.
+ * It returns index of the last extent whose fblock <= iblock, or -1.
+ */
+static int
+__strom_extent_cache_search(strom_extent_cache *ecache, sector_t iblock)
+{
+	int		head = 0;
+	int		tail = ecache->nitems - 1;
+
+	while (head <= tail)
+	{
+		int		curr = (head + tail) / 2;
+
+		if (ecache->extents[curr].fblock <= iblock)
+			head = curr + 1;
+		else
+			tail = curr - 1;
+	}
+	return tail;
+}
+
+/*
+ * __strom_extent_cache_insert - insert a resolved extent, and merge with
+ * the neighbor extents if they are physically continuous.
+ */
+static void
+__strom_extent_cache_insert(strom_extent_cache *ecache, strom_extent *ext)
+{
+	strom_extent   *prev = NULL;
+	strom_extent   *next = NULL;
+	int				index;
+
+	index = __strom_extent_cache_search(ecache, ext->fblock);
+	if (index >= 0)
+	{
+		prev = &ecache->extents[index];
+		if (ext->fblock < prev->fblock + prev->nblocks)
+			return;		/* already cached by concurrent lookup */
+	}
+	if (index + 1 < ecache->nitems)
+	{
+		next = &ecache->extents[index + 1];
+		if (ext->fblock + ext->nblocks > next->fblock)
+			return;		/* overlap; should not happen */
+	}
+
+	if (prev &&
+		prev->fblock + prev->nblocks == ext->fblock &&
+		prev->pblock + prev->nblocks == ext->pblock)
+	{
+		prev->nblocks += ext->nblocks;
+		if (next &&
+			prev->fblock + prev->nblocks == next->fblock &&
+			prev->pblock + prev->nblocks == next->pblock)
+		{
+			prev->nblocks += next->nblocks;
+			memmove(next, next + 1,
+					sizeof(strom_extent) * (ecache->nitems - (index + 2)));
+			ecache->nitems--;
+		}
+	}
+	else if (next &&
+			 ext->fblock + ext->nblocks == next->fblock &&
+			 ext->pblock + ext->nblocks == next->pblock)
+	{
+		next->fblock   = ext->fblock;
+		next->pblock   = ext->pblock;
+		next->nblocks += ext->nblocks;
+	}
+	else
+	{
+		/*
+		 * MEMO: If the cache entry is full, we simply reset the extents
+		 * rather than LRU management. Scan workloads rarely go back to the
+		 * extents already consumed in the same pass.
+		 */
+		if (ecache->nitems >= STROM_EXTENT_CACHE_NITEMS)
+		{
+			ecache->nitems = 0;
+			index = -1;
+		}
+		index++;
+		memmove(&ecache->extents[index + 1],
+				&ecache->extents[index],
+				sizeof(strom_extent) * (ecache->nitems - index));
+		ecache->extents[index] = *ext;
+		ecache->nitems++;
+	}
+}
+
+/*
+ * strom_lookup_extent - lookup the extent that contains @iblock; either from
+ * the extent cache or strom_get_block(). On return, @ext is adjusted to begin
+ * from the @iblock. Unmapped block is returned with nblocks = 1, as is.
+ *
+ * On cache miss, we ask the filesystem to map up to @max_nblocks blocks at
+ * once. Both of Ext4 and XFS return the whole mapped extent (clipped by the
+ * supplied b_size), so a well laid out file needs only one lookup per extent.
+ */
+static int
+strom_lookup_extent(struct inode *inode, sector_t iblock,
+					sector_t max_nblocks, strom_extent *ext)
+{
+	int					index = strom_extent_index(inode);
+	spinlock_t		   *lock = &strom_extent_locks[index];
+	struct list_head   *slot = &strom_extent_slots[index];
+	strom_extent_cache *ecache;
+	strom_extent_cache *ecache_new = NULL;
+	strom_inode_stamp	stamp;
+	strom_inode_stamp	stamp_curr;
+	struct buffer_head	bh;
+	int					i, retval;
+
+	/* attributes of the inode prior to the lookup */
+	strom_inode_stamp_read(inode, &stamp);
+	if (extent_cache)
+	{
+		spin_lock(lock);
+		ecache = __strom_extent_cache_lookup(inode, slot, &stamp);
+		if (ecache)
+		{
+			i = __strom_extent_cache_search(ecache, iblock);
+			if (i >= 0 &&
+				iblock < (ecache->extents[i].fblock +
+						  ecache->extents[i].nblocks))
+			{
+				strom_extent   *curr = &ecache->extents[i];
+
+				ext->fblock  = iblock;
+				ext->pblock  = curr->pblock + (iblock - curr->fblock);
+				ext->nblocks = curr->nblocks - (iblock - curr->fblock);
+				spin_unlock(lock);
+				return 0;
+			}
+		}
+		spin_unlock(lock);
+	}
+
+	/* cache miss, so walk on the filesystem */
+	memset(&bh, 0, sizeof(bh));
+	bh.b_size = ((size_t)Max(max_nblocks, 1) << inode->i_blkbits);
+
+	retval = strom_get_block(inode, iblock, &bh, 0);
+	if (retval)
+		return retval;
+	ext->fblock  = iblock;
+	ext->pblock  = bh.b_blocknr;
+	ext->nblocks = 1;
+
+	if (!buffer_mapped(&bh) ||
+		buffer_unwritten(&bh) ||
+		buffer_delay(&bh))
+		return 0;
+	if (bh.b_size > (1UL << inode->i_blkbits))
+		ext->nblocks = (bh.b_size >> inode->i_blkbits);
+	if (!extent_cache)
+		return 0;
+
+	/*
+	 * OK, put the resolved extent on the cache, unless the file was
+	 * modified during the lookup; the extent may be already stale.
+	 * Entry is looked up by the stamp prior to the lookup, so modification
+	 * after here is detected by the next lookup.
+	 */
+	strom_inode_stamp_read(inode, &stamp_curr);
+	if (!strom_inode_stamp_equal(&stamp, &stamp_curr))
+		return 0;
+	spin_lock(lock);
+	ecache = __strom_extent_cache_lookup(inode, slot, &stamp);
+	if (!ecache)
+	{
+		spin_unlock(lock);
+		ecache_new = kmalloc(sizeof(strom_extent_cache), GFP_KERNEL);
+		if (!ecache_new)
+			return 0;	/* not a fatal error */
+		ecache_new->i_sb	= inode->i_sb;
+		ecache_new->i_ino	= inode->i_ino;
+		ecache_new->i_generation = inode->i_generation;
+		ecache_new->stamp	= stamp;
+		ecache_new->nitems	= 0;
+
+		spin_lock(lock);
+		ecache = __strom_extent_cache_lookup(inode, slot, &stamp);
+		if (!ecache)
+		{
+			ecache = ecache_new;
+			ecache_new = NULL;
+			list_add(&ecache->chain, slot);
+		}
+	}
+	__strom_extent_cache_insert(ecache, ext);
+
+	/* evict the least recently used entry, if slot is too deep */
+	i = 0;
+	list_for_each_entry(ecache, slot, chain)
+		i++;
+	if (i > STROM_EXTENT_SLOT_DEPTH)
+	{
+		ecache = list_entry(slot->prev, strom_extent_cache, chain);
+		list_del(&ecache->chain);
+	}
+	else
+		ecache = NULL;
+	spin_unlock(lock);
+
+	kfree(ecache);
+	kfree(ecache_new);
+
+	return 0;
+}
+
+/*
+ * strom_init_extent_cache / strom_exit_extent_cache
+ */
+static void __init
+strom_init_extent_cache(void)
+{
+	int		i;
+
+	for (i=0; i < STROM_EXTENT_NSLOTS; i++)
+	{
+		spin_lock_init(&strom_extent_locks[i]);
+		INIT_LIST_HEAD(&strom_extent_slots[i]);
+	}
+}
+
+static void
+strom_exit_extent_cache(void)
+{
+	strom_extent_cache *ecache;
+	int		i;
+
+	for (i=0; i < STROM_EXTENT_NSLOTS; i++)
+	{
+		while (!list_empty(&strom_extent_slots[i]))
+		{
+			ecache = list_first_entry(&strom_extent_slots[i],
+									  strom_extent_cache, chain);
+			list_del(&ecache->chain);
+			kfree(ecache);
+		}
+	}
+}
+
 /*
  * ioctl_check_file - checks whether the supplied file descriptor is
  * capable to perform P2P DMA from NVMe SSD.
@@ -199,6 +588,39 @@ strom_get_block(struct inode *inode, sector_t iblock,
  *   are capable to have file contents inline, for very small files.
  */
 
+/*
+ * strom_lookup_dmareq_maxsz_override - returns the max size of DMA request
+ * configured for the device by @dmareq_maxsz_override, or 0 if none.
+ */
+static size_t
+strom_lookup_dmareq_maxsz_override(const char *disk_name)
+{
+	const char	   *pos = dmareq_maxsz_override;
+	const char	   *tail;
+	size_t			len = strlen(disk_name);
+	char			buf[32];
+	unsigned long	kb;
+
+	while (pos && *pos != '\0')
+	{
+		tail = strchrnul(pos, ',');
+		if (strncmp(pos, disk_name, len) == 0 &&
+			pos[len] == '=' &&
+			tail - (pos + len + 1) < sizeof(buf))
+		{
+			memcpy(buf, pos + len + 1, tail - (pos + len + 1));
+			buf[tail - (pos + len + 1)] = '\0';
+			if (kstrtoul(buf, 10, &kb) == 0 && kb > 0)
+				return (size_t)kb << 10;
+			prError("dmareq_maxsz_override: invalid value for '%s'",
+					disk_name);
+			return 0;
+		}
+		pos = (*tail == ',' ? tail + 1 : tail);
+	}
+	return 0;
+}
+
 /*
  * __extblock_is_supported_nvme - checker for BLOCK_EXT_MAJOR
  */
@@ -299,18 +721,23 @@ __extblock_is_supported_nvme(struct block_device *blkdev,
 	 * equivalent to /sys/block/nvme?n1/queue/max_hw_sectors_kb
 	 */
 	dmareq_maxsz = (size_t)queue_max_hw_sectors(nvme_ns->queue) << 9;
-	if (dmareq_maxsz > NVMESSD_DMAREQ_MAXSZ)
-		dmareq_maxsz = NVMESSD_DMAREQ_MAXSZ;
+	if (dmareq_maxsz > NVMESSD_DMAREQ_LIMIT)
+		dmareq_maxsz = NVMESSD_DMAREQ_LIMIT;
+	dmareq_maxsz = Min(dmareq_maxsz,
+					   strom_lookup_dmareq_maxsz_override(bd_disk->disk_name)
+					   ?: dmareq_maxsz);
+	dmareq_maxsz &= PAGE_MASK;
+	if (dmareq_maxsz < PAGE_SIZE)
+	{
+		prError("max size of DMA request on '%s' is too small",
+				bd_disk->disk_name);
+		return -ENOTSUPP;
+	}
 	if (p_dmareq_maxsz)
 	{
-		if (*p_dmareq_maxsz == 0)
+		/* RAID volume follows the smallest one */
+		if (*p_dmareq_maxsz == 0 || *p_dmareq_maxsz > dmareq_maxsz)
 			*p_dmareq_maxsz = dmareq_maxsz;
-		else if (*p_dmareq_maxsz != dmareq_maxsz)
-		{
-			prError("Max size of DMA request on NVMe SSD mismatch %zu <-> %zu",
-					*p_dmareq_maxsz, dmareq_maxsz);
-			return -ENOTSUPP;
-		}
 	}
 
 	/* Inform PCIe topolocy where the SSD device locates on */
@@ -590,17 +1017,258 @@ ioctl_check_file(StromCmd__CheckFile __user *uarg)
  */
 struct nvme_ns;
 
+/*
+ * strom_dma_segment - a continuous range of the destination buffer
+ *
+ * A pending DMA request consists of continuous sectors on the source device,
+ * however, its destination may be scattered to multiple segments as long as
+ * PRP list can represent them; all the segments but the first one begin at
+ * page boundary, and all the segments but the last one end at page boundary.
+ */
+typedef struct strom_dma_segment
+{
+	loff_t			offset;		/* offset of the destination buffer, or
+								 * STROM_DMA_SEGMENT__GAP */
+	unsigned int	nr_sects;	/* length in sectors */
+} strom_dma_segment;
+
+/* sectors of the segment are read through into the scratch page */
+#define STROM_DMA_SEGMENT__GAP		(-1LL)
+
+#define STROM_DMA_TASK_NSEGS		32
+
+#define STROM_RING_MAX_ENTRIES		4096
+
+/*
+ * strom_ring_failure - CQE of the SQE failed on submission, deferred by CQ
+ * full. It is allocated prior to execution of the SQE, so the consumed SQE
+ * is always reported.
+ */
+typedef struct strom_ring_failure
+{
+	struct list_head	chain;		/* chain to fstate->cq_failures */
+	unsigned long		user_data;
+	long				status;
+} strom_ring_failure;
+
+/*
+ * strom_source_file - a validated source file and attributes of the
+ * underlying NVMe-SSD. It holds a reference to @filp.
+ */
+typedef struct strom_source_file
+{
+	struct file		   *filp;
+	struct mddev	   *mddev;		/* MD RAID-0 configuration, if any */
+	struct nvme_ns	   *nvme_ns;	/* NULL, if MD RAID-0 */
+	int					nvme_blksz;
+	size_t				dmareq_maxsz;
+} strom_source_file;
+
+#define STROM_MAX_REGISTERED_FILES	1024
+
+/*
+ * strom_file_state - per file handle state of /proc/nvme-strom
+ *
+ * Once completion events are enabled, completed DMA tasks are linked to
+ * @events in order of completion, then read(2) returns them as event
+ * records. The DMA task is not released until its event is consumed, so
+ * no memory allocation is needed at the completion callback.
+ * If SQ/CQ ring is set up, DMA tasks submitted via the ring put a CQE on
+ * completion instead, or are linked to @cq_overflow if CQ is full.
+ * @lock is acquired after the slot lock of the DMA task, if both.
+ */
+typedef struct strom_file_state
+{
+	spinlock_t			lock;
+	bool				events_enabled;
+	struct list_head	events;		/* completed but unread DMA tasks */
+	wait_queue_head_t	waitq;		/* readers, pollers and ring waiters */
+	/* SQ/CQ ring, if any */
+	struct mutex		ring_mutex;	/* serialization of the submitters */
+	StromRing__Header  *ring;		/* vmalloc'ed; mapped to userspace */
+	size_t				ring_sz;
+	StromRing__Sqe	   *sqes;
+	StromRing__Cqe	   *cqes;
+	unsigned int		sq_entries;
+	unsigned int		cq_entries;
+	unsigned int		sq_head;	/* private copy; never trust userspace */
+	unsigned int		cq_tail;	/* private copy; never trust userspace */
+	struct list_head	cq_overflow; /* completed DMA tasks waiting for CQ */
+	struct list_head	cq_failures; /* failed SQEs waiting for CQ */
+	/* source files registered by STROM_IOCTL__REGISTER_FILE; under @lock */
+	strom_source_file **reg_files;	/* allocated on demand */
+	/* DMA buffers registered by STROM_IOCTL__REGISTER_DMA_BUFFER */
+	struct idr			hd_buf_idr;	/* under @lock */
+} strom_file_state;
+
+/*
+ * strom_dma_progress - bitmap of the landed chunks in the user space, for
+ * NVME_STROM_MEMCPY_FLAGS__PROGRESS_MAP
+ *
+ * Pages of the bitmap are pinned on setup, because the completion callback
+ * updates the bitmap in interrupt context. A chunk may be loaded by multiple
+ * NVMe commands, so the bit is set when the last byte of the chunk lands.
+ */
+typedef struct strom_dma_progress
+{
+	loff_t			dest_base;	/* offset of the first chunk in the buffer */
+	unsigned int	chunk_sz;	/* size of a chunk */
+	unsigned int	nr_chunks;	/* # of chunks being tracked */
+	unsigned int	map_offset;	/* offset of the bitmap in pages[0] */
+	unsigned int	nr_pages;	/* # of pinned pages of the bitmap */
+	struct page	   *pages[2];	/* the bitmap never go across 2 pages */
+	atomic_t		remains[1];	/* # of bytes not landed yet, per chunk */
+} strom_dma_progress;
+
+/*
+ * strom_create_dma_progress
+ */
+static strom_dma_progress *
+strom_create_dma_progress(uint64_t __user *progress_map,
+						  loff_t dest_base,
+						  unsigned int chunk_sz,
+						  unsigned int nr_chunks)
+{
+	strom_dma_progress *dprog;
+	unsigned long	uaddr = (unsigned long)progress_map;
+	unsigned long	ustart = (uaddr & PAGE_MASK);
+	unsigned long	uend;
+	size_t			length;
+	unsigned int	i;
+	int				rc;
+
+	if (nr_chunks == 0 ||
+		nr_chunks > NVME_STROM_PROGRESS_MAP_MAX_CHUNKS ||
+		(uaddr & (sizeof(uint64_t) - 1)) != 0)
+		return ERR_PTR(-EINVAL);
+	uend = PAGE_ALIGN(uaddr + sizeof(uint64_t) * DIV_ROUND_UP(nr_chunks, 64));
+
+	length = offsetof(strom_dma_progress, remains[nr_chunks]);
+	if (length <= PAGE_SIZE)
+		dprog = kzalloc(length, GFP_KERNEL);
+	else
+		dprog = vzalloc(length);
+	if (!dprog)
+		return ERR_PTR(-ENOMEM);
+	dprog->dest_base	= dest_base;
+	dprog->chunk_sz		= chunk_sz;
+	dprog->nr_chunks	= nr_chunks;
+	dprog->map_offset	= (uaddr - ustart);
+	dprog->nr_pages		= (uend - ustart) >> PAGE_SHIFT;
+	Assert(dprog->nr_pages <= lengthof(dprog->pages));
+	for (i=0; i < nr_chunks; i++)
+		atomic_set(&dprog->remains[i], chunk_sz);
+
+	rc = get_user_pages_fast(ustart, dprog->nr_pages, 1, dprog->pages);
+	if (rc < 0 || rc < dprog->nr_pages)
+	{
+		prError("failed on get_user_pages_fast(0x%p, %u) = %d",
+				(void *)ustart, dprog->nr_pages, rc);
+		while (rc > 0)
+			put_page(dprog->pages[--rc]);
+		rc = (rc < 0 ? rc : -EFAULT);
+		goto error;
+	}
+	/*
+	 * pages of the bitmap must be anonymous memory, because we cannot
+	 * take locks to dirty the page cache in interrupt context.
+	 */
+	for (i=0; i < dprog->nr_pages; i++)
+	{
+		if (!PageAnon(dprog->pages[i]))
+		{
+			prError("progress map (0x%p) is not on anonymous memory",
+					progress_map);
+			for (i=0; i < dprog->nr_pages; i++)
+				put_page(dprog->pages[i]);
+			rc = -EINVAL;
+			goto error;
+		}
+	}
+	return dprog;
+
+error:
+	if (is_vmalloc_addr(dprog))
+		vfree(dprog);
+	else
+		kfree(dprog);
+	return ERR_PTR(rc);
+}
+
+/*
+ * strom_release_dma_progress
+ */
+static void
+strom_release_dma_progress(strom_dma_progress *dprog)
+{
+	unsigned int	i;
+
+	for (i=0; i < dprog->nr_pages; i++)
+	{
+		set_page_dirty(dprog->pages[i]);
+		put_page(dprog->pages[i]);
+	}
+	if (is_vmalloc_addr(dprog))
+		vfree(dprog);
+	else
+		kfree(dprog);
+}
+
+/*
+ * strom_dma_progress_land - account @length bytes landed at @dest_offset of
+ * the destination buffer, then set the bits of the chunks fully landed. It
+ * can be called in interrupt context.
+ */
+static void
+strom_dma_progress_land(strom_dma_progress *dprog,
+						loff_t dest_offset, size_t length)
+{
+	loff_t			limit = (loff_t)dprog->nr_chunks * dprog->chunk_sz;
+
+	while (length > 0)
+	{
+		loff_t			pos = dest_offset - dprog->dest_base;
+		unsigned int	index;
+		unsigned int	nbytes;
+		size_t			moffset;
+		char		   *kaddr;
+
+		if (pos < 0 || pos >= limit)
+		{
+			prError("Bug? offset %ld is out of the progress map",
+					(long)dest_offset);
+			break;
+		}
+		index = (unsigned long)pos / dprog->chunk_sz;
+		nbytes = Min(length, (size_t)(index + 1) * dprog->chunk_sz - pos);
+		if (atomic_sub_return(nbytes, &dprog->remains[index]) == 0)
+		{
+			moffset = dprog->map_offset + sizeof(uint64_t) * (index / 64);
+			kaddr = kmap_atomic(dprog->pages[moffset >> PAGE_SHIFT]);
+			set_bit(index % 64, (unsigned long *)
+					(kaddr + (moffset & (PAGE_SIZE - 1))));
+			kunmap_atomic(kaddr);
+		}
+		dest_offset += nbytes;
+		length -= nbytes;
+	}
+}
+
 struct strom_dma_task
 {
-	struct list_head	chain;
+	struct rcu_head		rcu;		/* to be released after RCU grace period */
 	unsigned long		dma_task_id;/* ID of this DMA task */
-	int					hindex;		/* index of hash slot */
+	int					hindex;		/* index of the lock slot */
 	atomic_t			refcnt;		/* reference counter */
 	bool				frozen;		/* (DEBUG) no longer newly referenced */
 	mapped_gpu_memory  *mgmem;		/* destination GPU memory segment */
 	hugepage_dma_buffer *hd_buf;	/* destination huge-page buffer */
+	strom_dma_progress *progress;	/* progress map of SSD2RAM, if any */
 	/* reference to the backing file */
 	struct file		   *filp;		/* source file */
+	struct file		  **vec_filps;	/* previous source files of the vectored
+									 * SSD2RAM; kept until completion */
+	unsigned int		nr_vec_filps;
 	/* MD RAID-0 configuration, if any */
 	struct mddev	   *mddev;
 	/* current focus of the raw NVMe-SSD device */
@@ -626,22 +1294,70 @@ struct strom_dma_task
 	 */
 	long				dma_status;
 	struct file		   *ioctl_filp;
+	strom_file_state   *fstate;		/* state of @ioctl_filp; it is kept
+									 * after completion to identify the
+									 * owner of the error status */
+	struct list_head	ev_chain;	/* link to fstate->events or
+									 * fstate->cq_overflow */
+	bool				ev_pending;	/* event is not consumed yet */
+	bool				ring_task;	/* submitted via SQ ring */
+	unsigned long		ring_user_data; /* user_data of the SQE */
+
+	/*
+	 * Waiters sleep on the own wait queue of the task, thus, completion of
+	 * the other tasks never wakes them up. Waiter pins the task with
+	 * @nr_waiters during the sleep, then the last waiter releases the task
+	 * once it gets completed. These fields are protected by the slot lock.
+	 */
+	wait_queue_head_t	waitq;
+	int					nr_waiters;	/* # of waiters pinning this task */
+	bool				completed;	/* no more running */
+	bool				reaped;		/* status is already reported */
+	bool				cancelled;	/* STROM_IOCTL__MEMCPY_CANCEL */
+
+	/* doorbell written on completion, if NVME_STROM_MEMCPY_FLAGS__DOORBELL */
+	struct page		   *doorbell_page;	/* pinned user page */
+	unsigned int		doorbell_offset;/* offset in the page */
+	u64					doorbell_value;
+
+	/* hardware queue where requests are inserted but not kicked yet */
+	struct request_queue *batch_queue;
+	unsigned int		batch_nr;	/* # of requests not kicked yet */
 
 	/* state of the current pending SSD2GPU DMA request */
-	loff_t				dest_offset;/* current destination offset */
 	sector_t			head_sector;
 	unsigned int		nr_sectors;
-	/* temporary buffer for locked page cache in a chunk */
-	struct page		   *file_pages[NVMESSD_DMAREQ_MAXSZ / PAGE_CACHE_SIZE];
+	unsigned int		nr_dest_segs; /* # of valid dest_segs[] */
+	strom_dma_segment	dest_segs[STROM_DMA_TASK_NSEGS];
 };
 typedef struct strom_dma_task	strom_dma_task;
 
+/*
+ * strom_dma_task and strom_async_cmd_context are allocated from the dedicated
+ * slab caches, with mempool to guarantee forward progress of the DMA under
+ * memory pressure.
+ */
+#define STROM_DMA_TASK_MEMPOOL_MIN	32
+static struct kmem_cache *strom_dma_task_cachep = NULL;
+static mempool_t		*strom_dma_task_mempool = NULL;
+
+/*
+ * DMA tasks are tracked by strom_dma_task_idr, from the creation until its
+ * status gets reported by MEMCPY_WAIT, event or CQE. The ID is
+ * allocated cyclically, so it is not reused soon after the release, and
+ * kernel pointer is never exposed to the userspace.
+ * Per task state (completed, nr_waiters, ...) is protected by the lock slot
+ * chosen by the ID. Tracked tasks are detached from the IDR under the lock
+ * slot, so the task found by the lookup under the lock slot is valid until
+ * the lock is released. strom_dma_task_idr_lock is acquired after the lock
+ * slot, if both. Task is released after RCU grace period, so the IDR can be
+ * scanned under rcu_read_lock().
+ */
 #define STROM_DMA_TASK_NSLOTS_BITS	9
 #define STROM_DMA_TASK_NSLOTS		(1UL << STROM_DMA_TASK_NSLOTS_BITS)
 static spinlock_t		strom_dma_task_locks[STROM_DMA_TASK_NSLOTS];
-static struct list_head	strom_dma_task_slots[STROM_DMA_TASK_NSLOTS];
-static struct list_head	failed_dma_task_slots[STROM_DMA_TASK_NSLOTS];
-static wait_queue_head_t strom_dma_task_waitq[STROM_DMA_TASK_NSLOTS];
+static DEFINE_SPINLOCK(strom_dma_task_idr_lock);
+static DEFINE_IDR(strom_dma_task_idr);
 
 /*
  * strom_dma_task_index
@@ -653,95 +1369,251 @@ strom_dma_task_index(unsigned long dma_task_id)
 }
 
 /*
- * strom_create_dma_task
+ * __strom_untrack_dma_task - detach the DMA task from the IDR. Caller must
+ * hold the lock slot.
  */
-static strom_dma_task *
-strom_create_dma_task(int fdesc,
-					  mapped_gpu_memory *mgmem,
-					  hugepage_dma_buffer *hd_buf,
-					  struct file *ioctl_filp)
+static inline void
+__strom_untrack_dma_task(strom_dma_task *dtask)
 {
-	strom_dma_task		   *dtask;
-	struct file			   *filp;
-	struct super_block	   *i_sb;
-	struct block_device	   *s_bdev;
-	struct mddev		   *mddev = NULL;
-	int						node_id = -2;
-	int						support_dma64 = 1;
-	int						nvme_blksz = -1;
-	size_t					dmareq_maxsz = 0;
-	long					retval;
-	unsigned long			flags;
-
-	/* either of GPU or Host memory can be destination */
-	Assert((mgmem != NULL && hd_buf == NULL) ||
-		   (mgmem == NULL && hd_buf != NULL));
+	spin_lock(&strom_dma_task_idr_lock);
+	idr_remove(&strom_dma_task_idr, (int)dtask->dma_task_id);
+	spin_unlock(&strom_dma_task_idr_lock);
+}
 
-	/* ensure the source file is supported */
-	filp = fget(fdesc);
+/*
+ * strom_free_dma_task - release the DMA task after RCU grace period
+ */
+static void
+__strom_free_dma_task_rcu(struct rcu_head *rcu)
+{
+	strom_dma_task *dtask = container_of(rcu, strom_dma_task, rcu);
+
+	mempool_free(dtask, strom_dma_task_mempool);
+}
+
+static inline void
+strom_free_dma_task(strom_dma_task *dtask)
+{
+	call_rcu(&dtask->rcu, __strom_free_dma_task_rcu);
+}
+
+/*
+ * strom_get_source_file - lookup the source file of the DMA, either by the
+ * file descriptor or the index of the registered file.
+ */
+static int
+strom_get_source_file(struct file *ioctl_filp, int fdesc, unsigned int flags,
+					  strom_source_file *sfile)
+{
+	struct file		   *filp;
+	int					node_id = -2;
+	int					support_dma64 = 1;
+	long				retval;
+
+	if ((flags & NVME_STROM_MEMCPY_FLAGS__REGISTERED_FILE) != 0)
+	{
+		strom_file_state *fstate = ioctl_filp->private_data;
+		unsigned long	lflags;
+
+		retval = -EBADF;
+		spin_lock_irqsave(&fstate->lock, lflags);
+		if (fstate->reg_files &&
+			fdesc >= 0 && fdesc < STROM_MAX_REGISTERED_FILES &&
+			fstate->reg_files[fdesc])
+		{
+			*sfile = *fstate->reg_files[fdesc];
+			get_file(sfile->filp);
+			retval = 0;
+		}
+		spin_unlock_irqrestore(&fstate->lock, lflags);
+		return retval;
+	}
+
+	filp = fget(fdesc);
 	if (!filp)
 	{
 		prError("file descriptor %d of process %u is not available",
 				fdesc, current->tgid);
-		return ERR_PTR(-EBADF);
+		return -EBADF;
 	}
+	memset(sfile, 0, sizeof(strom_source_file));
+	sfile->nvme_blksz = -1;
 	retval = file_is_supported_nvme(filp,
 									&node_id,
 									&support_dma64,
-									&nvme_blksz,
-									&dmareq_maxsz,
-									&mddev);
+									&sfile->nvme_blksz,
+									&sfile->dmareq_maxsz,
+									&sfile->mddev);
 	if (retval < 0)
 	{
 		fput(filp);
-		return ERR_PTR(retval);
+		return retval;
+	}
+	sfile->filp = filp;
+	/*
+	 * If no MD RAID-0 configuration here, the focused NVMe-SSD will not be
+	 * changed during execution. So, we setup nvme_ns here.
+	 */
+	if (!sfile->mddev)
+	{
+		struct gendisk *bd_disk = filp->f_inode->i_sb->s_bdev->bd_disk;
+
+		sfile->nvme_ns = (struct nvme_ns *)bd_disk->private_data;
 	}
-	i_sb = filp->f_inode->i_sb;
-	s_bdev = i_sb->s_bdev;
+	return 0;
+}
+
+/*
+ * strom_create_dma_task
+ */
+static strom_dma_task *
+strom_create_dma_task(int fdesc,
+					  unsigned int cmd_flags,
+					  mapped_gpu_memory *mgmem,
+					  hugepage_dma_buffer *hd_buf,
+					  struct file *ioctl_filp)
+{
+	strom_dma_task		   *dtask;
+	strom_source_file		sfile;
+	long					retval;
+	unsigned long			flags;
+
+	/* either of GPU or Host memory can be destination */
+	Assert((mgmem != NULL && hd_buf == NULL) ||
+		   (mgmem == NULL && hd_buf != NULL));
+
+	/* ensure the source file is supported */
+	retval = strom_get_source_file(ioctl_filp, fdesc, cmd_flags, &sfile);
+	if (retval)
+		return ERR_PTR(retval);
 
 	/* allocate strom_dma_task object */
-	dtask = kzalloc(sizeof(strom_dma_task), GFP_KERNEL);
+	dtask = mempool_alloc(strom_dma_task_mempool, GFP_KERNEL);
 	if (!dtask)
 	{
-		fput(filp);
+		fput(sfile.filp);
 		return ERR_PTR(-ENOMEM);
 	}
-	dtask->dma_task_id	= (unsigned long) dtask;
-	dtask->hindex		= strom_dma_task_index(dtask->dma_task_id);
+	memset(dtask, 0, sizeof(strom_dma_task));
     atomic_set(&dtask->refcnt, 1);
 	dtask->frozen		= false;
     dtask->mgmem		= mgmem;
 	dtask->hd_buf		= hd_buf;
-    dtask->filp			= filp;
-	dtask->mddev		= mddev;
-	dtask->nvme_ns		= NULL;		/* to be set later */
-	dtask->nvme_blksz	= nvme_blksz;
-	dtask->dmareq_maxsz	= dmareq_maxsz;
+	dtask->progress		= NULL;
+    dtask->filp			= sfile.filp;
+	dtask->mddev		= sfile.mddev;
+	dtask->nvme_ns		= sfile.nvme_ns;
+	dtask->nvme_blksz	= sfile.nvme_blksz;
+	dtask->dmareq_maxsz	= sfile.dmareq_maxsz;
     dtask->dma_status	= 0;
     dtask->ioctl_filp	= get_file(ioctl_filp);
-	dtask->dest_offset	= 0;
+	dtask->fstate		= ioctl_filp->private_data;
+	INIT_LIST_HEAD(&dtask->ev_chain);
+	dtask->ev_pending	= false;
+	dtask->ring_task	= false;
+	dtask->ring_user_data = 0;
+	init_waitqueue_head(&dtask->waitq);
+	dtask->nr_waiters	= 0;
+	dtask->completed	= false;
+	dtask->reaped		= false;
+	dtask->cancelled	= false;
+	dtask->doorbell_page = NULL;
+	dtask->doorbell_offset = 0;
+	dtask->doorbell_value = 0;
+	dtask->batch_queue	= NULL;
+	dtask->batch_nr		= 0;
 	dtask->head_sector	= 0;
 	dtask->nr_sectors	= 0;
-
-	/*
-	 * If no MD RAID-0 configuration here, the focused NVMe-SSD will not be
-	 * changed during execution. So, we setup nvme_ns here.
-	 */
-	if (!mddev)
+	dtask->nr_dest_segs	= 0;
+
+	/* reserve an ID, then this strom_dma_task is now tracked */
+	idr_preload(GFP_KERNEL);
+	spin_lock_irqsave(&strom_dma_task_idr_lock, flags);
+	retval = idr_alloc_cyclic(&strom_dma_task_idr, NULL, 1, 0, GFP_NOWAIT);
+	spin_unlock_irqrestore(&strom_dma_task_idr_lock, flags);
+	idr_preload_end();
+	if (retval < 0)
 	{
-		struct gendisk	   *bd_disk = s_bdev->bd_disk;
-
-		dtask->nvme_ns	= (struct nvme_ns *)bd_disk->private_data;
+		fput(dtask->ioctl_filp);
+		fput(dtask->filp);
+		mempool_free(dtask, strom_dma_task_mempool);
+		return ERR_PTR(retval);
 	}
+	dtask->dma_task_id	= retval;
+	dtask->hindex		= strom_dma_task_index(dtask->dma_task_id);
 
-	/* OK, this strom_dma_task is now tracked */
-	spin_lock_irqsave(&strom_dma_task_locks[dtask->hindex], flags);
-	list_add_rcu(&dtask->chain, &strom_dma_task_slots[dtask->hindex]);
-	spin_unlock_irqrestore(&strom_dma_task_locks[dtask->hindex], flags);
+	spin_lock_irqsave(&strom_dma_task_idr_lock, flags);
+	idr_replace(&strom_dma_task_idr, dtask, (int)dtask->dma_task_id);
+	spin_unlock_irqrestore(&strom_dma_task_idr_lock, flags);
 
 	return dtask;
 }
 
+/*
+ * strom_dma_task_switch_file - switch the source file of the DMA task, for
+ * the vectored SSD2RAM. Caller must ensure no pending DMA request, and
+ * @dtask->vec_filps has enough room. The previous source file is kept
+ * until completion of the task, because in-flight requests still read it.
+ */
+static int
+strom_dma_task_switch_file(strom_dma_task *dtask, int fdesc,
+						   unsigned int cmd_flags, struct file *ioctl_filp)
+{
+	strom_source_file	sfile;
+	long				retval;
+
+	Assert(dtask->nr_sectors == 0 && dtask->vec_filps != NULL);
+	retval = strom_get_source_file(ioctl_filp, fdesc, cmd_flags, &sfile);
+	if (retval)
+		return retval;
+
+	dtask->vec_filps[dtask->nr_vec_filps++] = dtask->filp;
+	dtask->filp			= sfile.filp;
+	dtask->mddev		= sfile.mddev;
+	dtask->nvme_ns		= sfile.nvme_ns;
+	dtask->nvme_blksz	= sfile.nvme_blksz;
+	dtask->dmareq_maxsz	= sfile.dmareq_maxsz;
+
+	return 0;
+}
+
+/*
+ * strom_dma_task_setup_doorbell - pin the user page of the doorbell, to be
+ * written on completion of the DMA task. Caller must hold a reference of
+ * the DMA task.
+ */
+static int
+strom_dma_task_setup_doorbell(strom_dma_task *dtask,
+							  uint64_t __user *doorbell,
+							  uint64_t doorbell_value)
+{
+	unsigned long	uaddr = (unsigned long)doorbell;
+	struct page	   *page;
+	int				rc;
+
+	if ((uaddr & (sizeof(uint64_t) - 1)) != 0)
+		return -EINVAL;
+	rc = get_user_pages_fast(uaddr & PAGE_MASK, 1, 1, &page);
+	if (rc < 1)
+	{
+		prError("failed on get_user_pages_fast(0x%p, 1) = %d",
+				(void *)(uaddr & PAGE_MASK), rc);
+		return (rc < 0 ? rc : -EFAULT);
+	}
+	/* see the comment at strom_create_dma_progress */
+	if (!PageAnon(page))
+	{
+		prError("doorbell (0x%p) is not on anonymous memory", doorbell);
+		put_page(page);
+		return -EINVAL;
+	}
+	dtask->doorbell_page	= page;
+	dtask->doorbell_offset	= (uaddr & ~PAGE_MASK);
+	dtask->doorbell_value	= doorbell_value;
+
+	return 0;
+}
+
 /*
  * strom_get_dma_task
  */
@@ -757,6 +1629,47 @@ strom_get_dma_task(strom_dma_task *dtask)
 	return dtask;
 }
 
+/*
+ * __strom_dma_task_releasable - true, if nobody references the completed
+ * DMA task any more. Caller must hold the slot lock.
+ */
+static inline bool
+__strom_dma_task_releasable(strom_dma_task *dtask)
+{
+	return (dtask->completed &&
+			dtask->nr_waiters == 0 &&
+			!dtask->ev_pending &&
+			dtask->reaped);
+}
+
+/*
+ * __strom_ring_post_cqe - put a CQE on the completion ring. It returns false
+ * if CQ is full. Caller must hold fstate->lock.
+ */
+static bool
+__strom_ring_post_cqe(strom_file_state *fstate,
+					  unsigned long user_data,
+					  unsigned long dma_task_id,
+					  long status)
+{
+	StromRing__Header *ring = fstate->ring;
+	StromRing__Cqe *cqe;
+	unsigned int	tail = fstate->cq_tail;
+
+	if (tail - ACCESS_ONCE(ring->cq_head) >= fstate->cq_entries)
+		return false;
+	cqe = &fstate->cqes[tail & (fstate->cq_entries - 1)];
+	cqe->user_data		= user_data;
+	cqe->dma_task_id	= dma_task_id;
+	cqe->status			= status;
+	/* CQE must be visible prior to the tail */
+	smp_wmb();
+	fstate->cq_tail = tail + 1;
+	ACCESS_ONCE(ring->cq_tail) = tail + 1;
+
+	return true;
+}
+
 /*
  * strom_put_dma_task
  */
@@ -779,42 +1692,112 @@ strom_put_dma_task(strom_dma_task *dtask, long dma_status)
 	{
 		mapped_gpu_memory  *mgmem = dtask->mgmem;
 		hugepage_dma_buffer *hd_buf = dtask->hd_buf;
+		strom_dma_progress *progress = dtask->progress;
+		struct page		   *doorbell_page = dtask->doorbell_page;
 		struct file		   *ioctl_filp = dtask->ioctl_filp;
 		struct file		   *data_filp = dtask->filp;
+		struct file		  **vec_filps = dtask->vec_filps;
+		unsigned int		nr_vec_filps = dtask->nr_vec_filps;
+		strom_file_state   *fstate = dtask->fstate;
+		unsigned long		dma_task_id = dtask->dma_task_id;
 		long				dma_status;
+		bool				release_dtask = false;
 
 		if (!has_spinlock)
 			spin_lock_irqsave(&strom_dma_task_locks[hindex], flags);
 		/* should be released after the final async job is submitted */
 		Assert(dtask->frozen);
 		/* fetch status under the lock */
+		if (unlikely(dtask->cancelled) && !dtask->dma_status)
+			dtask->dma_status = -ECANCELED;
 		dma_status = dtask->dma_status;
-		/* detach from the global hash table */
-		list_del_rcu(&dtask->chain);
-		/* move to the error task list, if any error */
-		if (unlikely(dma_status))
+		dtask->completed = true;
+		dtask->ioctl_filp = NULL;
+		dtask->filp = NULL;
+		dtask->vec_filps = NULL;
+		dtask->nr_vec_filps = 0;
+		dtask->mgmem = NULL;
+		dtask->hd_buf = NULL;
+		dtask->progress = NULL;
+		dtask->doorbell_page = NULL;
+		/*
+		 * ring the doorbell. It is written under the lock, so MEMCPY_WAIT
+		 * by the consumer who saw the doorbell never misses the completion.
+		 */
+		if (doorbell_page)
+		{
+			char   *kaddr = kmap_atomic(doorbell_page);
+
+			smp_wmb();
+			ACCESS_ONCE(*((u64 *)(kaddr + dtask->doorbell_offset)))
+				= dtask->doorbell_value;
+			kunmap_atomic(kaddr);
+		}
+		/*
+		 * deliver the CQE or completion event, if enabled. @fstate is valid
+		 * here because @ioctl_filp is not released yet.
+		 */
+		if (fstate && dtask->ring_task)
+		{
+			spin_lock(&fstate->lock);
+			if (__strom_ring_post_cqe(fstate,
+									  dtask->ring_user_data,
+									  dtask->dma_task_id,
+									  dma_status))
+				dtask->reaped = true;	/* CQE reports the error */
+			else
+			{
+				list_add_tail(&dtask->ev_chain, &fstate->cq_overflow);
+				dtask->ev_pending = true;
+				fstate->ring->cq_overflow++;
+			}
+			spin_unlock(&fstate->lock);
+			wake_up_interruptible(&fstate->waitq);
+		}
+		else if (fstate && fstate->events_enabled)
 		{
-			dtask->ioctl_filp = NULL;
-			dtask->filp = NULL;
-			dtask->mgmem = NULL;
-			dtask->hd_buf = NULL;
-			list_add_tail_rcu(&dtask->chain, &failed_dma_task_slots[hindex]);
+			spin_lock(&fstate->lock);
+			list_add_tail(&dtask->ev_chain, &fstate->events);
+			dtask->ev_pending = true;
+			spin_unlock(&fstate->lock);
+			wake_up_interruptible(&fstate->waitq);
 		}
+		/* keep tracking the task until its status gets reported */
+		if (dtask->reaped)
+			__strom_untrack_dma_task(dtask);
+		release_dtask = __strom_dma_task_releasable(dtask);
+		/*
+		 * wake up the waiters of this task, if any. It has to be done under
+		 * the lock, because the last waiter may release the task.
+		 */
+		if (dtask->nr_waiters > 0)
+			wake_up_all(&dtask->waitq);
 		spin_unlock_irqrestore(&strom_dma_task_locks[hindex], flags);
-		/* wake up all the waiting tasks, if any */
-		wake_up_all(&strom_dma_task_waitq[hindex]);
 
-		/* release the dtask object, if no error */
-		if (likely(!dma_status))
-			kfree(dtask);
+		/* release the dtask object, if nobody references it */
+		if (release_dtask)
+			strom_free_dma_task(dtask);
 		if (mgmem)
 			strom_put_mapped_gpu_memory(mgmem);
 		if (hd_buf)
 			put_hugepage_dma_buffer(hd_buf);
+		if (progress)
+			strom_release_dma_progress(progress);
+		if (doorbell_page)
+		{
+			set_page_dirty(doorbell_page);
+			put_page(doorbell_page);
+		}
 		fput(data_filp);
+		if (vec_filps)
+		{
+			while (nr_vec_filps > 0)
+				fput(vec_filps[--nr_vec_filps]);
+			kfree(vec_filps);
+		}
 		fput(ioctl_filp);
 
-		prDebug("DMA task (id=%p) was completed", dtask);
+		prDebug("DMA task (id=%lu) was completed", dma_task_id);
 	}
 	else if (has_spinlock)
 		spin_unlock_irqrestore(&strom_dma_task_locks[hindex], flags);
@@ -916,216 +1899,722 @@ strom_raid0_map_sector(struct mddev *mddev,
  * command. It tries to walk on a list of pre-allocated pages under spinlock.
  * Concurrent workload easily grows length of the list up, then duration of
  * the critical section makes longer.
- * In case of NVMe-Strom, length of PRPs list is about (128KB / PAGE_SIZE)
- * entries. So, we can pre-allocate fixed-length PRPs-list buffer, and we can
- * look-up inactive buffer with one step.
+ * In case of NVMe-Strom, length of PRPs list is at most
+ * (NVMESSD_DMAREQ_LIMIT / PAGE_SIZE) entries. So, we can pre-allocate
+ * fixed-length PRPs-list buffer, and we can look-up inactive buffer with
+ * one step. PRPs list longer than a page is chained to the next list page
+ * using the last entry of the page, within a continuous buffer.
+ *
+ * Inactive buffers are kept in the per-CPU lock-free list. Only the local
+ * CPU pops an item (with preemption disabled), and completion callback
+ * pushes the item back to the list of the CPU where the callback runs, so
+ * no cacheline is shared across CPUs in the hot path. Items more than
+ * @prps_cache_depth on a CPU are moved to the global overflow list, then
+ * reused by other CPUs prior to dma_alloc_coherent().
+ *
+ * PRPs list buffers are allocated for each NVMe controller through its own
+ * struct device, thus, on the NUMA node where the controller is installed.
+ * The controller fetches PRPs list without crossing the inter-socket link.
  */
+struct strom_prps_pool;
+
+/* entries for the unaligned head, and chain pointers for each list page */
+#define STROM_PRPS_ITEM_NENTRIES								\
+	(NVMESSD_DMAREQ_LIMIT / PAGE_SIZE + 1 +						\
+	 NVMESSD_DMAREQ_LIMIT / PAGE_SIZE / (PAGE_SIZE / sizeof(__le64) - 1) + 1)
+
 struct strom_prps_item
 {
-	struct list_head	chain;
+	struct llist_node	lnode;
+	struct strom_prps_pool *pool;	/* pool where this item belongs to */
 	dma_addr_t			pitem_dma;	/* physical address of this structure */
-	unsigned int		cpu_id;	/* index to strom_prps_locks/slots */
 	unsigned int		nrooms;	/* size of prps_list[] array */
-	unsigned int		nitems;	/* usage count of prps_list[] array */
-	__le64				prps_list[NVMESSD_DMAREQ_MAXSZ / PAGE_SIZE + 1];
+	unsigned int		nitems;	/* usage count of prps_list[] array, or
+								 * # of SGL descriptors if sgl_mode */
+	bool				sgl_mode; /* prps_list[] contains SGL descriptors */
+	__le64				prps_list[STROM_PRPS_ITEM_NENTRIES];
 };
 typedef struct strom_prps_item		strom_prps_item;
-#define STROM_PRPS_ITEMS_NSLOTS		32
-static struct device   *strom_prps_device = NULL;
-static spinlock_t		strom_prps_locks[STROM_PRPS_ITEMS_NSLOTS];
-static struct list_head	strom_prps_slots[STROM_PRPS_ITEMS_NSLOTS];
 
-static __init int
-strom_find_pci_device(struct device *dev, void *data)
+struct strom_prps_cache
 {
-	struct pci_dev	   *pci_device = to_pci_dev(dev);
-    struct pci_driver  *nvme_driver = (struct pci_driver *) data;
+	struct llist_head	free_list;	/* inactive items on this CPU */
+	unsigned int		nitems;		/* # of items in the free_list */
+};
+typedef struct strom_prps_cache		strom_prps_cache;
 
-	if (nvme_driver)
-	{
-		if (pci_device->driver == nvme_driver)
-			return 1;
-		return 0;
-	}
-	return 1;
-}
+struct strom_prps_pool
+{
+	struct list_head	chain;
+	struct device	   *device;		/* device of the NVMe controller */
+	strom_prps_cache __percpu *caches;
+	spinlock_t			overflow_lock;
+	struct llist_head	overflow;	/* items beyond the per-CPU cache */
+};
+typedef struct strom_prps_pool		strom_prps_pool;
 
-static __init int
-strom_init_prps_item_buffer(void)
+static int	prps_cache_depth = 8;
+module_param(prps_cache_depth, int, 0444);
+MODULE_PARM_DESC(prps_cache_depth, "# of PRPs list buffers pre-allocated and cached per CPU");
+
+static spinlock_t		strom_prps_pools_lock;
+static struct list_head	strom_prps_pools;
+
+static strom_prps_item *
+__strom_prps_item_create(strom_prps_pool *pool, gfp_t gfp_mask)
 {
-    struct device_driver   *dev_driver;
-	int		i;
+	strom_prps_item	   *pitem;
+	dma_addr_t			pitem_dma;
 
-	/*
-	 * Try to acquire a PCI device which is likely NVMe-SSD.
-	 */
-	dev_driver = driver_find("nvme", &pci_bus_type);
-	if (dev_driver)
-	{
-		strom_prps_device = bus_find_device(&pci_bus_type, NULL,
-											to_pci_driver(dev_driver),
-											strom_find_pci_device);
-	}
-	if (!strom_prps_device)
-		strom_prps_device = bus_find_device(&pci_bus_type, NULL, NULL,
-											strom_find_pci_device);
-	if (!strom_prps_device)
+	pitem = dma_alloc_coherent(pool->device,
+							   sizeof(strom_prps_item),
+							   &pitem_dma,
+							   gfp_mask);
+	if (pitem)
 	{
-		prError("No PCI device found, thus unable to get entry to alloc/free coherent memory for DMA");
-		return -ENOENT;
+		pitem->lnode.next = NULL;
+		pitem->pool = pool;
+		pitem->pitem_dma = pitem_dma;
+		pitem->nrooms = STROM_PRPS_ITEM_NENTRIES;
+		pitem->nitems = 0;
+		pitem->sgl_mode = false;
 	}
+	return pitem;
+}
+
+static void
+__strom_prps_item_release(struct llist_node *lnode)
+{
+	strom_prps_item	   *pitem;
+	struct llist_node  *next;
 
-	/* init strom_prps_locks/slots */
-	for (i=0; i < STROM_PRPS_ITEMS_NSLOTS; i++)
+	while (lnode)
 	{
-		spin_lock_init(&strom_prps_locks[i]);
-		INIT_LIST_HEAD(&strom_prps_slots[i]);
+		next = lnode->next;
+		pitem = llist_entry(lnode, strom_prps_item, lnode);
+		dma_free_coherent(pitem->pool->device,
+						  sizeof(strom_prps_item),
+						  pitem,
+						  pitem->pitem_dma);
+		lnode = next;
 	}
-	return 0;
 }
 
 static void
-strom_exit_prps_item_buffer(void)
+strom_destroy_prps_pool(strom_prps_pool *pool)
 {
-	int		index;
+	strom_prps_cache   *cache;
+	int					cpu;
 
-	for (index=0; index < STROM_PRPS_ITEMS_NSLOTS; index++)
+	if (pool->caches)
 	{
-		spinlock_t		   *lock = &strom_prps_locks[index];
-		struct list_head   *slot = &strom_prps_slots[index];
-		unsigned long		flags;
-		strom_prps_item	   *pitem;
-
-		spin_lock_irqsave(lock, flags);
-		while (!list_empty(slot))
+		for_each_possible_cpu(cpu)
 		{
-			pitem = list_first_entry(slot, strom_prps_item, chain);
-			list_del(&pitem->chain);
-			spin_unlock_irqrestore(lock, flags);
-
-			dma_free_coherent(strom_prps_device,
-							  sizeof(strom_prps_item),
-							  pitem,
-							  pitem->pitem_dma);
-			spin_lock_irqsave(lock, flags);
+			cache = per_cpu_ptr(pool->caches, cpu);
+			__strom_prps_item_release(llist_del_all(&cache->free_list));
+			cache->nitems = 0;
 		}
-		spin_unlock_irqrestore(lock, flags);
+		free_percpu(pool->caches);
 	}
-	put_device(strom_prps_device);
+	__strom_prps_item_release(llist_del_all(&pool->overflow));
+	put_device(pool->device);
+	kfree(pool);
 }
 
-static strom_prps_item *
-strom_prps_item_alloc(void)
+/*
+ * strom_create_prps_pool - create a PRPs pool for the supplied device, then
+ * pre-warm the cache of the CPUs on the same NUMA node.
+ */
+static strom_prps_pool *
+strom_create_prps_pool(struct device *device)
 {
-	int					index = smp_processor_id() % STROM_PRPS_ITEMS_NSLOTS;
-	spinlock_t		   *lock = &strom_prps_locks[index];
-	struct list_head   *slot = &strom_prps_slots[index];
-	unsigned long		flags;
-	dma_addr_t			pitem_dma;
+	strom_prps_pool	   *pool;
+	strom_prps_pool	   *temp;
+	strom_prps_cache   *cache;
 	strom_prps_item	   *pitem;
+	int					node_id = dev_to_node(device);
+	int					cpu, i;
+	unsigned long		flags;
 
-	spin_lock_irqsave(lock, flags);
-	if (!list_empty(slot))
+	pool = kzalloc_node(sizeof(strom_prps_pool), GFP_KERNEL, node_id);
+	if (!pool)
+		return NULL;
+	pool->device = get_device(device);
+	spin_lock_init(&pool->overflow_lock);
+	init_llist_head(&pool->overflow);
+	pool->caches = alloc_percpu(strom_prps_cache);
+	if (!pool->caches)
 	{
-		pitem = list_first_entry(slot, strom_prps_item, chain);
-		list_del(&pitem->chain);
-		memset(&pitem->chain, 0, sizeof(struct list_head));
-		spin_unlock_irqrestore(lock, flags);
-		return pitem;
+		strom_destroy_prps_pool(pool);
+		return NULL;
 	}
-	spin_unlock_irqrestore(lock, flags);
-	/* no available prps_item, so create a new one */
-	pitem = dma_alloc_coherent(strom_prps_device,
-							   sizeof(strom_prps_item),
-							   &pitem_dma,
-							   GFP_KERNEL);
-	if (pitem)
+	for_each_possible_cpu(cpu)
 	{
-		memset(&pitem->chain, 0, sizeof(struct list_head));
-		pitem->pitem_dma = pitem_dma;
-		pitem->cpu_id = smp_processor_id();
-		pitem->nrooms = NVMESSD_DMAREQ_MAXSZ / PAGE_SIZE + 1;
-		pitem->nitems = 0;
+		cache = per_cpu_ptr(pool->caches, cpu);
+		init_llist_head(&cache->free_list);
+		cache->nitems = 0;
 	}
-	return pitem;
-}
 
-static void
-strom_prps_item_free(strom_prps_item *pitem)
-{
-	int					index = pitem->cpu_id % STROM_PRPS_ITEMS_NSLOTS;
-	spinlock_t		   *lock = &strom_prps_locks[index];
-	struct list_head   *slot = &strom_prps_slots[index];
-	unsigned long		flags;
+	for_each_online_cpu(cpu)
+	{
+		if (node_id != NUMA_NO_NODE && cpu_to_node(cpu) != node_id)
+			continue;
+		cache = per_cpu_ptr(pool->caches, cpu);
+		for (i=0; i < prps_cache_depth; i++)
+		{
+			pitem = __strom_prps_item_create(pool, GFP_KERNEL);
+			if (!pitem)
+			{
+				strom_destroy_prps_pool(pool);
+				return NULL;
+			}
+			llist_add(&pitem->lnode, &cache->free_list);
+			cache->nitems++;
+		}
+	}
 
-	Assert(!pitem->chain.next && !pitem->chain.prev);
-	spin_lock_irqsave(lock, flags);
-	list_add(&pitem->chain, slot);
-	spin_unlock_irqrestore(lock, flags);
-}
+	/* someone might create the pool concurrently */
+	spin_lock_irqsave(&strom_prps_pools_lock, flags);
+	list_for_each_entry(temp, &strom_prps_pools, chain)
+	{
+		if (temp->device == device)
+		{
+			spin_unlock_irqrestore(&strom_prps_pools_lock, flags);
+			strom_destroy_prps_pool(pool);
+			return temp;
+		}
+	}
+	list_add_tail_rcu(&pool->chain, &strom_prps_pools);
+	spin_unlock_irqrestore(&strom_prps_pools_lock, flags);
 
-/*
- * DMA transaction for SSD->GPU asynchronous copy
- */
-struct strom_async_cmd_context {
-	strom_prps_item	   *pitem;
-	strom_dma_task	   *dtask;
-	struct mddev	   *mddev;	/* md-raid0 device, if any */
-	struct nvme_command	cmd;	/* NVMe command */
-	uint64_t			tv1;	/* TSC value when DMA submit */
-	uint32_t			nr_sectors;
-};
-typedef struct strom_async_cmd_context strom_async_cmd_context;
+	prInfo("PRPs pool was created for %s (node=%d)",
+		   dev_name(device), node_id);
+	return pool;
+}
 
 /*
- * __callback_async_read_cmd - callback of async READ command
+ * strom_lookup_prps_pool - find the PRPs pool of the NVMe controller, or
+ * create a new one if not yet (e.g, hot-plugged device).
  */
-static void
-__callback_async_read_cmd(struct request *req, int error)
+static strom_prps_pool *
+strom_lookup_prps_pool(struct nvme_ctrl *nvme_ctrl)
 {
-	strom_async_cmd_context *async_cxt = req->end_io_data;
-	u32		result = (uintptr_t)req->special;
-	u16		status = req->errors;
-	u64		tv1 = async_cxt->tv1;
-	u64		tv2 = rdtsc();
+	struct device	   *device = nvme_ctrl->dev;
+	strom_prps_pool	   *pool;
 
-	prDebug("DMA Req Completed error=%d status=%d result=%u",
-			error, status, result);
-	/* update statistics */
-	if (stat_info)
+	rcu_read_lock();
+	list_for_each_entry_rcu(pool, &strom_prps_pools, chain)
 	{
-		atomic64_inc(&stat_nr_ssd2gpu);
-		atomic64_add((u64)(tv2 > tv1 ? tv2 - tv1 : 0), &stat_clk_ssd2gpu);
-		atomic64_dec(&stat_cur_dma_count);
+		if (pool->device == device)
+		{
+			rcu_read_unlock();
+			return pool;
+		}
 	}
-	/* update common statistics, if success */
-	if (!status)
-	{
-		struct hd_struct *part = &req->rq_disk->part0;
-		strom_dma_task *dtask = async_cxt->dtask;
-		unsigned long	duration = jiffies - req->start_time;
-		unsigned int	nr_sectors = async_cxt->nr_sectors;
-		int				cpu = part_stat_lock();
+	rcu_read_unlock();
 
-		part_stat_add(cpu, part, sectors[0], nr_sectors);
-		part_stat_inc(cpu, part, ios[0]);
-		part_stat_add(cpu, part, ticks[0], duration);
+	return strom_create_prps_pool(device);
+}
 
-		/* also update statistics of md-raid0 device */
-		if (dtask->mddev)
-		{
-			struct gendisk *md_disk = dtask->mddev->gendisk;
+static void
+strom_exit_prps_item_buffer(void)
+{
+	strom_prps_pool	   *pool;
 
-			part_stat_add(cpu, &md_disk->part0, sectors[0], nr_sectors);
-			part_stat_inc(cpu, &md_disk->part0, ios[0]);
-			part_stat_add(cpu, &md_disk->part0, ticks[0], duration);
-		}
-		part_stat_unlock();
+	while (!list_empty(&strom_prps_pools))
+	{
+		pool = list_first_entry(&strom_prps_pools, strom_prps_pool, chain);
+		list_del_rcu(&pool->chain);
+		synchronize_rcu();
+		strom_destroy_prps_pool(pool);
+	}
+}
+
+static int
+strom_init_prps_pool_callback(struct device *dev, void *data)
+{
+	struct pci_dev	   *pci_device = to_pci_dev(dev);
+	struct pci_driver  *nvme_driver = (struct pci_driver *) data;
+
+	if (pci_device->driver == nvme_driver &&
+		!strom_create_prps_pool(dev))
+		return -ENOMEM;
+	return 0;
+}
+
+static __init int
+strom_init_prps_item_buffer(void)
+{
+	struct device_driver   *dev_driver;
+	int		rc = 0;
+
+	spin_lock_init(&strom_prps_pools_lock);
+	INIT_LIST_HEAD(&strom_prps_pools);
+
+	/*
+	 * Create PRPs pool for each NVMe controller; hot-plugged controllers
+	 * shall be added on demand.
+	 */
+	dev_driver = driver_find("nvme", &pci_bus_type);
+	if (dev_driver)
+		rc = bus_for_each_dev(&pci_bus_type, NULL,
+							  to_pci_driver(dev_driver),
+							  strom_init_prps_pool_callback);
+	if (rc)
+		strom_exit_prps_item_buffer();
+	else if (list_empty(&strom_prps_pools))
+		prNotice("No NVMe controller found, PRPs pool shall be created on demand");
+	return rc;
+}
+
+static strom_prps_item *
+strom_prps_item_alloc(struct nvme_ctrl *nvme_ctrl)
+{
+	strom_prps_pool	   *pool;
+	strom_prps_cache   *cache;
+	struct llist_node  *lnode;
+	unsigned long		flags;
+
+	pool = strom_lookup_prps_pool(nvme_ctrl);
+	if (!pool)
+		return NULL;
+
+	/* fast path - local CPU is the only consumer of the free_list */
+	cache = get_cpu_ptr(pool->caches);
+	lnode = llist_del_first(&cache->free_list);
+	if (lnode)
+		this_cpu_dec(pool->caches->nitems);
+	put_cpu_ptr(pool->caches);
+	if (lnode)
+		goto found;
+
+	/* second path - reuse an item in the overflow list */
+	if (!llist_empty(&pool->overflow))
+	{
+		spin_lock_irqsave(&pool->overflow_lock, flags);
+		lnode = llist_del_first(&pool->overflow);
+		spin_unlock_irqrestore(&pool->overflow_lock, flags);
+		if (lnode)
+			goto found;
+	}
+	/* no available prps_item, so create a new one */
+	return __strom_prps_item_create(pool, GFP_KERNEL);
+
+found:
+	lnode->next = NULL;
+	return llist_entry(lnode, strom_prps_item, lnode);
+}
+
+static void
+strom_prps_item_free(strom_prps_item *pitem)
+{
+	strom_prps_pool	   *pool = pitem->pool;
+	strom_prps_cache   *cache;
+	bool				overflow = false;
+
+	Assert(!pitem->lnode.next);
+	pitem->nitems = 0;
+	cache = get_cpu_ptr(pool->caches);
+	if (this_cpu_read(pool->caches->nitems) < prps_cache_depth)
+	{
+		llist_add(&pitem->lnode, &cache->free_list);
+		this_cpu_inc(pool->caches->nitems);
+	}
+	else
+		overflow = true;
+	put_cpu_ptr(pool->caches);
+
+	if (overflow)
+		llist_add(&pitem->lnode, &pool->overflow);
+}
+
+/*
+ * Scratch page to read through the gap between extents
+ *
+ * If two runs of sectors are separated by a small hole on the device, it is
+ * often cheaper to read the hole together than to issue two READ commands.
+ * Sectors in the hole shall be written to the scratch page, then discarded.
+ * All the PRP entries for the hole point to the same page, and nobody reads
+ * its contents, so concurrent DMA on the same page is harmless. We have one
+ * scratch page per CPU on its local NUMA node, to avoid remote memory access.
+ */
+static DEFINE_PER_CPU(struct page *, strom_scratch_page);
+
+static __init int
+strom_init_scratch_pages(void)
+{
+	struct page	   *page;
+	int				cpu;
+
+	for_each_possible_cpu(cpu)
+	{
+		page = alloc_pages_node(cpu_to_node(cpu),
+								GFP_KERNEL | __GFP_ZERO, 0);
+		if (!page)
+		{
+			prError("failed on alloc_pages_node for scratch page");
+			goto error;
+		}
+		per_cpu(strom_scratch_page, cpu) = page;
+	}
+	return 0;
+
+error:
+	for_each_possible_cpu(cpu)
+	{
+		page = per_cpu(strom_scratch_page, cpu);
+		if (page)
+			__free_page(page);
+		per_cpu(strom_scratch_page, cpu) = NULL;
+	}
+	return -ENOMEM;
+}
+
+static void
+strom_exit_scratch_pages(void)
+{
+	struct page	   *page;
+	int				cpu;
+
+	for_each_possible_cpu(cpu)
+	{
+		page = per_cpu(strom_scratch_page, cpu);
+		if (page)
+			__free_page(page);
+		per_cpu(strom_scratch_page, cpu) = NULL;
+	}
+}
+
+static inline phys_addr_t
+strom_scratch_page_paddr(void)
+{
+	return page_to_phys(per_cpu(strom_scratch_page, raw_smp_processor_id()));
+}
+
+/*
+ * NVMe SGL (Scatter Gather List) support
+ *
+ * PRPs list needs one entry per controller page even if destination is
+ * physically continuous; e.g, 64 entries for 256KB read. If controller
+ * supports SGL, a physically continuous range of the destination can be
+ * described by a single data block descriptor. Only RHEL7.4 or later
+ * exposes the SGL capability of the controller, so we use PRPs list on
+ * the older kernel, and also as a fallback when descriptors run out.
+ */
+#if RHEL_KERNEL_RELEASE_NUM >= 704000
+#define STROM_SUPPORT_NVME_SGL		1
+#endif
+
+typedef struct strom_sgl_desc
+{
+	__le64		addr;
+	__le32		length;
+	__u8		rsvd[3];
+	__u8		type;
+} strom_sgl_desc;
+
+#define STROM_SGL_TYPE__DATA_BLOCK		0x00
+#define STROM_SGL_TYPE__BIT_BUCKET		0x10
+#define STROM_SGL_TYPE__LAST_SEGMENT	0x30
+/* PSDT=01b; SGLs are used for the data transfer */
+#define STROM_NVME_CMD_FLAGS__SGL		(1 << 6)
+
+static int	nvme_sgl = 1;
+module_param(nvme_sgl, int, 0644);
+MODULE_PARM_DESC(nvme_sgl, "turn on/off SGL data pointer if NVMe controller supports");
+
+static inline bool
+strom_nvme_ctrl_support_sgl(struct nvme_ctrl *nvme_ctrl)
+{
+#ifdef STROM_SUPPORT_NVME_SGL
+	return (nvme_sgl && (nvme_ctrl->sgls & 0x0003) != 0);
+#else
+	return false;
+#endif
+}
+
+static inline bool
+strom_nvme_ctrl_support_bitbucket(struct nvme_ctrl *nvme_ctrl)
+{
+#ifdef STROM_SUPPORT_NVME_SGL
+	return (nvme_sgl && (nvme_ctrl->sgls & 0x0003) != 0 &&
+			(nvme_ctrl->sgls & (1U << 16)) != 0);
+#else
+	return false;
+#endif
+}
+
+/*
+ * strom_prps_item_append - append a physically continuous range of the
+ * destination to the PRPs item. In PRP mode, the range is split into the
+ * entries per controller page; layout of the destination segments ensures
+ * all the entries but the first one are page aligned. In SGL mode, the range
+ * is merged to the last data block descriptor if continuous. It returns
+ * false if no room any more.
+ */
+static bool
+strom_prps_item_append(strom_prps_item *pitem,
+					   struct nvme_ctrl *nvme_ctrl,
+					   u64 paddr, size_t length)
+{
+	u32		nvme_page_size = nvme_ctrl->page_size;
+
+	if (pitem->sgl_mode)
+	{
+		strom_sgl_desc *sgl = (strom_sgl_desc *)pitem->prps_list;
+		strom_sgl_desc *last = (pitem->nitems > 0
+								? &sgl[pitem->nitems - 1] : NULL);
+
+		if (last && last->type == STROM_SGL_TYPE__DATA_BLOCK &&
+			le64_to_cpu(last->addr) + le32_to_cpu(last->length) == paddr)
+		{
+			le32_add_cpu(&last->length, length);
+			return true;
+		}
+		if (2 * (pitem->nitems + 1) > pitem->nrooms)
+			return false;
+		last = &sgl[pitem->nitems++];
+		memset(last, 0, sizeof(strom_sgl_desc));
+		last->addr		= cpu_to_le64(paddr);
+		last->length	= cpu_to_le32(length);
+		last->type		= STROM_SGL_TYPE__DATA_BLOCK;
+		return true;
+	}
+
+	while (length > 0)
+	{
+		size_t		len = Min(length, (nvme_page_size -
+									   (paddr & (nvme_page_size - 1))));
+		dma_addr_t	curr_dma = (pitem->pitem_dma +
+								offsetof(strom_prps_item, prps_list) +
+								sizeof(__le64) * pitem->nitems);
+
+		if (pitem->nitems >= pitem->nrooms)
+			return false;
+		/*
+		 * PRPs list must not go across the controller page, so the last
+		 * entry of the list page has to be a pointer to the next list page.
+		 * prps_list[0] is PRP1 and is not a part of the list.
+		 */
+		if (pitem->nitems > 1 && (curr_dma & (nvme_page_size - 1)) == 0)
+		{
+			if (pitem->nitems + 1 >= pitem->nrooms)
+				return false;
+			pitem->prps_list[pitem->nitems] =
+				pitem->prps_list[pitem->nitems - 1];
+			pitem->prps_list[pitem->nitems - 1] = curr_dma;
+			pitem->nitems++;
+		}
+		pitem->prps_list[pitem->nitems++] = paddr;
+		paddr += len;
+		length -= len;
+	}
+	return true;
+}
+
+/*
+ * strom_prps_item_append_gap - append the gap to be read through; a bit
+ * bucket descriptor if controller supports, or the scratch page elsewhere.
+ */
+static bool
+strom_prps_item_append_gap(strom_prps_item *pitem,
+						   struct nvme_ctrl *nvme_ctrl,
+						   size_t length)
+{
+	phys_addr_t	scratch;
+
+	if (pitem->sgl_mode && strom_nvme_ctrl_support_bitbucket(nvme_ctrl))
+	{
+		strom_sgl_desc *sgl = (strom_sgl_desc *)pitem->prps_list;
+		strom_sgl_desc *last;
+
+		if (2 * (pitem->nitems + 1) > pitem->nrooms)
+			return false;
+		last = &sgl[pitem->nitems++];
+		memset(last, 0, sizeof(strom_sgl_desc));
+		last->length	= cpu_to_le32(length);
+		last->type		= STROM_SGL_TYPE__BIT_BUCKET;
+		return true;
+	}
+
+	/* SGL descriptors are never merged, because scratch is a page */
+	scratch = strom_scratch_page_paddr();
+	for (; length > 0; length -= PAGE_SIZE)
+	{
+		if (!strom_prps_item_append(pitem, nvme_ctrl, scratch, PAGE_SIZE))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * DMA transaction for SSD->GPU asynchronous copy
+ */
+struct strom_async_cmd_context {
+	strom_prps_item	   *pitem;
+	strom_dma_task	   *dtask;
+	struct mddev	   *mddev;	/* md-raid0 device, if any */
+	struct nvme_command	cmd;	/* NVMe command */
+	uint64_t			tv1;	/* TSC value when DMA submit */
+	uint32_t			nr_sectors;
+	/* copy of the destination segments, only if progress map is enabled */
+	unsigned int		nr_dest_segs;
+	strom_dma_segment	dest_segs[STROM_DMA_TASK_NSEGS];
+};
+typedef struct strom_async_cmd_context strom_async_cmd_context;
+
+static int	reserved_cmd_contexts = 256;
+module_param(reserved_cmd_contexts, int, 0444);
+MODULE_PARM_DESC(reserved_cmd_contexts, "# of NVMe command contexts reserved for forward progress under memory pressure");
+
+static struct kmem_cache *strom_async_cmd_cachep = NULL;
+static mempool_t		*strom_async_cmd_mempool = NULL;
+
+static void
+strom_exit_mempools(void)
+{
+	if (strom_async_cmd_mempool)
+		mempool_destroy(strom_async_cmd_mempool);
+	if (strom_async_cmd_cachep)
+		kmem_cache_destroy(strom_async_cmd_cachep);
+	/* wait for the DMA tasks released by RCU callback */
+	rcu_barrier();
+	if (strom_dma_task_mempool)
+		mempool_destroy(strom_dma_task_mempool);
+	if (strom_dma_task_cachep)
+		kmem_cache_destroy(strom_dma_task_cachep);
+	strom_async_cmd_mempool = NULL;
+	strom_async_cmd_cachep = NULL;
+	strom_dma_task_mempool = NULL;
+	strom_dma_task_cachep = NULL;
+}
+
+static __init int
+strom_init_mempools(void)
+{
+	strom_dma_task_cachep = KMEM_CACHE(strom_dma_task, 0);
+	if (!strom_dma_task_cachep)
+		goto error;
+	strom_dma_task_mempool =
+		mempool_create_slab_pool(STROM_DMA_TASK_MEMPOOL_MIN,
+								 strom_dma_task_cachep);
+	if (!strom_dma_task_mempool)
+		goto error;
+
+	strom_async_cmd_cachep = KMEM_CACHE(strom_async_cmd_context,
+										SLAB_HWCACHE_ALIGN);
+	if (!strom_async_cmd_cachep)
+		goto error;
+	strom_async_cmd_mempool =
+		mempool_create_slab_pool(Max(reserved_cmd_contexts, 1),
+								 strom_async_cmd_cachep);
+	if (!strom_async_cmd_mempool)
+		goto error;
+
+	return 0;
+
+error:
+	prError("failed on creation of slab caches or mempools");
+	strom_exit_mempools();
+	return -ENOMEM;
+}
+
+/*
+ * __callback_async_read_cmd - callback of async READ command
+ */
+static void
+__callback_async_read_cmd(struct request *req, int error)
+{
+	strom_async_cmd_context *async_cxt = req->end_io_data;
+	u32		result = (uintptr_t)req->special;
+	u16		status = req->errors;
+
+	prDebug("DMA Req Completed error=%d status=%d result=%u",
+			error, status, result);
+	/* update statistics */
+	if (stat_info)
+	{
+		u64		tv1 = async_cxt->tv1;
+		u64		tv2 = rdtsc();
+
+		this_cpu_inc(stat_nr_ssd2gpu);
+		this_cpu_add(stat_clk_ssd2gpu, (u64)(tv2 > tv1 ? tv2 - tv1 : 0));
+		atomic64_dec(&stat_cur_dma_count);
+	}
+	/* update common statistics, if success */
+	if (!status)
+	{
+		struct hd_struct *part = &req->rq_disk->part0;
+		strom_dma_task *dtask = async_cxt->dtask;
+		unsigned long	duration = jiffies - req->start_time;
+		unsigned int	nr_sectors = async_cxt->nr_sectors;
+		int				cpu = part_stat_lock();
+
+		part_stat_add(cpu, part, sectors[0], nr_sectors);
+		part_stat_inc(cpu, part, ios[0]);
+		part_stat_add(cpu, part, ticks[0], duration);
+
+		/* also update statistics of md-raid0 device */
+		if (dtask->mddev)
+		{
+			struct gendisk *md_disk = dtask->mddev->gendisk;
+
+			part_stat_add(cpu, &md_disk->part0, sectors[0], nr_sectors);
+			part_stat_inc(cpu, &md_disk->part0, ios[0]);
+			part_stat_add(cpu, &md_disk->part0, ticks[0], duration);
+		}
+		part_stat_unlock();
+	}
+	/* report the landed chunks, if progress map is enabled */
+	if (async_cxt->nr_dest_segs > 0)
+	{
+		strom_dma_progress *dprog = async_cxt->dtask->progress;
+		unsigned int	i;
+
+		for (i=0; !status && i < async_cxt->nr_dest_segs; i++)
+		{
+			strom_dma_segment *dseg = &async_cxt->dest_segs[i];
+
+			if (dseg->offset != STROM_DMA_SEGMENT__GAP)
+				strom_dma_progress_land(dprog, dseg->offset,
+										(size_t)dseg->nr_sects << SECTOR_SHIFT);
+		}
+	}
+	strom_prps_item_free(async_cxt->pitem);
+	strom_put_dma_task(async_cxt->dtask, status);
+	mempool_free(async_cxt, strom_async_cmd_mempool);
+	blk_mq_free_request(req);
+}
+
+/*
+ * Batch submission of NVMe commands
+ *
+ * Requests of a DMA task are inserted to the hardware queue without kick,
+ * then the queue is run once per submit_batch_sz requests, on switch of the
+ * NVMe-SSD device, and at the end of ioctl(2). It reduces the doorbell
+ * writes of NVMe-SSD. It needs optional kernel symbols; see extra_ksyms.c.
+ * Requests not kicked yet hold tags of the queue, so the batch size is
+ * clamped to a quarter of the queue depth; concurrent submitters must not
+ * exhaust the tags and block in nvme_alloc_request().
+ */
+static int	submit_batch_sz = 16;
+module_param(submit_batch_sz, int, 0644);
+MODULE_PARM_DESC(submit_batch_sz, "max number of NVMe commands to be kicked at once (0 disables batch submission)");
+
+/*
+ * strom_dma_task_unplug - kick the requests inserted but not kicked yet.
+ * Caller must call it after the submission of requests, prior to release
+ * of the DMA task.
+ */
+static void
+strom_dma_task_unplug(strom_dma_task *dtask)
+{
+	if (dtask->batch_queue)
+	{
+		__blk_mq_run_hw_queues(dtask->batch_queue, false);
+		dtask->batch_queue = NULL;
+		dtask->batch_nr = 0;
 	}
-	strom_prps_item_free(async_cxt->pitem);
-	strom_put_dma_task(async_cxt->dtask, status);
-	kfree(async_cxt);
-	blk_mq_free_request(req);
 }
 
 /*
@@ -1147,8 +2636,9 @@ __submit_async_read_cmd(strom_dma_task *dtask, strom_prps_item *pitem)
 	u32						dsmgmt = 0;
 	u32						nblocks;
 	u64						slba;
-	dma_addr_t				prp1, prp2;
+	dma_addr_t				prp1 = 0, prp2 = 0;
 	int						npages;
+	int						batch_sz;
 
 	/* setup scatter-gather list */
 	length = (size_t)dtask->nr_sectors << SECTOR_SHIFT;
@@ -1161,24 +2651,37 @@ __submit_async_read_cmd(strom_dma_task *dtask, strom_prps_item *pitem)
 	}
 	slba = (dtask->head_sector << SECTOR_SHIFT) >> nvme_ns->lba_shift;
 
-	prp1 = pitem->prps_list[0];
-	npages = ((prp1 & (nvme_page_size - 1)) + length - 1) / nvme_page_size;
-	if (npages < 1)
-		prp2 = 0;	/* reserved */
-	else if (npages < 2)
-		prp2 = pitem->prps_list[1];
-	else
-		prp2 = pitem->pitem_dma + offsetof(strom_prps_item, prps_list[1]);
+	if (!pitem->sgl_mode)
+	{
+		prp1 = pitem->prps_list[0];
+		npages = ((prp1 & (nvme_page_size - 1)) +
+				  length - 1) / nvme_page_size;
+		if (npages < 1)
+			prp2 = 0;	/* reserved */
+		else if (npages < 2)
+			prp2 = pitem->prps_list[1];
+		else
+			prp2 = pitem->pitem_dma + offsetof(strom_prps_item,
+											   prps_list[1]);
+	}
 
 	/* private datum of async DMA call */
-	async_cmd_cxt = kzalloc(sizeof(strom_async_cmd_context), GFP_KERNEL);
+	async_cmd_cxt = mempool_alloc(strom_async_cmd_mempool, GFP_KERNEL);
 	if (!async_cmd_cxt)
 		return -ENOMEM;
+	memset(async_cmd_cxt, 0, offsetof(strom_async_cmd_context, dest_segs));
+	if (dtask->progress)
+	{
+		Assert(dtask->nr_dest_segs <= STROM_DMA_TASK_NSEGS);
+		memcpy(async_cmd_cxt->dest_segs, dtask->dest_segs,
+			   sizeof(strom_dma_segment) * dtask->nr_dest_segs);
+		async_cmd_cxt->nr_dest_segs = dtask->nr_dest_segs;
+	}
 
 	/* setup READ command */
 	cmd = &async_cmd_cxt->cmd.rw;
 	cmd->opcode		= nvme_cmd_read;
-	cmd->flags		= 0;	/* we use PRPs, rather than SGL */
+	cmd->flags		= 0;	/* we use PRPs, unless SGL is available */
 	cmd->command_id	= 0;	/* set by nvme driver later */
 	cmd->nsid		= cpu_to_le32(nvme_ns->ns_id);
 #if RHEL_KERNEL_RELEASE_NUM < 704000
@@ -1187,6 +2690,28 @@ __submit_async_read_cmd(strom_dma_task *dtask, strom_prps_item *pitem)
 #else
 	cmd->dptr.prp1	= cpu_to_le64(prp1);
 	cmd->dptr.prp2	= cpu_to_le64(prp2);
+#endif
+#ifdef STROM_SUPPORT_NVME_SGL
+	if (pitem->sgl_mode)
+	{
+		strom_sgl_desc *dptr = (strom_sgl_desc *)&cmd->dptr;
+		strom_sgl_desc *sgl = (strom_sgl_desc *)pitem->prps_list;
+
+		Assert(pitem->nitems > 0);
+		if (pitem->nitems == 1)
+			memcpy(dptr, sgl, sizeof(strom_sgl_desc));
+		else
+		{
+			/* SGL segment that contains only the last descriptors */
+			memset(dptr, 0, sizeof(strom_sgl_desc));
+			dptr->addr = cpu_to_le64(pitem->pitem_dma +
+									 offsetof(strom_prps_item, prps_list));
+			dptr->length = cpu_to_le32(sizeof(strom_sgl_desc) *
+									   pitem->nitems);
+			dptr->type = STROM_SGL_TYPE__LAST_SEGMENT;
+		}
+		cmd->flags	= STROM_NVME_CMD_FLAGS__SGL;
+	}
 #endif
 	cmd->metadata	= 0;	/* XXX integrity check, if needed */
 	cmd->slba		= cpu_to_le64(slba);
@@ -1207,7 +2732,7 @@ __submit_async_read_cmd(strom_dma_task *dtask, strom_prps_item *pitem)
 #endif
 	if (IS_ERR(req))
 	{
-		kfree(async_cmd_cxt);
+		mempool_free(async_cmd_cxt, strom_async_cmd_mempool);
 		return PTR_ERR(req);
 	}
 	async_cmd_cxt->pitem	= pitem;
@@ -1218,94 +2743,191 @@ __submit_async_read_cmd(strom_dma_task *dtask, strom_prps_item *pitem)
 	req->end_io_data		= async_cmd_cxt;
 
 	/* throw asynchronous i/o request */
-	blk_execute_rq_nowait(nvme_ns->queue, nvme_ns->disk, req, 0,
-						  __callback_async_read_cmd);
+	batch_sz = Min(ACCESS_ONCE(submit_batch_sz),
+				   (int)(nvme_ns->queue->nr_requests / 4));
+	if (batch_sz > 1 && __blk_mq_batch_submit_available())
+	{
+		if (dtask->batch_queue != nvme_ns->queue)
+			strom_dma_task_unplug(dtask);
+		/* see blk_execute_rq_nowait */
+		req->rq_disk	= nvme_ns->disk;
+		req->end_io		= __callback_async_read_cmd;
+		__blk_mq_insert_request(req, false, false, false);
+		dtask->batch_queue = nvme_ns->queue;
+		if (++dtask->batch_nr >= batch_sz)
+			strom_dma_task_unplug(dtask);
+	}
+	else
+	{
+		blk_execute_rq_nowait(nvme_ns->queue, nvme_ns->disk, req, 0,
+							  __callback_async_read_cmd);
+	}
 	return 0;
 }
 
 
+/*
+ * __strom_lookup_dma_task - lookup a DMA task either running or failed.
+ * Caller must hold the slot lock.
+ */
+static strom_dma_task *
+__strom_lookup_dma_task(unsigned long dma_task_id, int hindex)
+{
+	strom_dma_task	   *dtask;
+
+	if (dma_task_id == 0 || dma_task_id > INT_MAX)
+		return NULL;
+	rcu_read_lock();
+	dtask = idr_find(&strom_dma_task_idr, (int)dma_task_id);
+	rcu_read_unlock();
+	/* task tracked by the IDR is never released under the slot lock */
+	if (dtask && dtask->hindex != hindex)
+		return NULL;
+	return dtask;
+}
+
+/*
+ * __strom_reap_dma_task - fetch the result of the completed DMA task, then
+ * detach it from the IDR. It returns true if caller has to release the task.
+ * If the status is delivered as an event (or deferred CQE), it is reported
+ * only by the event, so the task is not reaped and -EBUSY is returned.
+ * Caller must hold the slot lock.
+ */
+static bool
+__strom_reap_dma_task(strom_dma_task *dtask,
+					  long *p_dma_task_status,
+					  int *p_retval)
+{
+	Assert(dtask->completed);
+	if (dtask->ev_pending)
+	{
+		if (p_dma_task_status)
+			*p_dma_task_status = -EBUSY;
+		*p_retval = -EBUSY;
+		return false;
+	}
+	if (dtask->dma_status)
+	{
+		if (p_dma_task_status)
+			*p_dma_task_status = dtask->dma_status;
+		*p_retval = (dtask->dma_status == -ECANCELED ? -ECANCELED : -EIO);
+	}
+	if (!dtask->reaped)
+	{
+		__strom_untrack_dma_task(dtask);
+		dtask->reaped = true;
+	}
+	return __strom_dma_task_releasable(dtask);
+}
+
+/*
+ * Waiter spins on completion of the DMA task for a while prior to sleep, if
+ * wait_spin_usecs is positive. It saves the cost of sleep and wakeup for
+ * short DMA tasks, at the cost of CPU cycles.
+ */
+static int	wait_spin_usecs = 0;
+module_param(wait_spin_usecs, int, 0644);
+MODULE_PARM_DESC(wait_spin_usecs, "duration to spin on completion of DMA task prior to sleep, in microseconds");
+
 /*
  * strom_memcpy_wait - synchronization of a dma_task
+ *
+ * @timeout_ms follows the convention of STROM_IOCTL__MEMCPY_WAIT_MANY;
+ * 0 means no timeout, and negative means no wait. The task is not reaped
+ * on -ETIMEDOUT or -EAGAIN, so caller can wait for it again.
+ * It returns -ENOENT if no such task or already reaped, and -EPERM if the
+ * task was not submitted via @fstate.
  */
 static int
-strom_dma_task_wait(unsigned long dma_task_id,
+strom_dma_task_wait(strom_file_state *fstate,
+					unsigned long dma_task_id,
 					long *p_dma_task_status,
-					int task_state)
+					int task_state,
+					int timeout_ms)
 {
 	int					hindex = strom_dma_task_index(dma_task_id);
 	spinlock_t		   *lock = &strom_dma_task_locks[hindex];
-	wait_queue_head_t  *waitq = &strom_dma_task_waitq[hindex];
-	unsigned long		flags = 0;
+	unsigned long		flags;
 	strom_dma_task	   *dtask;
-	struct list_head   *slot;
+	long				timeout;
 	u64					tv1, tv2;
 	int					retval = 0;
+	bool				release_dtask = false;
 	bool				had_sleep = false;
 	DEFINE_WAIT(__wait);
 
+	if (timeout_ms < 0)
+		timeout = 0;
+	else if (timeout_ms == 0)
+		timeout = MAX_SCHEDULE_TIMEOUT;
+	else
+		timeout = msecs_to_jiffies(timeout_ms);
+
 	tv1 = rdtsc();
-	for (;;)
+	spin_lock_irqsave(lock, flags);
+	dtask = __strom_lookup_dma_task(dma_task_id, hindex);
+	if (!dtask || dtask->fstate != fstate)
 	{
-		bool	has_spinlock = false;
-		bool	task_is_running = false;
+		spin_unlock_irqrestore(lock, flags);
+		return (!dtask ? -ENOENT : -EPERM);
+	}
 
-		rcu_read_lock();
-	retry:
-		/* check error status first */
-		slot = &failed_dma_task_slots[hindex];
-		list_for_each_entry_rcu(dtask, slot, chain)
-		{
-			if (dtask->dma_task_id == dma_task_id)
-			{
-				if (!has_spinlock)
-				{
-					rcu_read_unlock();
-					has_spinlock = true;
-					spin_lock_irqsave(lock, flags);
-					goto retry;
-				}
-				if (p_dma_task_status)
-					*p_dma_task_status = dtask->dma_status;
-				list_del(&dtask->chain);
-				spin_unlock_irqrestore(lock, flags);
-				kfree(dtask);
-				retval = -EIO;
+	if (!dtask->completed)
+	{
+		int		spin_usecs = ACCESS_ONCE(wait_spin_usecs);
 
-				goto out;
-			}
-		}
+		/* pin the task, then sleep on its own wait queue */
+		dtask->nr_waiters++;
+		spin_unlock_irqrestore(lock, flags);
+		/* spin a while prior to sleep, if configured */
+		if (spin_usecs > 0 && timeout != 0)
+		{
+			u64		deadline = local_clock() +
+				(u64)spin_usecs * NSEC_PER_USEC;
 
-		/* check whether it is a running task or not */
-		slot = &strom_dma_task_slots[hindex];
-		list_for_each_entry_rcu(dtask, slot, chain)
+			while (!ACCESS_ONCE(dtask->completed) &&
+				   !need_resched() &&
+				   local_clock() < deadline)
+				cpu_relax();
+		}
+		for (;;)
 		{
-			if (dtask->dma_task_id == dma_task_id)
+			prepare_to_wait(&dtask->waitq, &__wait, task_state);
+			if (ACCESS_ONCE(dtask->completed))
+				break;
+			if (timeout == 0)
+			{
+				retval = (timeout_ms < 0 ? -EAGAIN : -ETIMEDOUT);
+				break;
+			}
+			if (task_state == TASK_INTERRUPTIBLE && signal_pending(current))
 			{
-				task_is_running = true;
+				retval = -EINTR;
 				break;
 			}
+			if (stat_info && had_sleep)
+				atomic64_inc(&stat_nr_wrong_wakeup);
+			timeout = schedule_timeout(timeout);
+			had_sleep = true;
 		}
-		if (has_spinlock)
-			spin_unlock_irqrestore(lock, flags);
-		else
-			rcu_read_unlock();
+		finish_wait(&dtask->waitq, &__wait);
+		spin_lock_irqsave(lock, flags);
+		dtask->nr_waiters--;
+	}
 
-		if (!task_is_running)
-			break;
-		if (signal_pending(current))
-		{
-			retval = -EINTR;
-			break;
-		}
-		/* wait for completion of DMA task */
-		prepare_to_wait(waitq, &__wait, task_state);
-		schedule();
-		if (stat_info && had_sleep)
-			atomic64_inc(&stat_nr_wrong_wakeup);
-		had_sleep = true;
+	if (dtask->completed)
+	{
+		/* task is reaped here, so timeout or signal is not reported */
+		retval = 0;
+		release_dtask = __strom_reap_dma_task(dtask,
+											  p_dma_task_status,
+											  &retval);
 	}
-out:
-	finish_wait(waitq, &__wait);
+	spin_unlock_irqrestore(lock, flags);
+
+	if (release_dtask)
+		strom_free_dma_task(dtask);
+
 	tv2 = rdtsc();
 	if (stat_info && had_sleep)
 	{
@@ -1320,21 +2942,243 @@ out:
  */
 static int
 ioctl_memcpy_wait(StromCmd__MemCopyWait __user *uarg,
+				  size_t argsz,
 				  struct file *ioctl_filp)
 {
 	StromCmd__MemCopyWait karg;
 	long		retval;
 
-	if (copy_from_user(&karg, uarg, sizeof(StromCmd__MemCopyWait)))
+	/* timeout_ms is zero (no timeout), if legacy form */
+	memset(&karg, 0, sizeof(StromCmd__MemCopyWait));
+	if (copy_from_user(&karg, uarg, argsz))
 		return -EFAULT;
 
 	karg.status = 0;
-	retval = strom_dma_task_wait(karg.dma_task_id,
+	retval = strom_dma_task_wait(ioctl_filp->private_data,
+								 karg.dma_task_id,
 								 &karg.status,
-								 TASK_INTERRUPTIBLE);
-	if (copy_to_user(uarg, &karg, sizeof(StromCmd__MemCopyWait)))
+								 TASK_INTERRUPTIBLE,
+								 karg.timeout_ms);
+	if (copy_to_user(uarg, &karg, argsz))
+		return -EFAULT;
+
+	return retval;
+}
+
+/*
+ * ioctl(2) handler for STROM_IOCTL__MEMCPY_CANCEL
+ *
+ * It marks the DMA task as cancelled, so the submitter stops to submit the
+ * remaining chunks; the ID is written back to the argument of the submitter
+ * prior to the submission. NVMe commands already in flight are not aborted;
+ * the task gets completed with -ECANCELED once they are drained.
+ */
+static int
+ioctl_memcpy_cancel(StromCmd__MemCopyCancel __user *uarg,
+					struct file *ioctl_filp)
+{
+	StromCmd__MemCopyCancel karg;
+	strom_dma_task *dtask;
+	unsigned long	flags;
+	int				hindex;
+	int				retval = 0;
+
+	if (copy_from_user(&karg, uarg, sizeof(StromCmd__MemCopyCancel)))
+		return -EFAULT;
+
+	hindex = strom_dma_task_index(karg.dma_task_id);
+	spin_lock_irqsave(&strom_dma_task_locks[hindex], flags);
+	dtask = __strom_lookup_dma_task(karg.dma_task_id, hindex);
+	if (!dtask)
+		retval = -ENOENT;
+	else if (dtask->fstate != ioctl_filp->private_data)
+		retval = -EPERM;
+	else if (!dtask->completed)
+		dtask->cancelled = true;
+	spin_unlock_irqrestore(&strom_dma_task_locks[hindex], flags);
+
+	return retval;
+}
+
+/*
+ * ioctl(2) handler for STROM_IOCTL__MEMCPY_WAIT_MANY
+ *
+ * It pins the running tasks, then sleeps on the wait queues of all of them
+ * until the condition is satisfied. Completed tasks are reaped, and their
+ * status is reported, regardless of the mode. It returns -ENOENT or -EPERM
+ * without reaping anything, if any of the IDs is unknown, already reaped,
+ * or submitted via other file handle.
+ */
+static int
+ioctl_memcpy_wait_many(StromCmd__MemCopyWaitMany __user *uarg,
+					   struct file *ioctl_filp)
+{
+	StromCmd__MemCopyWaitMany karg;
+	unsigned long  *dma_task_ids = NULL;
+	strom_dma_task **dtasks = NULL;
+	wait_queue_t   *waits = NULL;
+	long		   *status = NULL;
+	uint8_t		   *completed = NULL;
+	unsigned int	nr_required;
+	long			timeout;
+	unsigned long	flags;
+	u64				tv1, tv2;
+	bool			had_sleep = false;
+	int				i, retval = 0;
+
+	if (copy_from_user(&karg, uarg, sizeof(StromCmd__MemCopyWaitMany)))
 		return -EFAULT;
+	if (karg.nr_tasks == 0 || karg.nr_tasks > NVME_STROM_WAIT_MANY_MAX_TASKS)
+		return -EINVAL;
+	switch (karg.mode)
+	{
+		case NVME_STROM_WAIT_MANY__ANY:
+			nr_required = 1;
+			break;
+		case NVME_STROM_WAIT_MANY__ALL:
+			nr_required = karg.nr_tasks;
+			break;
+		case NVME_STROM_WAIT_MANY__AT_LEAST:
+			if (karg.min_tasks == 0 || karg.min_tasks > karg.nr_tasks)
+				return -EINVAL;
+			nr_required = karg.min_tasks;
+			break;
+		default:
+			return -EINVAL;
+	}
+	if (karg.timeout_ms < 0)
+		timeout = 0;
+	else if (karg.timeout_ms == 0)
+		timeout = MAX_SCHEDULE_TIMEOUT;
+	else
+		timeout = msecs_to_jiffies(karg.timeout_ms);
+
+	dma_task_ids = kmalloc(sizeof(unsigned long) * karg.nr_tasks, GFP_KERNEL);
+	dtasks = kzalloc(sizeof(strom_dma_task *) * karg.nr_tasks, GFP_KERNEL);
+	waits = kmalloc(sizeof(wait_queue_t) * karg.nr_tasks, GFP_KERNEL);
+	status = kzalloc(sizeof(long) * karg.nr_tasks, GFP_KERNEL);
+	completed = kzalloc(sizeof(uint8_t) * karg.nr_tasks, GFP_KERNEL);
+	if (!dma_task_ids || !dtasks || !waits || !status || !completed)
+	{
+		retval = -ENOMEM;
+		goto out;
+	}
+	if (copy_from_user(dma_task_ids, karg.dma_task_ids,
+					   sizeof(unsigned long) * karg.nr_tasks))
+	{
+		retval = -EFAULT;
+		goto out;
+	}
+
+	/* pin the running tasks, and put a wait entry on them */
+	tv1 = rdtsc();
+	for (i=0; i < karg.nr_tasks; i++)
+	{
+		int				hindex = strom_dma_task_index(dma_task_ids[i]);
+		spinlock_t	   *lock = &strom_dma_task_locks[hindex];
+		strom_dma_task *dtask;
+
+		spin_lock_irqsave(lock, flags);
+		dtask = __strom_lookup_dma_task(dma_task_ids[i], hindex);
+		if (!dtask)
+			retval = -ENOENT;
+		else if (dtask->fstate != ioctl_filp->private_data)
+			retval = -EPERM;
+		else
+			dtask->nr_waiters++;
+		spin_unlock_irqrestore(lock, flags);
+		if (retval)
+			break;
+
+		init_waitqueue_entry(&waits[i], current);
+		add_wait_queue(&dtask->waitq, &waits[i]);
+		dtasks[i] = dtask;
+	}
+
+	/* wait for completion of the tasks, unless any invalid IDs */
+	while (!retval)
+	{
+		unsigned int	count = 0;
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		for (i=0; i < karg.nr_tasks; i++)
+		{
+			if (dtasks[i] && ACCESS_ONCE(dtasks[i]->completed))
+				count++;
+		}
+		if (count >= nr_required)
+			break;
+		if (timeout == 0)
+		{
+			retval = (karg.timeout_ms < 0 ? -EAGAIN : -ETIMEDOUT);
+			break;
+		}
+		if (signal_pending(current))
+		{
+			retval = -EINTR;
+			break;
+		}
+		if (stat_info && had_sleep)
+			atomic64_inc(&stat_nr_wrong_wakeup);
+		timeout = schedule_timeout(timeout);
+		had_sleep = true;
+	}
+	__set_current_state(TASK_RUNNING);
+
+	/*
+	 * unpin the tasks, and reap the completed ones. Nothing is reaped if
+	 * any invalid IDs, so caller can retry with the valid ones.
+	 */
+	karg.nr_completed = 0;
+	for (i=0; i < karg.nr_tasks; i++)
+	{
+		strom_dma_task *dtask = dtasks[i];
+		int				hindex;
+		spinlock_t	   *lock;
+		bool			release_dtask = false;
+		int				__retval = 0;
+
+		if (!dtask)
+			continue;
+		remove_wait_queue(&dtask->waitq, &waits[i]);
+
+		hindex = dtask->hindex;
+		lock = &strom_dma_task_locks[hindex];
+		spin_lock_irqsave(lock, flags);
+		dtask->nr_waiters--;
+		if (dtask->completed && retval != -ENOENT && retval != -EPERM)
+		{
+			release_dtask = __strom_reap_dma_task(dtask,
+												  &status[i],
+												  &__retval);
+			completed[i] = 1;
+			karg.nr_completed++;
+		}
+		spin_unlock_irqrestore(lock, flags);
+
+		if (release_dtask)
+			strom_free_dma_task(dtask);
+	}
+	tv2 = rdtsc();
+	if (stat_info && had_sleep)
+	{
+		atomic64_inc(&stat_nr_wait_dtask);
+		atomic64_add((u64)(tv2 > tv1 ? tv2 - tv1 : 0), &stat_clk_wait_dtask);
+	}
 
+	/* write back the results, even if timeout or signal */
+	if (copy_to_user(karg.status, status,
+					 sizeof(long) * karg.nr_tasks) ||
+		copy_to_user(karg.completed, completed,
+					 sizeof(uint8_t) * karg.nr_tasks) ||
+		copy_to_user(uarg, &karg, sizeof(StromCmd__MemCopyWaitMany)))
+		retval = -EFAULT;
+out:
+	kfree(completed);
+	kfree(status);
+	kfree(waits);
+	kfree(dtasks);
+	kfree(dma_task_ids);
 	return retval;
 }
 
@@ -1342,7 +3186,7 @@ ioctl_memcpy_wait(StromCmd__MemCopyWait __user *uarg,
  * memcpy_pgcache_to_ubuffer - write back page-cache to user buffer
  */
 static int
-memcpy_pgcache_to_ubuffer(strom_dma_task *dtask,
+memcpy_pgcache_to_ubuffer(struct page **file_pages,
 						  struct file *filp,
 						  loff_t fpos,
 						  int nr_pages,
@@ -1356,7 +3200,7 @@ memcpy_pgcache_to_ubuffer(strom_dma_task *dtask,
 
 	for (i=0; i < nr_pages; i++)
 	{
-		fpage = dtask->file_pages[i];
+		fpage = file_pages[i];
 		/* Synchronous read, if not cached */
 		if (!fpage)
 		{
@@ -1367,7 +3211,7 @@ memcpy_pgcache_to_ubuffer(strom_dma_task *dtask,
 				break;
 			}
 			lock_page(fpage);
-			dtask->file_pages[i] = fpage;
+			file_pages[i] = fpage;
 		}
 		Assert(fpage != NULL);
 
@@ -1400,8 +3244,139 @@ memcpy_pgcache_to_ubuffer(strom_dma_task *dtask,
 	return retval;
 }
 
+/*
+ * strom_dma_task_merge - try to merge a run of continuous sectors to the
+ * pending request, if source sectors are adjacent to the pending ones.
+ * Even if destination is not continuous, the run is attached as a separate
+ * destination segment when @scatter_merge is enabled and both of the
+ * segment boundaries are page-aligned. It returns false, if not mergeable.
+ *
+ * A run appended to the tail is clipped by @max_nr_sects, and @p_nr_sects
+ * is updated to the merged length. A run prepended to the head must be
+ * merged entirely.
+ *
+ * If the run is located behind the pending request with a small gap, less
+ * than or equal to @read_through_gap in KB, the gap is also read into the
+ * scratch page, then the run is appended as a separate destination segment.
+ */
+static int	scatter_merge = 1;
+module_param(scatter_merge, int, 0644);
+MODULE_PARM_DESC(scatter_merge, "turn on/off merge of requests whose destination is not continuous");
+
+static int	read_through_gap = 0;
+module_param(read_through_gap, int, 0644);
+MODULE_PARM_DESC(read_through_gap, "max length of the gap between extents in KB to be read through (0 = disabled)");
+
+static bool
+strom_dma_task_merge(strom_dma_task *dtask,
+					 sector_t sector,
+					 unsigned int *p_nr_sects,
+					 unsigned int max_nr_sects,
+					 loff_t dest_offset)
+{
+	strom_dma_segment *dseg;
+	sector_t	tail_sector = dtask->head_sector + dtask->nr_sectors;
+	unsigned int nr_sects = *p_nr_sects;
+	unsigned int nr_gaps = 0;
+	size_t		length;
+	bool		can_scatter;
+
+	Assert(dtask->nr_sectors > 0 && dtask->nr_dest_segs > 0);
+	if (dtask->nr_sectors >= max_nr_sects)
+		return false;
+	/* is the run located behind the pending request with a small gap? */
+	if (sector > tail_sector &&
+		sector - tail_sector <= ((sector_t)read_through_gap << 1) &&
+		((sector - tail_sector) & ((PAGE_SIZE >> SECTOR_SHIFT) - 1)) == 0 &&
+		dtask->nr_sectors + (sector - tail_sector) < max_nr_sects)
+		nr_gaps = sector - tail_sector;
+
+	if (tail_sector + nr_gaps == sector &&
+		dtask->nr_sectors + nr_gaps + nr_sects > max_nr_sects)
+		nr_sects = max_nr_sects - (dtask->nr_sectors + nr_gaps);
+	else if (dtask->nr_sectors + nr_sects > max_nr_sects)
+		return false;
+	length = ((size_t)nr_sects << SECTOR_SHIFT);
+
+	can_scatter = (scatter_merge &&
+				   dtask->nr_dest_segs < STROM_DMA_TASK_NSEGS &&
+				   dtask->nvme_ns->ctrl->page_size == PAGE_SIZE &&
+				   (dest_offset & (PAGE_SIZE - 1)) == 0 &&
+				   (length & (PAGE_SIZE - 1)) == 0);
+
+	if (nr_gaps > 0)
+	{
+		/* read through the gap, then append the run to the tail */
+		dseg = &dtask->dest_segs[dtask->nr_dest_segs - 1];
+		if (!can_scatter ||
+			dtask->nr_dest_segs + 2 > STROM_DMA_TASK_NSEGS ||
+			((dseg->offset +
+			  ((loff_t)dseg->nr_sects << SECTOR_SHIFT)) & (PAGE_SIZE - 1)) != 0)
+			return false;
+		dseg++;
+		dseg->offset	= STROM_DMA_SEGMENT__GAP;
+		dseg->nr_sects	= nr_gaps;
+		dseg++;
+		dseg->offset	= dest_offset;
+		dseg->nr_sects	= nr_sects;
+		dtask->nr_dest_segs += 2;
+		dtask->nr_sectors += nr_gaps;
+	}
+	else if (dtask->head_sector + dtask->nr_sectors == sector)
+	{
+		/* append the run to the tail */
+		dseg = &dtask->dest_segs[dtask->nr_dest_segs - 1];
+		if (dseg->offset +
+			((loff_t)dseg->nr_sects << SECTOR_SHIFT) == dest_offset)
+			dseg->nr_sects += nr_sects;
+		else if (can_scatter &&
+				 ((dseg->offset +
+				   ((loff_t)dseg->nr_sects << SECTOR_SHIFT)) &
+				  (PAGE_SIZE - 1)) == 0)
+		{
+			dseg++;
+			dseg->offset	= dest_offset;
+			dseg->nr_sects	= nr_sects;
+			dtask->nr_dest_segs++;
+		}
+		else
+			return false;
+	}
+	else if (sector + nr_sects == dtask->head_sector)
+	{
+		/* prepend the run to the head */
+		dseg = &dtask->dest_segs[0];
+		if (dest_offset + length == dseg->offset)
+		{
+			dseg->offset	= dest_offset;
+			dseg->nr_sects += nr_sects;
+		}
+		else if (can_scatter && (dseg->offset & (PAGE_SIZE - 1)) == 0)
+		{
+			memmove(dseg + 1, dseg,
+					sizeof(strom_dma_segment) * dtask->nr_dest_segs);
+			dseg->offset	= dest_offset;
+			dseg->nr_sects	= nr_sects;
+			dtask->nr_dest_segs++;
+		}
+		else
+			return false;
+		dtask->head_sector = sector;
+	}
+	else
+		return false;
+
+	dtask->nr_sectors += nr_sects;
+	*p_nr_sects = nr_sects;
+	return true;
+}
+
 /*
  * Submit READ command to NVMe SSD device
+ *
+ * It looks up the extents that cover the supplied range of the file, then
+ * walks on the extents rather than pages; a run of continuous blocks on the
+ * extent shall be merged to the pending request at once.
  */
 static int
 memcpy_from_nvme_ssd(strom_dma_task *dtask,
@@ -1415,34 +3390,68 @@ memcpy_from_nvme_ssd(strom_dma_task *dtask,
 					 unsigned int *p_nr_dma_submit,
 					 unsigned int *p_nr_dma_blocks)
 {
-	struct buffer_head	bh;
+	strom_extent	ext;
 	struct nvme_ns *nvme_ns;
+	sector_t		iblock;
 	sector_t		sector;
+	sector_t		nr_blocks;
 	unsigned int	nr_sects;
 	unsigned int	max_nr_sects = (dtask->dmareq_maxsz >> SECTOR_SHIFT);
+	unsigned int	page_sects = (PAGE_CACHE_SIZE >> SECTOR_SHIFT);
+	unsigned int	blkbits = f_inode->i_blkbits;
 	loff_t			curr_offset = dest_offset;
-	int				i, retval = 0;
+	int				retval = 0;
 
-	for (i=0; i < nr_pages; i++, fpos += PAGE_CACHE_SIZE)
+	memset(&ext, 0, sizeof(strom_extent));
+	while (nr_pages > 0)
 	{
-		/* lookup the source block number */
-		memset(&bh, 0, sizeof(bh));
-		bh.b_size = (1UL << f_inode->i_blkbits);
-
-		retval = strom_get_block(f_inode,
-								 fpos >> f_inode->i_blkbits,
-								 &bh, 0);
-		if (retval)
+		/*
+		 * lookup the extent that covers the rest of the range, unless
+		 * the extent we looked up last time covers this page
+		 */
+		iblock = fpos >> blkbits;
+		if (iblock < ext.fblock ||
+			iblock >= ext.fblock + ext.nblocks)
 		{
-			prError("strom_get_block: %d", retval);
-			break;
+			nr_blocks = ((size_t)nr_pages << PAGE_CACHE_SHIFT) >> blkbits;
+			retval = strom_lookup_extent(f_inode, iblock,
+										 Max(nr_blocks, 1), &ext);
+			if (retval)
+			{
+				prError("strom_get_block: %d", retval);
+				break;
+			}
 		}
 
 		/* adjust location according to sector-size and table partition */
-		sector = bh.b_blocknr << (f_inode->i_blkbits - SECTOR_SHIFT);
+		sector = (ext.pblock + (iblock - ext.fblock))
+			<< (blkbits - SECTOR_SHIFT);
 		if (blkdev->bd_part)
 			sector += blkdev->bd_part->start_sect;
-		nr_sects = PAGE_CACHE_SIZE >> SECTOR_SHIFT;
+
+		/*
+		 * length of the run; page-aligned, and at least one page because
+		 * we assume blocks in a page are continuous.
+		 */
+		nr_blocks = ext.fblock + ext.nblocks - iblock;
+		if (nr_blocks > ((size_t)nr_pages << PAGE_CACHE_SHIFT) >> blkbits)
+			nr_blocks = ((size_t)nr_pages << PAGE_CACHE_SHIFT) >> blkbits;
+		nr_sects = (nr_blocks << (blkbits - SECTOR_SHIFT)) & ~(page_sects - 1);
+		if (nr_sects == 0)
+			nr_sects = page_sects;
+		if (nr_sects > max_nr_sects)
+			nr_sects = max_nr_sects;
+
+		/* the run should not go across the destination segment */
+		if (dest_segment_shift >= 0)
+		{
+			loff_t	limit = ((curr_offset >> dest_segment_shift) + 1)
+				<< dest_segment_shift;
+
+			if (curr_offset + ((loff_t)nr_sects << SECTOR_SHIFT) > limit)
+				nr_sects = Max((limit - curr_offset) >> SECTOR_SHIFT,
+							   page_sects);
+		}
 
 		/*
 		 * NOTE: If we have MD RAID-0 configuration, block number on the MD
@@ -1453,8 +3462,14 @@ memcpy_from_nvme_ssd(strom_dma_task *dtask,
 		 */
 		if (dtask->mddev)
 		{
+			unsigned int	chunk_sects = dtask->mddev->chunk_sectors;
+			unsigned int	limit = chunk_sects - (sector % chunk_sects);
+
 			WARN_ON(dtask->mddev != blkdev->bd_disk->private_data);
 
+			/* the run should not go across the md raid-0 chunk */
+			if (nr_sects > limit)
+				nr_sects = limit;
 			nvme_ns = strom_raid0_map_sector(dtask->mddev,
 											 &sector,
 											 nr_sects);
@@ -1470,20 +3485,14 @@ memcpy_from_nvme_ssd(strom_dma_task *dtask,
 			nvme_ns = NULL;
 		}
 
-		/* merge with pending request if possible */
-		if ((!nvme_ns || dtask->nvme_ns == nvme_ns) &&
-			dtask->nr_sectors > 0 &&
-			dtask->nr_sectors + nr_sects <= max_nr_sects &&
-			dtask->head_sector + dtask->nr_sectors == sector &&
-			dtask->dest_offset +
-			SECTOR_SIZE * dtask->nr_sectors == curr_offset &&
-			(dest_segment_shift < 0 ||
-			 ((curr_offset >> dest_segment_shift) ==
-			  (curr_offset + PAGE_CACHE_SIZE - 1) >> dest_segment_shift)))
-		{
-			dtask->nr_sectors += nr_sects;
-		}
-		else
+		/*
+		 * merge with pending request if possible (note that nr_sects might
+		 * be clipped), elsewhere submit the pending one.
+		 */
+		if (dtask->nr_sectors == 0 ||
+			(nvme_ns && dtask->nvme_ns != nvme_ns) ||
+			!strom_dma_task_merge(dtask, sector, &nr_sects,
+								  max_nr_sects, curr_offset))
 		{
 			/* submit pending SSD2GPU DMA */
 			if (dtask->nr_sectors > 0)
@@ -1499,15 +3508,78 @@ memcpy_from_nvme_ssd(strom_dma_task *dtask,
 			}
 			if (nvme_ns != NULL)
 				dtask->nvme_ns = nvme_ns;
-			dtask->dest_offset = curr_offset;
 			dtask->head_sector = sector;
 			dtask->nr_sectors  = nr_sects;
+			dtask->dest_segs[0].offset	 = curr_offset;
+			dtask->dest_segs[0].nr_sects = nr_sects;
+			dtask->nr_dest_segs = 1;
 		}
-		curr_offset += PAGE_CACHE_SIZE;
+		fpos        += ((loff_t)nr_sects << SECTOR_SHIFT);
+		curr_offset += ((loff_t)nr_sects << SECTOR_SHIFT);
+		nr_pages    -= nr_sects / page_sects;
 	}
 	return retval;
 }
 
+/*
+ * Sort of chunks by the device LBA
+ *
+ * If caller supplies chunk_ids in random order (bitmap scan, index driven
+ * fetch, ...), source sectors of the adjacent chunks are rarely continuous,
+ * so we can merge almost nothing. If NVME_STROM_MEMCPY_FLAGS__SORT_BY_LBA
+ * is given, chunks to be loaded from SSD are collected first, then submitted
+ * in order of the device LBA of their head block.
+ */
+typedef struct strom_chunk_lba
+{
+	sector_t		pblock;		/* device block number of the head */
+	loff_t			fpos;		/* file position of the chunk */
+	uint32_t		chunk_id;	/* chunk-id supplied by the caller */
+} strom_chunk_lba;
+
+static int
+strom_chunk_lba_comp(const void *__a, const void *__b)
+{
+	const strom_chunk_lba *a = __a;
+	const strom_chunk_lba *b = __b;
+
+	if (a->pblock < b->pblock)
+		return -1;
+	if (a->pblock > b->pblock)
+		return 1;
+	if (a->fpos < b->fpos)
+		return -1;
+	if (a->fpos > b->fpos)
+		return 1;
+	return 0;
+}
+
+static int
+strom_chunk_lba_setup(strom_chunk_lba *clba,
+					  struct inode *f_inode,
+					  loff_t fpos,
+					  unsigned int chunk_sz,
+					  uint32_t chunk_id)
+{
+	strom_extent	ext;
+	int				retval;
+
+	retval = strom_lookup_extent(f_inode,
+								 fpos >> f_inode->i_blkbits,
+								 chunk_sz >> f_inode->i_blkbits,
+								 &ext);
+	if (retval)
+	{
+		prError("strom_get_block: %d", retval);
+		return retval;
+	}
+	clba->pblock	= ext.pblock;
+	clba->fpos		= fpos;
+	clba->chunk_id	= chunk_id;
+
+	return 0;
+}
+
 
 /* ================================================================
  *
@@ -1522,13 +3594,16 @@ submit_ssd2gpu_memcpy(strom_dma_task *dtask)
 	nvidia_p2p_page_table_t *page_table = mgmem->page_table;
 	struct nvme_ns	   *nvme_ns = dtask->nvme_ns;
 	struct nvme_ctrl   *nvme_ctrl = nvme_ns->ctrl;
+	strom_dma_segment  *dseg;
 	strom_prps_item	   *pitem;
 	ssize_t				total_nbytes;
 	ssize_t				__total_nbytes;
 	dma_addr_t			curr_paddr;
-	int					length;
-	int					i, retval;
+	loff_t				dest_offset;
+	size_t				length;
+	int					j, k, retval;
 	u32					nvme_page_size = nvme_ctrl->page_size;
+	bool				is_ok = true;
 	u64					tv1, tv2;
 
 	/* sanity checks */
@@ -1538,30 +3613,65 @@ submit_ssd2gpu_memcpy(strom_dma_task *dtask)
 	__total_nbytes = total_nbytes = SECTOR_SIZE * dtask->nr_sectors;
 	if (!total_nbytes || total_nbytes > dtask->dmareq_maxsz)
 		return -EINVAL;
-	if (dtask->dest_offset < mgmem->map_offset ||
-		dtask->dest_offset + total_nbytes > (mgmem->map_offset +
-											 mgmem->map_length))
-		return -ERANGE;
+	for (k=0; k < dtask->nr_dest_segs; k++)
+	{
+		dseg = &dtask->dest_segs[k];
+		if (dseg->offset == STROM_DMA_SEGMENT__GAP)
+			continue;
+		if (dseg->offset < mgmem->map_offset ||
+			dseg->offset + SECTOR_SIZE * dseg->nr_sects >
+			mgmem->map_offset + mgmem->map_length)
+			return -ERANGE;
+	}
 
 	tv1 = rdtsc();
-	pitem = strom_prps_item_alloc();
+	pitem = strom_prps_item_alloc(nvme_ctrl);
 	if (!pitem)
 		return -ENOMEM;
 
-	i =  (dtask->dest_offset >> mgmem->gpu_page_shift);
-	curr_paddr = (page_table->pages[i]->physical_address +
-				  (dtask->dest_offset & (mgmem->gpu_page_sz - 1)));
-	length = nvme_page_size - (curr_paddr & (nvme_page_size - 1));
-	for (i=0; total_nbytes > 0; i++)
+	pitem->sgl_mode = strom_nvme_ctrl_support_sgl(nvme_ctrl);
+retry:
+	pitem->nitems = 0;
+	for (k=0; is_ok && k < dtask->nr_dest_segs; k++)
 	{
-		Assert(i < pitem->nrooms);
-		pitem->prps_list[i] = curr_paddr;
-		curr_paddr += length;
-		total_nbytes -= length;
+		dseg = &dtask->dest_segs[k];
+		total_nbytes = SECTOR_SIZE * dseg->nr_sects;
 
-		length = Min(total_nbytes, nvme_page_size);
+		if (dseg->offset == STROM_DMA_SEGMENT__GAP)
+		{
+			is_ok = strom_prps_item_append_gap(pitem, nvme_ctrl,
+											   total_nbytes);
+			continue;
+		}
+		/* walk on the GPU pages; physically continuous in a GPU page */
+		dest_offset = dseg->offset;
+		while (is_ok && total_nbytes > 0)
+		{
+			j = (dest_offset >> mgmem->gpu_page_shift);
+			curr_paddr = (page_table->pages[j]->physical_address +
+						  (dest_offset & (mgmem->gpu_page_sz - 1)));
+			length = Min(total_nbytes,
+						 mgmem->gpu_page_sz -
+						 (dest_offset & (mgmem->gpu_page_sz - 1)));
+			is_ok = strom_prps_item_append(pitem, nvme_ctrl,
+										   curr_paddr, length);
+			dest_offset += length;
+			total_nbytes -= length;
+		}
+	}
+	if (!is_ok)
+	{
+		/* SGL descriptors run out, so fallback to PRPs list */
+		if (pitem->sgl_mode)
+		{
+			pitem->sgl_mode = false;
+			is_ok = true;
+			goto retry;
+		}
+		prError("Bug? PRPs list has no room for %zu bytes", __total_nbytes);
+		strom_prps_item_free(pitem);
+		return -EINVAL;
 	}
-	pitem->nitems = i;
 	if (stat_info)
 	{
 		tv2 = rdtsc();
@@ -1605,6 +3715,9 @@ do_memcpy_ssd2gpu(StromCmd__MemCopySsdToGpu *karg,
 	size_t				dest_offset;
 	unsigned int		nr_pages = (karg->chunk_sz >> PAGE_CACHE_SHIFT);
 	int					threshold = nr_pages / 2;
+	struct page		  **file_pages;
+	strom_chunk_lba	   *chunk_lba = NULL;
+	unsigned int		nr_lba = 0;
 	size_t				i_size;
 	long				i, j, k;
 	int					retval = 0;
@@ -1620,6 +3733,22 @@ do_memcpy_ssd2gpu(StromCmd__MemCopySsdToGpu *karg,
 					   (size_t)karg->chunk_sz) > mgmem->map_length)
 		return -ERANGE;
 
+	/* temporary buffer for locked page cache in a chunk */
+	file_pages = kmalloc(sizeof(struct page *) * nr_pages, GFP_KERNEL);
+	if (!file_pages)
+		return -ENOMEM;
+
+	if ((karg->flags & NVME_STROM_MEMCPY_FLAGS__SORT_BY_LBA) != 0)
+	{
+		chunk_lba = kmalloc(sizeof(strom_chunk_lba) * karg->nr_chunks,
+							GFP_KERNEL);
+		if (!chunk_lba)
+		{
+			retval = -ENOMEM;
+			goto out;
+		}
+	}
+
 	i_size = i_size_read(filp->f_inode);
 	for (i=karg->nr_chunks; i > 0; i--)
 	{
@@ -1628,18 +3757,27 @@ do_memcpy_ssd2gpu(StromCmd__MemCopySsdToGpu *karg,
 		struct page	   *fpage;
 		int				score = 0;
 
+		/* no more chunks shall be submitted, if cancelled */
+		if (unlikely(ACCESS_ONCE(dtask->cancelled)))
+		{
+			retval = -ECANCELED;
+			goto out;
+		}
 		if (karg->relseg_sz == 0)
 			fpos = chunk_id * karg->chunk_sz;
 		else
 			fpos = (chunk_id % karg->relseg_sz) * karg->chunk_sz;
 		Assert((fpos & (PAGE_CACHE_SIZE - 1)) == 0);
 		if (fpos > i_size)
-			return -ERANGE;
+		{
+			retval = -ERANGE;
+			goto out;
+		}
 
 		for (j=0, k=fpos >> PAGE_CACHE_SHIFT; j < nr_pages; j++, k++)
 		{
 			fpage = find_lock_page(filp->f_mapping, k);
-			dtask->file_pages[j] = fpage;
+			file_pages[j] = fpage;
 			if (fpage)
 				score += (PageDirty(fpage) ? threshold + 1 : 1);
 		}
@@ -1653,7 +3791,7 @@ do_memcpy_ssd2gpu(StromCmd__MemCopySsdToGpu *karg,
 			karg->nr_ram2gpu++;
 			dest_uaddr = karg->wb_buffer +
 				karg->chunk_sz * (karg->nr_chunks - karg->nr_ram2gpu);
-			retval = memcpy_pgcache_to_ubuffer(dtask,
+			retval = memcpy_pgcache_to_ubuffer(file_pages,
 											   filp,
 											   fpos,
 											   nr_pages,
@@ -1661,6 +3799,15 @@ do_memcpy_ssd2gpu(StromCmd__MemCopySsdToGpu *karg,
 			chunk_ids_out[karg->nr_chunks -
 						  karg->nr_ram2gpu] = (uint32_t)chunk_id;
 		}
+		else if (chunk_lba)
+		{
+			/* SSD2GPU chunks shall be submitted later */
+			retval = strom_chunk_lba_setup(&chunk_lba[nr_lba++],
+										   f_inode,
+										   fpos,
+										   karg->chunk_sz,
+										   (uint32_t)chunk_id);
+		}
 		else
 		{
 			retval = memcpy_from_nvme_ssd(dtask,
@@ -1686,7 +3833,7 @@ do_memcpy_ssd2gpu(StromCmd__MemCopySsdToGpu *karg,
 		{
 			for (j=0; j < nr_pages; j++)
 			{
-				fpage = dtask->file_pages[j];
+				fpage = file_pages[j];
 				if (fpage)
 				{
 					unlock_page(fpage);
@@ -1696,8 +3843,39 @@ do_memcpy_ssd2gpu(StromCmd__MemCopySsdToGpu *karg,
 		}
 
 		if (retval)
-			return retval;
+			goto out;
+	}
+
+	/* submit SSD2GPU chunks in order of LBA, if required */
+	if (chunk_lba)
+	{
+		sort(chunk_lba, nr_lba, sizeof(strom_chunk_lba),
+			 strom_chunk_lba_comp, NULL);
+		for (i=0; i < nr_lba; i++)
+		{
+			if (unlikely(ACCESS_ONCE(dtask->cancelled)))
+			{
+				retval = -ECANCELED;
+				goto out;
+			}
+			retval = memcpy_from_nvme_ssd(dtask,
+										  f_inode,
+										  i_sb->s_bdev,
+										  chunk_lba[i].fpos,
+										  nr_pages,
+										  dest_offset,
+										  -1,
+										  submit_ssd2gpu_memcpy,
+										  &karg->nr_dma_submit,
+										  &karg->nr_dma_blocks);
+			if (retval)
+				goto out;
+			chunk_ids_out[karg->nr_ssd2gpu] = chunk_lba[i].chunk_id;
+			dest_offset += karg->chunk_sz;
+			karg->nr_ssd2gpu++;
+		}
 	}
+
 	/* submit pending SSD2GPU DMA request, if any */
 	if (dtask->nr_sectors > 0)
 	{
@@ -1706,16 +3884,23 @@ do_memcpy_ssd2gpu(StromCmd__MemCopySsdToGpu *karg,
 		retval = submit_ssd2gpu_memcpy(dtask);
 	}
 	Assert(karg->nr_ram2gpu + karg->nr_ssd2gpu == karg->nr_chunks);
-
+out:
+	kfree(chunk_lba);
+	kfree(file_pages);
 	return retval;
 }
 
 /*
  * ioctl(2) handler for STROM_IOCTL__MEMCPY_SSD2GPU
+ *
+ * @argsz is the length of the argument; shorter if legacy form.
+ * @sqe is not NULL if it is submitted via SQ ring.
  */
 static int
 ioctl_memcpy_ssd2gpu(StromCmd__MemCopySsdToGpu __user *uarg,
-					 struct file *ioctl_filp)
+					 size_t argsz,
+					 struct file *ioctl_filp,
+					 StromRing__Sqe *sqe)
 {
 	StromCmd__MemCopySsdToGpu karg;
 	mapped_gpu_memory  *mgmem;
@@ -1724,7 +3909,9 @@ ioctl_memcpy_ssd2gpu(StromCmd__MemCopySsdToGpu __user *uarg,
 	uint32_t		   *chunk_ids_out = NULL;
 	int					retval;
 
-	if (copy_from_user(&karg, uarg, sizeof(StromCmd__MemCopySsdToGpu)))
+	/* fields not in @argsz (legacy form) are considered as zero */
+	memset(&karg, 0, sizeof(StromCmd__MemCopySsdToGpu));
+	if (copy_from_user(&karg, uarg, argsz))
 		return -EFAULT;
 	chunk_ids_in = kmalloc(2 * sizeof(uint32_t) * karg.nr_chunks, GFP_KERNEL);
 	if (!chunk_ids_in)
@@ -1745,7 +3932,7 @@ ioctl_memcpy_ssd2gpu(StromCmd__MemCopySsdToGpu __user *uarg,
 		goto out;
 	}
 
-	dtask = strom_create_dma_task(karg.file_desc,
+	dtask = strom_create_dma_task(karg.file_desc, karg.flags,
 								  mgmem, NULL, ioctl_filp);
 	if (IS_ERR(dtask))
 	{
@@ -1758,16 +3945,19 @@ ioctl_memcpy_ssd2gpu(StromCmd__MemCopySsdToGpu __user *uarg,
 	karg.nr_ssd2gpu = 0;
 	karg.nr_dma_submit = 0;
 	karg.nr_dma_blocks = 0;
-	
-	retval = do_memcpy_ssd2gpu(&karg, dtask,
-							   chunk_ids_in,
-							   chunk_ids_out);
+
+	/* ID is visible prior to the submission, to be cancelled */
+	if (put_user(karg.dma_task_id, &uarg->dma_task_id))
+		retval = -EFAULT;
+	else
+		retval = do_memcpy_ssd2gpu(&karg, dtask,
+								   chunk_ids_in,
+								   chunk_ids_out);
+	strom_dma_task_unplug(dtask);
 	/* no more async jobs shall not acquire the @dtask any more */
 	dtask->frozen = true;
 	barrier();
 
-	strom_put_dma_task(dtask, 0);
-
 	/* write back the results */
 	if (!retval)
 	{
@@ -1778,10 +3968,24 @@ ioctl_memcpy_ssd2gpu(StromCmd__MemCopySsdToGpu __user *uarg,
 							  sizeof(uint32_t) * karg.nr_chunks))
 			retval = -EFAULT;
 	}
+	/* doorbell shall be written on completion, if required */
+	if (!retval && (karg.flags & NVME_STROM_MEMCPY_FLAGS__DOORBELL) != 0)
+		retval = strom_dma_task_setup_doorbell(dtask,
+											   karg.doorbell,
+											   karg.doorbell_value);
+	/* completion shall be reported by CQE, if successfully submitted */
+	if (!retval && sqe)
+	{
+		dtask->ring_user_data = sqe->user_data;
+		dtask->ring_task = true;
+	}
+	strom_put_dma_task(dtask, 0);
+
 	/* synchronization of completion if any error */
 	if (retval)
-		strom_dma_task_wait(karg.dma_task_id, NULL,
-							TASK_UNINTERRUPTIBLE);
+		strom_dma_task_wait(ioctl_filp->private_data,
+							karg.dma_task_id, NULL,
+							TASK_UNINTERRUPTIBLE, 0);
 out:
 	kfree(chunk_ids_in);
 	return retval;
@@ -1803,45 +4007,85 @@ submit_ssd2ram_memcpy(strom_dma_task *dtask)
 	hugepage_dma_buffer *hd_buf = dtask->hd_buf;
 	struct nvme_ns	   *nvme_ns = dtask->nvme_ns;
 	struct nvme_ctrl   *nvme_ctrl = nvme_ns->ctrl;
+	strom_dma_segment  *dseg;
 	struct page		   *ppage;
 	strom_prps_item	   *pitem;
+	unsigned int		page_shift = hd_buf->page_shift;
+	size_t				page_sz = (1UL << page_shift);
 	ssize_t				total_nbytes;
 	ssize_t				__total_nbytes;
 	long				dest_offset;
-	long				i, j, k;
+	size_t				length;
+	long				j, k;
 	int					retval;
+	bool				is_ok = true;
 	u64					tv1, tv2;
 
 	WARN_ON(nvme_ctrl->page_size < PAGE_SIZE);
-	WARN_ON((dtask->dest_offset & (PAGE_SIZE - 1)) != 0);
 
 	__total_nbytes = total_nbytes = SECTOR_SIZE * dtask->nr_sectors;
-	if (!total_nbytes || total_nbytes > NVMESSD_DMAREQ_MAXSZ)
+	if (!total_nbytes || total_nbytes > dtask->dmareq_maxsz)
 		return -EINVAL;
-	if (dtask->dest_offset < 0 ||
-		dtask->dest_offset + total_nbytes > (hd_buf->nr_hpages << HPAGE_SHIFT))
-		return -ERANGE;
+	for (k=0; k < dtask->nr_dest_segs; k++)
+	{
+		dseg = &dtask->dest_segs[k];
+		if (dseg->offset == STROM_DMA_SEGMENT__GAP)
+			continue;
+		WARN_ON((dseg->offset & (PAGE_SIZE - 1)) != 0);
+		if (dseg->offset < 0 ||
+			dseg->offset + SECTOR_SIZE * dseg->nr_sects >
+			((size_t)hd_buf->nr_hpages << page_shift))
+			return -ERANGE;
+	}
 
 	tv1 = rdtsc();
-	pitem = strom_prps_item_alloc();
+	pitem = strom_prps_item_alloc(nvme_ctrl);
 	if (!pitem)
 		return -ENOMEM;
 
 	/* setup PRPS item */
-	dest_offset = dtask->dest_offset;
-	for (i=0; total_nbytes > 0; i++)
+	pitem->sgl_mode = strom_nvme_ctrl_support_sgl(nvme_ctrl);
+retry:
+	pitem->nitems = 0;
+	for (k=0; is_ok && k < dtask->nr_dest_segs; k++)
 	{
-		size_t	len = Min(total_nbytes, nvme_ctrl->page_size);
-
-		Assert(i < pitem->nrooms);
-		j = dest_offset >> HPAGE_SHIFT;
-		k = dest_offset & (HPAGE_SIZE - 1);
-		ppage = hd_buf->hpages[j];
-		pitem->prps_list[i] = page_to_phys(ppage) + k;
-		dest_offset += len;
-        total_nbytes -= len;
+		dseg = &dtask->dest_segs[k];
+		dest_offset = dseg->offset;
+		total_nbytes = SECTOR_SIZE * dseg->nr_sects;
+		if (dest_offset == STROM_DMA_SEGMENT__GAP)
+		{
+			is_ok = strom_prps_item_append_gap(pitem, nvme_ctrl,
+											   total_nbytes);
+			continue;
+		}
+		/* walk on the pages; physically continuous in a page */
+		while (is_ok && total_nbytes > 0)
+		{
+			j = dest_offset >> page_shift;
+			ppage = hd_buf->hpages[j];
+			length = Min(total_nbytes,
+						 page_sz - (dest_offset & (page_sz - 1)));
+			is_ok = strom_prps_item_append(pitem, nvme_ctrl,
+										   page_to_phys(ppage) +
+										   (dest_offset & (page_sz - 1)),
+										   length);
+			dest_offset += length;
+			total_nbytes -= length;
+		}
+	}
+	if (!is_ok)
+	{
+		/* SGL descriptors run out, so fallback to PRPs list */
+		if (pitem->sgl_mode)
+		{
+			pitem->sgl_mode = false;
+			is_ok = true;
+			goto retry;
+		}
+		prError("Bug? PRPs list has no room for %zu bytes", __total_nbytes);
+		strom_prps_item_free(pitem);
+		return -EINVAL;
 	}
-	pitem->nitems = i;
 
 	if (stat_info)
 	{
@@ -1875,27 +4119,55 @@ submit_ssd2ram_memcpy(strom_dma_task *dtask)
 static int
 do_memcpy_ssd2ram(StromCmd__MemCopySsdToRam *karg,
 				  strom_dma_task *dtask,
-				  uint32_t *chunk_ids)
+				  unsigned long dest_base,
+				  uint32_t *chunk_ids,
+				  uint32_t *chunk_ids_out)
 {
 	hugepage_dma_buffer *hd_buf = dtask->hd_buf;
 	struct file		   *filp = dtask->filp;
 	struct inode	   *f_inode = filp->f_inode;
 	struct super_block *i_sb = f_inode->i_sb;
-	unsigned long		dest_offset = hd_buf->uoffset;
+	unsigned long		dest_offset = dest_base;
 	char __user		   *dest_uaddr = karg->dest_uaddr;
 	unsigned int		nr_pages = (karg->chunk_sz >> PAGE_CACHE_SHIFT);
 	int					threshold = nr_pages / 2;
+	struct page		  **file_pages;
+	strom_chunk_lba	   *chunk_lba = NULL;
+	unsigned int		nr_lba = 0;
 	size_t				i_size;
 	long				i, j, k;
 	int					retval = 0;
+	/*
+	 * a run of DMA should not go across the huge-page; a set of normal
+	 * pages are split into PRPs per page on submit, so no limit here.
+	 */
+	int					dest_segment_shift = (hd_buf->page_shift > PAGE_SHIFT
+											  ? hd_buf->page_shift : -1);
 
 	/* sanity checks */
 	if ((karg->chunk_sz & (PAGE_CACHE_SIZE - 1)) != 0 ||	/* alignment */
 		karg->chunk_sz < PAGE_CACHE_SIZE ||					/* >= 4KB */
-		karg->chunk_sz > NVMESSD_DMAREQ_MAXSZ ||			/* <= 128KB */
-		(hd_buf->uoffset & (PAGE_CACHE_SIZE - 1)) != 0)		/* alignment */
+		karg->chunk_sz > dtask->dmareq_maxsz ||				/* <= HW limit */
+		(dest_base & (PAGE_CACHE_SIZE - 1)) != 0)			/* alignment */
 		return -EINVAL;
 
+	/* temporary buffer for locked page cache in a chunk */
+	file_pages = kmalloc(sizeof(struct page *) * nr_pages, GFP_KERNEL);
+	if (!file_pages)
+		return -ENOMEM;
+
+	if (chunk_ids_out)
+	{
+		Assert((karg->flags & NVME_STROM_MEMCPY_FLAGS__SORT_BY_LBA) != 0);
+		chunk_lba = kmalloc(sizeof(strom_chunk_lba) * karg->nr_chunks,
+							GFP_KERNEL);
+		if (!chunk_lba)
+		{
+			retval = -ENOMEM;
+			goto out;
+		}
+	}
+
 	i_size = i_size_read(f_inode);
 	for (i=karg->nr_chunks; i > 0; i--)
 	{
@@ -1904,6 +4176,12 @@ do_memcpy_ssd2ram(StromCmd__MemCopySsdToRam *karg,
 		struct page	   *fpage;
 		int				score = 0;
 
+		/* no more chunks shall be submitted, if cancelled */
+		if (unlikely(ACCESS_ONCE(dtask->cancelled)))
+		{
+			retval = -ECANCELED;
+			goto out;
+		}
 		if (karg->relseg_sz == 0)
 			fpos = chunk_id * (size_t)karg->chunk_sz;
 		else
@@ -1912,26 +4190,56 @@ do_memcpy_ssd2ram(StromCmd__MemCopySsdToRam *karg,
 		if (fpos > i_size)
 		{
 			prError("fpos=%ld i_size=%zu", (long)fpos, i_size);
-			return -ERANGE;
+			retval = -ERANGE;
+			goto out;
 		}
 
 		for (j=0, k=(fpos >> PAGE_CACHE_SHIFT); j < nr_pages; j++, k++)
 		{
 			fpage = find_lock_page(filp->f_mapping, k);
-			dtask->file_pages[j] = fpage;
+			file_pages[j] = fpage;
 			if (fpage)
 				score += (PageDirty(fpage) ? threshold + 1 : 1);
 		}
 
-		if (score > threshold)
+		if (score > threshold && chunk_ids_out)
 		{
-			retval = memcpy_pgcache_to_ubuffer(dtask,
+			/* RAM2RAM chunks are located from the tail */
+			k = karg->nr_chunks - (karg->nr_ram2ram + 1);
+			retval = memcpy_pgcache_to_ubuffer(file_pages,
+											   filp,
+											   fpos,
+											   nr_pages,
+											   karg->dest_uaddr +
+											   k * (size_t)karg->chunk_sz);
+			if (!retval && dtask->progress)
+				strom_dma_progress_land(dtask->progress,
+										dest_base + k * (size_t)karg->chunk_sz,
+										karg->chunk_sz);
+			chunk_ids_out[k] = (uint32_t)chunk_id;
+			karg->nr_ram2ram++;
+		}
+		else if (score > threshold)
+		{
+			retval = memcpy_pgcache_to_ubuffer(file_pages,
 											   filp,
 											   fpos,
 											   nr_pages,
 											   dest_uaddr);
+			if (!retval && dtask->progress)
+				strom_dma_progress_land(dtask->progress,
+										dest_offset, karg->chunk_sz);
 			karg->nr_ram2ram++;
 		}
+		else if (chunk_lba)
+		{
+			/* SSD2RAM chunks shall be submitted later */
+			retval = strom_chunk_lba_setup(&chunk_lba[nr_lba++],
+										   f_inode,
+										   fpos,
+										   karg->chunk_sz,
+										   (uint32_t)chunk_id);
+		}
 		else
 		{
 			retval = memcpy_from_nvme_ssd(dtask,
@@ -1940,7 +4248,7 @@ do_memcpy_ssd2ram(StromCmd__MemCopySsdToRam *karg,
 										  fpos,
 										  nr_pages,
 										  dest_offset,
-										  HPAGE_SHIFT,
+										  dest_segment_shift,
 										  submit_ssd2ram_memcpy,
 										  &karg->nr_dma_submit,
 										  &karg->nr_dma_blocks);
@@ -1955,7 +4263,7 @@ do_memcpy_ssd2ram(StromCmd__MemCopySsdToRam *karg,
 		{
 			for (j=0; j < nr_pages; j++)
 			{
-				fpage = dtask->file_pages[j];
+				fpage = file_pages[j];
 				if (fpage)
 				{
 					unlock_page(fpage);
@@ -1965,10 +4273,42 @@ do_memcpy_ssd2ram(StromCmd__MemCopySsdToRam *karg,
 		}
 
 		if (retval)
-			return retval;
+			goto out;
 		dest_uaddr += (size_t)karg->chunk_sz;
 		dest_offset += (size_t)karg->chunk_sz;
 	}
+
+	/* submit SSD2RAM chunks in order of LBA, if required */
+	if (chunk_lba)
+	{
+		sort(chunk_lba, nr_lba, sizeof(strom_chunk_lba),
+			 strom_chunk_lba_comp, NULL);
+		dest_offset = dest_base;
+		for (i=0; i < nr_lba; i++)
+		{
+			if (unlikely(ACCESS_ONCE(dtask->cancelled)))
+			{
+				retval = -ECANCELED;
+				goto out;
+			}
+			retval = memcpy_from_nvme_ssd(dtask,
+										  f_inode,
+										  i_sb->s_bdev,
+										  chunk_lba[i].fpos,
+										  nr_pages,
+										  dest_offset,
+										  dest_segment_shift,
+										  submit_ssd2ram_memcpy,
+										  &karg->nr_dma_submit,
+										  &karg->nr_dma_blocks);
+			if (retval)
+				goto out;
+			chunk_ids_out[karg->nr_ssd2ram] = chunk_lba[i].chunk_id;
+			dest_offset += (size_t)karg->chunk_sz;
+			karg->nr_ssd2ram++;
+		}
+	}
+
 	/* submit pending SSD2RAM DMA request, if any */
 	if (dtask->nr_sectors > 0)
 	{
@@ -1977,191 +4317,1172 @@ do_memcpy_ssd2ram(StromCmd__MemCopySsdToRam *karg,
 		retval = submit_ssd2ram_memcpy(dtask);
 	}
 	Assert(karg->nr_ram2ram + karg->nr_ssd2ram == karg->nr_chunks);
+out:
+	kfree(chunk_lba);
+	kfree(file_pages);
+	return retval;
+}
+
+/*
+ * strom_get_dma_buffer - lookup the destination buffer of SSD2RAM, either
+ * from the registered DMA buffer, the buffer allocated by the module, or by
+ * the page table walk. It also returns the offset of @uaddr from the head
+ * of the first huge-page.
+ */
+static hugepage_dma_buffer *
+strom_get_dma_buffer(struct file *ioctl_filp, unsigned int cmd_flags,
+					 unsigned long handle, void __user *uaddr, size_t length,
+					 unsigned long *p_dest_base)
+{
+	strom_file_state *fstate = ioctl_filp->private_data;
+	hugepage_dma_buffer *hd_buf;
+	unsigned long	flags;
+
+	if ((cmd_flags & NVME_STROM_MEMCPY_FLAGS__REGISTERED_BUFFER) == 0)
+	{
+		hd_buf = find_module_dma_buffer(uaddr, length, p_dest_base);
+		if (hd_buf)
+			return hd_buf;
+		hd_buf = create_hugepage_dma_buffer(uaddr, length, true);
+		if (!IS_ERR(hd_buf))
+			*p_dest_base = hd_buf->uoffset;
+		return hd_buf;
+	}
+
+	if (handle > INT_MAX)
+		return ERR_PTR(-ENOENT);
+	spin_lock_irqsave(&fstate->lock, flags);
+	hd_buf = idr_find(&fstate->hd_buf_idr, (int)handle);
+	if (!hd_buf)
+		hd_buf = ERR_PTR(-ENOENT);
+	else if ((unsigned long)uaddr < hd_buf->uaddr ||
+			 (unsigned long)uaddr + length > hd_buf->uaddr + hd_buf->ulength)
+		hd_buf = ERR_PTR(-ERANGE);
+	else
+	{
+		get_hugepage_dma_buffer(hd_buf);
+		*p_dest_base = hd_buf->uoffset +
+			((unsigned long)uaddr - hd_buf->uaddr);
+	}
+	spin_unlock_irqrestore(&fstate->lock, flags);
+
+	return hd_buf;
+}
+
+/*
+ * ioctl_memcpy_ssd2ram - handler for STROM_IOCTL__MEMCPY_SSD2RAM
+ *
+ * @argsz is the length of the argument; shorter if legacy form.
+ * @sqe is not NULL if it is submitted via SQ ring.
+ */
+static int
+ioctl_memcpy_ssd2ram(StromCmd__MemCopySsdToRam __user *uarg,
+					 size_t argsz,
+					 struct file *ioctl_filp,
+					 StromRing__Sqe *sqe)
+{
+	StromCmd__MemCopySsdToRam karg;
+	hugepage_dma_buffer	   *hd_buf;
+	strom_dma_task		   *dtask;
+	uint32_t			   *chunk_ids;
+	uint32_t			   *chunk_ids_out = NULL;
+	unsigned long			dest_base;
+	int						retval = 0;
+
+	/* copy ioctl arguments from the userspace; zero, if not in @argsz */
+	memset(&karg, 0, sizeof(karg));
+	if (copy_from_user(&karg, uarg, argsz))
+		return -EFAULT;
+	if ((karg.flags & NVME_STROM_MEMCPY_FLAGS__SORT_BY_LBA) == 0)
+		chunk_ids = kmalloc(sizeof(uint32_t) * karg.nr_chunks, GFP_KERNEL);
+	else
+	{
+		chunk_ids = kmalloc(2 * sizeof(uint32_t) * karg.nr_chunks,
+							GFP_KERNEL);
+		chunk_ids_out = chunk_ids + karg.nr_chunks;
+	}
+	if (!chunk_ids)
+		return -ENOMEM;
+	if (copy_from_user(chunk_ids, karg.chunk_ids,
+					   sizeof(uint32_t) * karg.nr_chunks))
+	{
+		retval = -EFAULT;
+		goto out;
+	}
+
+	/* lookup DMA destination buffer */
+	hd_buf = strom_get_dma_buffer(ioctl_filp, karg.flags,
+								  karg.dest_handle, karg.dest_uaddr,
+								  (size_t)karg.nr_chunks *
+								  (size_t)karg.chunk_sz,
+								  &dest_base);
+	if (IS_ERR(hd_buf))
+	{
+		retval = PTR_ERR(hd_buf);
+		goto out;
+	}
+
+	/* setup DMA task with huge-page DMA buffer */
+	dtask = strom_create_dma_task(karg.file_desc, karg.flags,
+								  NULL, hd_buf, ioctl_filp);
+	if (IS_ERR(dtask))
+	{
+		put_hugepage_dma_buffer(hd_buf);
+		retval = PTR_ERR(dtask);
+		goto out;
+	}
+	karg.dma_task_id = dtask->dma_task_id;
+	karg.nr_ram2ram = 0;
+	karg.nr_ssd2ram = 0;
+
+	/* setup progress map, if required */
+	if (karg.flags & NVME_STROM_MEMCPY_FLAGS__PROGRESS_MAP)
+	{
+		strom_dma_progress *dprog
+			= strom_create_dma_progress(karg.progress_map,
+										dest_base,
+										karg.chunk_sz,
+										karg.nr_chunks);
+		if (IS_ERR(dprog))
+			retval = PTR_ERR(dprog);
+		else
+			dtask->progress = dprog;
+	}
+	/* ID is visible prior to the submission, to be cancelled */
+	if (!retval && put_user(karg.dma_task_id, &uarg->dma_task_id))
+		retval = -EFAULT;
+	if (!retval)
+		retval = do_memcpy_ssd2ram(&karg, dtask, dest_base,
+								   chunk_ids, chunk_ids_out);
+	strom_dma_task_unplug(dtask);
+	/* no more async task shall acquire the @dtask any more */
+	dtask->frozen = true;
+	barrier();
+
+	/* write back the results */
+	if (!retval)
+	{
+		if (copy_to_user(uarg, &karg,
+						 offsetof(StromCmd__MemCopySsdToRam, dest_uaddr)))
+			retval = -EFAULT;
+		else if (chunk_ids_out &&
+				 copy_to_user(karg.chunk_ids, chunk_ids_out,
+							  sizeof(uint32_t) * karg.nr_chunks))
+			retval = -EFAULT;
+	}
+	/* doorbell shall be written on completion, if required */
+	if (!retval && (karg.flags & NVME_STROM_MEMCPY_FLAGS__DOORBELL) != 0)
+		retval = strom_dma_task_setup_doorbell(dtask,
+											   karg.doorbell,
+											   karg.doorbell_value);
+	/* completion shall be reported by CQE, if successfully submitted */
+	if (!retval && sqe)
+	{
+		dtask->ring_user_data = sqe->user_data;
+		dtask->ring_task = true;
+	}
+	strom_put_dma_task(dtask, 0);
+	/* synchronization of completion if any error */
+	if (retval)
+		strom_dma_task_wait(ioctl_filp->private_data,
+							karg.dma_task_id, NULL,
+							TASK_UNINTERRUPTIBLE, 0);
+out:
+	kfree(chunk_ids);
+	return retval;
+}
+
+/*
+ * ioctl_memcpy_ssd2ram_vec - handler for STROM_IOCTL__MEMCPY_SSD2RAM_VEC
+ *
+ * @sqe is not NULL if it is submitted via SQ ring.
+ */
+static int
+ioctl_memcpy_ssd2ram_vec(StromCmd__MemCopySsdToRamVec __user *uarg,
+						 struct file *ioctl_filp,
+						 StromRing__Sqe *sqe)
+{
+	StromCmd__MemCopySsdToRamVec karg;
+	StromCmd__MemCopySsdToRamSeg *segs;
+	StromCmd__MemCopySsdToRam sub;
+	hugepage_dma_buffer	   *hd_buf;
+	strom_dma_task		   *dtask;
+	struct file			  **vec_filps;
+	uint32_t			   *chunk_ids = NULL;
+	uint32_t			   *chunk_ids_out = NULL;
+	unsigned int			max_chunks = 0;
+	size_t					total_chunks = 0;
+	unsigned long			dest_offset;
+	unsigned int			i;
+	int						retval = 0;
+
+	/* copy ioctl arguments from the userspace */
+	if (copy_from_user(&karg, uarg, sizeof(karg)))
+		return -EFAULT;
+	if (karg.nr_segs == 0 || karg.nr_segs > NVME_STROM_MEMCPY_VEC_MAX_SEGS)
+		return -EINVAL;
+	segs = kmalloc(sizeof(StromCmd__MemCopySsdToRamSeg) * karg.nr_segs,
+				   GFP_KERNEL);
+	if (!segs)
+		return -ENOMEM;
+	if (copy_from_user(segs, karg.segs,
+					   sizeof(StromCmd__MemCopySsdToRamSeg) * karg.nr_segs))
+	{
+		retval = -EFAULT;
+		goto out;
+	}
+	for (i=0; i < karg.nr_segs; i++)
+	{
+		max_chunks = Max(max_chunks, segs[i].nr_chunks);
+		total_chunks += segs[i].nr_chunks;
+	}
+	if ((karg.flags & NVME_STROM_MEMCPY_FLAGS__SORT_BY_LBA) == 0)
+		chunk_ids = kmalloc(sizeof(uint32_t) * max_chunks, GFP_KERNEL);
+	else
+	{
+		chunk_ids = kmalloc(2 * sizeof(uint32_t) * max_chunks, GFP_KERNEL);
+		chunk_ids_out = chunk_ids + max_chunks;
+	}
+	if (!chunk_ids)
+	{
+		retval = -ENOMEM;
+		goto out;
+	}
+	/* released with the DMA task */
+	vec_filps = kmalloc(sizeof(struct file *) * karg.nr_segs, GFP_KERNEL);
+	if (!vec_filps)
+	{
+		retval = -ENOMEM;
+		goto out;
+	}
+
+	/* lookup DMA destination buffer, for all the segments */
+	hd_buf = strom_get_dma_buffer(ioctl_filp, karg.flags,
+								  karg.dest_handle, karg.dest_uaddr,
+								  total_chunks * (size_t)karg.chunk_sz,
+								  &dest_offset);
+	if (IS_ERR(hd_buf))
+	{
+		kfree(vec_filps);
+		retval = PTR_ERR(hd_buf);
+		goto out;
+	}
+
+	/* setup DMA task with the first source file */
+	dtask = strom_create_dma_task(segs[0].file_desc, karg.flags,
+								  NULL, hd_buf, ioctl_filp);
+	if (IS_ERR(dtask))
+	{
+		put_hugepage_dma_buffer(hd_buf);
+		kfree(vec_filps);
+		retval = PTR_ERR(dtask);
+		goto out;
+	}
+	dtask->vec_filps = vec_filps;
+	karg.dma_task_id = dtask->dma_task_id;
+	karg.nr_ram2ram = 0;
+	karg.nr_ssd2ram = 0;
+	karg.nr_dma_submit = 0;
+	karg.nr_dma_blocks = 0;
+
+	/* setup progress map over all the segments, if required */
+	if (karg.flags & NVME_STROM_MEMCPY_FLAGS__PROGRESS_MAP)
+	{
+		strom_dma_progress *dprog;
+
+		if (total_chunks > NVME_STROM_PROGRESS_MAP_MAX_CHUNKS)
+			dprog = ERR_PTR(-EINVAL);
+		else
+			dprog = strom_create_dma_progress(karg.progress_map,
+											  dest_offset,
+											  karg.chunk_sz,
+											  total_chunks);
+		if (IS_ERR(dprog))
+			retval = PTR_ERR(dprog);
+		else
+			dtask->progress = dprog;
+	}
+
+	/* ID is visible prior to the submission, to be cancelled */
+	if (!retval && put_user(karg.dma_task_id, &uarg->dma_task_id))
+		retval = -EFAULT;
+
+	memset(&sub, 0, sizeof(StromCmd__MemCopySsdToRam));
+	sub.dest_uaddr	= karg.dest_uaddr;
+	sub.chunk_sz	= karg.chunk_sz;
+	sub.relseg_sz	= karg.relseg_sz;
+	sub.flags		= karg.flags;
+	for (i=0; !retval && i < karg.nr_segs; i++)
+	{
+		StromCmd__MemCopySsdToRamSeg *seg = &segs[i];
+
+		/* validation of the source file only if it is changed */
+		if (i > 0 && seg->file_desc != segs[i-1].file_desc)
+		{
+			retval = strom_dma_task_switch_file(dtask, seg->file_desc,
+												karg.flags, ioctl_filp);
+			if (retval)
+				break;
+		}
+		if (copy_from_user(chunk_ids, seg->chunk_ids,
+						   sizeof(uint32_t) * seg->nr_chunks))
+		{
+			retval = -EFAULT;
+			break;
+		}
+		sub.nr_chunks = seg->nr_chunks;
+		sub.nr_ram2ram = 0;
+		sub.nr_ssd2ram = 0;
+		retval = do_memcpy_ssd2ram(&sub, dtask, dest_offset,
+								   chunk_ids, chunk_ids_out);
+		if (retval)
+			break;
+		if (chunk_ids_out &&
+			copy_to_user(seg->chunk_ids, chunk_ids_out,
+						 sizeof(uint32_t) * seg->nr_chunks))
+		{
+			retval = -EFAULT;
+			break;
+		}
+		seg->nr_ram2ram = sub.nr_ram2ram;
+		seg->nr_ssd2ram = sub.nr_ssd2ram;
+		karg.nr_ram2ram += sub.nr_ram2ram;
+		karg.nr_ssd2ram += sub.nr_ssd2ram;
+
+		sub.dest_uaddr += (size_t)seg->nr_chunks * (size_t)karg.chunk_sz;
+		dest_offset += (size_t)seg->nr_chunks * (size_t)karg.chunk_sz;
+	}
+	strom_dma_task_unplug(dtask);
+	karg.nr_dma_submit = sub.nr_dma_submit;
+	karg.nr_dma_blocks = sub.nr_dma_blocks;
+	/* no more async task shall acquire the @dtask any more */
+	dtask->frozen = true;
+	barrier();
+
+	/* write back the results */
+	if (!retval)
+	{
+		if (copy_to_user(uarg, &karg,
+						 offsetof(StromCmd__MemCopySsdToRamVec, dest_uaddr)))
+			retval = -EFAULT;
+		else if (copy_to_user(karg.segs, segs,
+							  sizeof(StromCmd__MemCopySsdToRamSeg) *
+							  karg.nr_segs))
+			retval = -EFAULT;
+	}
+	/* doorbell shall be written on completion, if required */
+	if (!retval && (karg.flags & NVME_STROM_MEMCPY_FLAGS__DOORBELL) != 0)
+		retval = strom_dma_task_setup_doorbell(dtask,
+											   karg.doorbell,
+											   karg.doorbell_value);
+	/* completion shall be reported by CQE, if successfully submitted */
+	if (!retval && sqe)
+	{
+		dtask->ring_user_data = sqe->user_data;
+		dtask->ring_task = true;
+	}
+	strom_put_dma_task(dtask, 0);
+
+	/* synchronization of completion if any error */
+	if (retval)
+		strom_dma_task_wait(ioctl_filp->private_data,
+							karg.dma_task_id, NULL,
+							TASK_UNINTERRUPTIBLE, 0);
+out:
+	kfree(chunk_ids);
+	kfree(segs);
+	return retval;
+}
+
+/*
+ * STROM_IOCTL__STAT_INFO - Run-time statistics support
+ */
+static int
+ioctl_stat_info_command(StromCmd__StatInfo __user *uarg)
+{
+	StromCmd__StatInfo	karg;
+
+	if (copy_from_user(&karg, uarg, sizeof(StromCmd__StatInfo)))
+		return -EFAULT;
+	if (karg.version != 1)
+		return -EINVAL;
+	if (!stat_info)
+		return -ENODATA;
+
+	karg.tsc			= rdtsc();
+	karg.nr_ioctl_memcpy_submit = atomic64_read(&stat_nr_ioctl_memcpy_submit);
+	karg.clk_ioctl_memcpy_submit =atomic64_read(&stat_clk_ioctl_memcpy_submit);
+	karg.nr_ioctl_memcpy_wait = atomic64_read(&stat_nr_ioctl_memcpy_wait);
+	karg.clk_ioctl_memcpy_wait = atomic64_read(&stat_clk_ioctl_memcpy_wait);
+	karg.nr_ssd2gpu		= stat_percpu_sum(&stat_nr_ssd2gpu);
+	karg.clk_ssd2gpu	= stat_percpu_sum(&stat_clk_ssd2gpu);
+	karg.nr_setup_prps	= atomic64_read(&stat_nr_setup_prps);
+	karg.clk_setup_prps	= atomic64_read(&stat_clk_setup_prps);
+	karg.nr_submit_dma	= atomic64_read(&stat_nr_submit_dma);
+	karg.clk_submit_dma	= atomic64_read(&stat_clk_submit_dma);
+	karg.nr_wait_dtask	= atomic64_read(&stat_nr_wait_dtask);
+	karg.clk_wait_dtask	= atomic64_read(&stat_clk_wait_dtask);
+	karg.nr_wrong_wakeup = atomic64_read(&stat_nr_wrong_wakeup);
+	karg.total_dma_length = atomic64_read(&stat_total_dma_length);
+	karg.cur_dma_count	= atomic64_read(&stat_cur_dma_count);
+	karg.max_dma_count	= atomic64_xchg(&stat_max_dma_count, 0UL);
+	if ((karg.flags & NVME_STROM_STATFLAGS__DEBUG) != 0)
+	{
+		karg.nr_debug1	= atomic64_read(&stat_nr_debug1);
+		karg.clk_debug1	= atomic64_read(&stat_clk_debug1);
+		karg.nr_debug2	= atomic64_read(&stat_nr_debug2);
+		karg.clk_debug2	= atomic64_read(&stat_clk_debug2);
+		karg.nr_debug3	= atomic64_read(&stat_nr_debug3);
+		karg.clk_debug3	= atomic64_read(&stat_clk_debug3);
+		karg.nr_debug4	= atomic64_read(&stat_nr_debug4);
+		karg.clk_debug4	= atomic64_read(&stat_clk_debug4);
+	}
+	if (copy_to_user(uarg, &karg, sizeof(StromCmd__StatInfo)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* ================================================================
+ *
+ * file_operations of '/proc/nvme-strom' entry
+ *
+ * ================================================================
+ */
+static const char  *strom_proc_signature =		\
+	"version: " NVME_STROM_VERSION "\n"			\
+	"target: " UTS_RELEASE "\n"					\
+	"build: " NVME_STROM_BUILD_TIMESTAMP "\n";
+
+static int
+strom_proc_open(struct inode *inode, struct file *filp)
+{
+	strom_file_state   *fstate;
+
+	fstate = kzalloc(sizeof(strom_file_state), GFP_KERNEL);
+	if (!fstate)
+		return -ENOMEM;
+	spin_lock_init(&fstate->lock);
+	fstate->events_enabled = false;
+	INIT_LIST_HEAD(&fstate->events);
+	init_waitqueue_head(&fstate->waitq);
+	mutex_init(&fstate->ring_mutex);
+	fstate->ring = NULL;
+	INIT_LIST_HEAD(&fstate->cq_overflow);
+	INIT_LIST_HEAD(&fstate->cq_failures);
+	idr_init(&fstate->hd_buf_idr);
+	filp->private_data = fstate;
+
+	return 0;
+}
+
+/*
+ * strom_consume_dma_event - detach the completed DMA task from the event
+ * list of the file handle, then release it if nobody references.
+ * The error status delivered by the event is considered as reaped.
+ */
+static void
+strom_consume_dma_event(strom_dma_task *dtask)
+{
+	spinlock_t	   *lock = &strom_dma_task_locks[dtask->hindex];
+	unsigned long	flags;
+	bool			release_dtask;
+
+	spin_lock_irqsave(lock, flags);
+	Assert(dtask->completed && dtask->ev_pending);
+	dtask->ev_pending = false;
+	if (!dtask->reaped)
+	{
+		__strom_untrack_dma_task(dtask);
+		dtask->reaped = true;
+	}
+	release_dtask = __strom_dma_task_releasable(dtask);
+	spin_unlock_irqrestore(lock, flags);
+
+	if (release_dtask)
+		strom_free_dma_task(dtask);
+}
+
+/*
+ * strom_read_dma_events - read(2) handler once completion events are enabled.
+ * It returns as many event records as the buffer can hold, or blocks until
+ * any DMA task gets completed unless O_NONBLOCK.
+ */
+static ssize_t
+strom_read_dma_events(struct file *filp, char __user *buf, size_t len)
+{
+	strom_file_state   *fstate = filp->private_data;
+	StromEvent__DmaTaskDone	ev;
+	strom_dma_task	   *dtask;
+	unsigned long		flags;
+	size_t				nbytes = 0;
+	int					rc;
+
+	if (len < sizeof(StromEvent__DmaTaskDone))
+		return -EINVAL;
+
+	for (;;)
+	{
+		spin_lock_irqsave(&fstate->lock, flags);
+		while (nbytes + sizeof(StromEvent__DmaTaskDone) <= len &&
+			   !list_empty(&fstate->events))
+		{
+			dtask = list_first_entry(&fstate->events,
+									 strom_dma_task, ev_chain);
+			list_del_init(&dtask->ev_chain);
+			spin_unlock_irqrestore(&fstate->lock, flags);
+
+			/* status is never updated after completion */
+			ev.dma_task_id	= dtask->dma_task_id;
+			ev.status		= dtask->dma_status;
+			if (copy_to_user(buf + nbytes, &ev, sizeof(ev)))
+			{
+				/* put back the event not delivered */
+				spin_lock_irqsave(&fstate->lock, flags);
+				list_add(&dtask->ev_chain, &fstate->events);
+				spin_unlock_irqrestore(&fstate->lock, flags);
+				return (nbytes > 0 ? nbytes : -EFAULT);
+			}
+			strom_consume_dma_event(dtask);
+			nbytes += sizeof(StromEvent__DmaTaskDone);
+
+			spin_lock_irqsave(&fstate->lock, flags);
+		}
+		spin_unlock_irqrestore(&fstate->lock, flags);
+
+		if (nbytes > 0)
+			return nbytes;
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		rc = wait_event_interruptible(fstate->waitq,
+									  !list_empty(&fstate->events));
+		if (rc)
+			return rc;
+	}
+}
+
+static ssize_t
+strom_proc_read(struct file *filp, char __user *buf, size_t len, loff_t *pos)
+{
+	strom_file_state *fstate = filp->private_data;
+	size_t		sig_len = strlen(strom_proc_signature);
+
+	if (fstate->events_enabled)
+		return strom_read_dma_events(filp, buf, len);
+
+	if (*pos >= sig_len)
+		return 0;
+	if (*pos + len >= sig_len)
+		len = sig_len - *pos;
+	if (copy_to_user(buf, strom_proc_signature + *pos, len))
+		return -EFAULT;
+	*pos += len;
+
+	return len;
+}
+
+static unsigned int
+strom_proc_poll(struct file *filp, poll_table *wait)
+{
+	strom_file_state *fstate = filp->private_data;
+	StromRing__Header *ring = fstate->ring;
+
+	/* signature is always readable, if no events */
+	if (!fstate->events_enabled && !ring)
+		return POLLIN | POLLRDNORM;
+
+	poll_wait(filp, &fstate->waitq, wait);
+	if (!list_empty(&fstate->events))
+		return POLLIN | POLLRDNORM;
+	if (ring && (ACCESS_ONCE(ring->cq_tail) != ACCESS_ONCE(ring->cq_head) ||
+				 !list_empty(&fstate->cq_overflow) ||
+				 !list_empty(&fstate->cq_failures)))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+/*
+ * ioctl(2) handler for STROM_IOCTL__ENABLE_EVENTS
+ */
+static int
+ioctl_enable_events(struct file *ioctl_filp)
+{
+	strom_file_state *fstate = ioctl_filp->private_data;
+	unsigned long	flags;
+
+	spin_lock_irqsave(&fstate->lock, flags);
+	fstate->events_enabled = true;
+	spin_unlock_irqrestore(&fstate->lock, flags);
+
+	return 0;
+}
+
+/*
+ * ioctl(2) handler for STROM_IOCTL__REGISTER_FILE
+ */
+static int
+ioctl_register_file(StromCmd__RegisterFile __user *uarg,
+					struct file *ioctl_filp)
+{
+	strom_file_state *fstate = ioctl_filp->private_data;
+	StromCmd__RegisterFile karg;
+	strom_source_file *sfile;
+	strom_source_file **reg_files = NULL;
+	unsigned long	flags;
+	int				i, retval;
+
+	if (copy_from_user(&karg, uarg, sizeof(StromCmd__RegisterFile)))
+		return -EFAULT;
+
+	sfile = kmalloc(sizeof(strom_source_file), GFP_KERNEL);
+	if (!sfile)
+		return -ENOMEM;
+	retval = strom_get_source_file(ioctl_filp, karg.fdesc, 0, sfile);
+	if (retval)
+	{
+		kfree(sfile);
+		return retval;
+	}
+	if (!fstate->reg_files)
+	{
+		reg_files = kzalloc(sizeof(strom_source_file *) *
+							STROM_MAX_REGISTERED_FILES, GFP_KERNEL);
+		if (!reg_files)
+		{
+			retval = -ENOMEM;
+			goto error;
+		}
+	}
+
+	retval = -ENFILE;
+	spin_lock_irqsave(&fstate->lock, flags);
+	if (!fstate->reg_files)
+	{
+		fstate->reg_files = reg_files;
+		reg_files = NULL;
+	}
+	for (i=0; i < STROM_MAX_REGISTERED_FILES; i++)
+	{
+		if (!fstate->reg_files[i])
+		{
+			fstate->reg_files[i] = sfile;
+			karg.file_index = i;
+			retval = 0;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&fstate->lock, flags);
+	kfree(reg_files);
+	if (retval)
+		goto error;
+
+	if (copy_to_user(uarg, &karg, sizeof(StromCmd__RegisterFile)))
+		return -EFAULT;
+	return 0;
+
+error:
+	fput(sfile->filp);
+	kfree(sfile);
+	return retval;
+}
+
+/*
+ * ioctl(2) handler for STROM_IOCTL__UNREGISTER_FILE
+ */
+static int
+ioctl_unregister_file(StromCmd__RegisterFile __user *uarg,
+					  struct file *ioctl_filp)
+{
+	strom_file_state *fstate = ioctl_filp->private_data;
+	StromCmd__RegisterFile karg;
+	strom_source_file *sfile = NULL;
+	unsigned long	flags;
+
+	if (copy_from_user(&karg, uarg, sizeof(StromCmd__RegisterFile)))
+		return -EFAULT;
+	if (karg.file_index < 0 || karg.file_index >= STROM_MAX_REGISTERED_FILES)
+		return -EINVAL;
+
+	spin_lock_irqsave(&fstate->lock, flags);
+	if (fstate->reg_files)
+	{
+		sfile = fstate->reg_files[karg.file_index];
+		fstate->reg_files[karg.file_index] = NULL;
+	}
+	spin_unlock_irqrestore(&fstate->lock, flags);
+	if (!sfile)
+		return -ENOENT;
+
+	/* DMA tasks in progress have their own reference */
+	fput(sfile->filp);
+	kfree(sfile);
+
+	return 0;
+}
+
+/*
+ * ioctl(2) handler for STROM_IOCTL__REGISTER_DMA_BUFFER
+ */
+static int
+ioctl_register_dma_buffer(StromCmd__RegisterDmaBuffer __user *uarg,
+						  struct file *ioctl_filp)
+{
+	strom_file_state *fstate = ioctl_filp->private_data;
+	StromCmd__RegisterDmaBuffer karg;
+	hugepage_dma_buffer *hd_buf;
+	hugepage_dma_buffer *mod_buf;
+	unsigned long	offset;
+	unsigned long	flags;
+	int				handle;
+
+	if (copy_from_user(&karg, uarg, sizeof(StromCmd__RegisterDmaBuffer)))
+		return -EFAULT;
+	if (karg.length == 0)
+		return -EINVAL;
+	/* only hugetlb or the buffer allocated by the module */
+	mod_buf = find_module_dma_buffer(karg.uaddr, karg.length, &offset);
+	if (mod_buf)
+	{
+		hd_buf = slice_module_dma_buffer(mod_buf, karg.uaddr,
+										 karg.length, offset);
+		put_hugepage_dma_buffer(mod_buf);
+	}
+	else
+		hd_buf = create_hugepage_dma_buffer(karg.uaddr, karg.length, false);
+	if (IS_ERR(hd_buf))
+		return PTR_ERR(hd_buf);
+
+	idr_preload(GFP_KERNEL);
+	spin_lock_irqsave(&fstate->lock, flags);
+	handle = idr_alloc(&fstate->hd_buf_idr, hd_buf, 1, 0, GFP_NOWAIT);
+	spin_unlock_irqrestore(&fstate->lock, flags);
+	idr_preload_end();
+	if (handle < 0)
+	{
+		put_hugepage_dma_buffer(hd_buf);
+		return handle;
+	}
+
+	karg.handle = handle;
+	if (copy_to_user(uarg, &karg, sizeof(StromCmd__RegisterDmaBuffer)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * ioctl(2) handler for STROM_IOCTL__UNREGISTER_DMA_BUFFER
+ */
+static int
+ioctl_unregister_dma_buffer(StromCmd__RegisterDmaBuffer __user *uarg,
+							struct file *ioctl_filp)
+{
+	strom_file_state *fstate = ioctl_filp->private_data;
+	StromCmd__RegisterDmaBuffer karg;
+	hugepage_dma_buffer *hd_buf = NULL;
+	unsigned long	flags;
 
-	return retval;
+	if (copy_from_user(&karg, uarg, sizeof(StromCmd__RegisterDmaBuffer)))
+		return -EFAULT;
+	if (karg.handle == 0 || karg.handle > INT_MAX)
+		return -ENOENT;
+
+	spin_lock_irqsave(&fstate->lock, flags);
+	hd_buf = idr_find(&fstate->hd_buf_idr, (int)karg.handle);
+	if (hd_buf)
+		idr_remove(&fstate->hd_buf_idr, (int)karg.handle);
+	spin_unlock_irqrestore(&fstate->lock, flags);
+	if (!hd_buf)
+		return -ENOENT;
+
+	/* DMA tasks in progress have their own reference */
+	put_hugepage_dma_buffer(hd_buf);
+
+	return 0;
 }
 
 /*
- * ioctl_memcpy_ssd2ram - handler for STROM_IOCTL__MEMCPY_SSD2RAM
+ * ioctl(2) handler for STROM_IOCTL__SETUP_RING
  */
 static int
-ioctl_memcpy_ssd2ram(StromCmd__MemCopySsdToRam __user *uarg,
-					 struct file *ioctl_filp)
+ioctl_setup_ring(StromCmd__SetupRing __user *uarg,
+				 struct file *ioctl_filp)
 {
-	StromCmd__MemCopySsdToRam karg;
-	hugepage_dma_buffer	   *hd_buf;
-	strom_dma_task		   *dtask;
-	uint32_t			   *chunk_ids;
-	int						retval = 0;
-
-	/* copy ioctl arguments from the userspace */
-	if (copy_from_user(&karg, uarg, sizeof(karg)))
+	strom_file_state *fstate = ioctl_filp->private_data;
+	StromCmd__SetupRing karg;
+	StromRing__Header *ring;
+	unsigned int	sq_entries;
+	unsigned int	cq_entries;
+	size_t			sq_offset;
+	size_t			cq_offset;
+	size_t			ring_sz;
+	int				retval = 0;
+
+	if (copy_from_user(&karg, uarg, sizeof(StromCmd__SetupRing)))
 		return -EFAULT;
-	chunk_ids = kmalloc(sizeof(uint32_t) * karg.nr_chunks, GFP_KERNEL);
-	if (!chunk_ids)
+	if (karg.sq_entries == 0 || karg.sq_entries > STROM_RING_MAX_ENTRIES)
+		return -EINVAL;
+	sq_entries = roundup_pow_of_two(karg.sq_entries);
+	if (karg.cq_entries == 0)
+		cq_entries = 2 * sq_entries;
+	else if (karg.cq_entries < sq_entries ||
+			 karg.cq_entries > 2 * STROM_RING_MAX_ENTRIES)
+		return -EINVAL;
+	else
+		cq_entries = roundup_pow_of_two(karg.cq_entries);
+
+	sq_offset = L1_CACHE_ALIGN(sizeof(StromRing__Header));
+	cq_offset = L1_CACHE_ALIGN(sq_offset + sizeof(StromRing__Sqe) * sq_entries);
+	ring_sz = PAGE_ALIGN(cq_offset + sizeof(StromRing__Cqe) * cq_entries);
+
+	ring = vmalloc_user(ring_sz);
+	if (!ring)
 		return -ENOMEM;
-	if (copy_from_user(chunk_ids, karg.chunk_ids,
-					   sizeof(uint32_t) * karg.nr_chunks))
+	ring->sq_mask		= sq_entries - 1;
+	ring->sq_entries	= sq_entries;
+	ring->cq_mask		= cq_entries - 1;
+	ring->cq_entries	= cq_entries;
+
+	mutex_lock(&fstate->ring_mutex);
+	if (fstate->ring)
+		retval = -EBUSY;
+	else
 	{
-		retval = -EFAULT;
-		goto out;
+		fstate->sqes		= (StromRing__Sqe *)((char *)ring + sq_offset);
+		fstate->cqes		= (StromRing__Cqe *)((char *)ring + cq_offset);
+		fstate->sq_entries	= sq_entries;
+		fstate->cq_entries	= cq_entries;
+		fstate->sq_head		= 0;
+		fstate->cq_tail		= 0;
+		fstate->ring_sz		= ring_sz;
+		smp_wmb();
+		fstate->ring		= ring;
 	}
-
-	/* lookup DMA destination buffer */
-	hd_buf = create_hugepage_dma_buffer(karg.dest_uaddr,
-										(size_t)karg.nr_chunks *
-										(size_t)karg.chunk_sz);
-	if (IS_ERR(hd_buf))
+	mutex_unlock(&fstate->ring_mutex);
+	if (retval)
 	{
-		retval = PTR_ERR(hd_buf);
-		goto out;
+		vfree(ring);
+		return retval;
 	}
-	
 
-	/* setup DMA task with huge-page DMA buffer */
-	dtask = strom_create_dma_task(karg.file_desc,
-								  NULL, hd_buf, ioctl_filp);
-	if (IS_ERR(dtask))
+	karg.sq_entries	= sq_entries;
+	karg.cq_entries	= cq_entries;
+	karg.sq_offset	= sq_offset;
+	karg.cq_offset	= cq_offset;
+	karg.ring_sz	= ring_sz;
+	if (copy_to_user(uarg, &karg, sizeof(StromCmd__SetupRing)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * strom_ring_flush_overflow - put CQEs of the failed SQEs and DMA tasks
+ * deferred by CQ full, as long as CQ has room. It returns # of available
+ * CQEs.
+ */
+static unsigned int
+strom_ring_flush_overflow(strom_file_state *fstate)
+{
+	StromRing__Header *ring = fstate->ring;
+	strom_dma_task *dtask;
+	strom_ring_failure *rfail;
+	unsigned long	flags;
+	unsigned int	nr_cqes;
+	LIST_HEAD(dlist);
+	LIST_HEAD(flist);
+
+	spin_lock_irqsave(&fstate->lock, flags);
+	while (!list_empty(&fstate->cq_failures))
 	{
-		retval = PTR_ERR(dtask);
-		goto out;
+		rfail = list_first_entry(&fstate->cq_failures,
+								 strom_ring_failure, chain);
+		if (!__strom_ring_post_cqe(fstate,
+								   rfail->user_data, 0,
+								   rfail->status))
+			break;
+		list_move_tail(&rfail->chain, &flist);
 	}
-	karg.dma_task_id = dtask->dma_task_id;
-	karg.nr_ram2ram = 0;
-	karg.nr_ssd2ram = 0;
-
-	retval = do_memcpy_ssd2ram(&karg, dtask, chunk_ids);
-	/* no more async task shall acquire the @dtask any more */
-	dtask->frozen = true;
-	barrier();
-
-	strom_put_dma_task(dtask, 0);
+	while (!list_empty(&fstate->cq_overflow))
+	{
+		dtask = list_first_entry(&fstate->cq_overflow,
+								 strom_dma_task, ev_chain);
+		if (!__strom_ring_post_cqe(fstate,
+								   dtask->ring_user_data,
+								   dtask->dma_task_id,
+								   dtask->dma_status))
+			break;
+		list_move_tail(&dtask->ev_chain, &dlist);
+	}
+	nr_cqes = fstate->cq_tail - ACCESS_ONCE(ring->cq_head);
+	spin_unlock_irqrestore(&fstate->lock, flags);
 
-	/* write back the results */
-	if (!retval)
+	/* release the DMA tasks and failures reported by CQEs */
+	while (!list_empty(&dlist))
 	{
-		if (copy_to_user(uarg, &karg,
-						 offsetof(StromCmd__MemCopySsdToRam, dest_uaddr)))
-			retval = -EFAULT;
+		dtask = list_first_entry(&dlist, strom_dma_task, ev_chain);
+		list_del_init(&dtask->ev_chain);
+		strom_consume_dma_event(dtask);
 	}
-	/* synchronization of completion if any error */
-	if (retval)
-		strom_dma_task_wait(karg.dma_task_id, NULL,
-							TASK_UNINTERRUPTIBLE);
-out:
-	kfree(chunk_ids);
-	return retval;
+	while (!list_empty(&flist))
+	{
+		rfail = list_first_entry(&flist, strom_ring_failure, chain);
+		list_del(&rfail->chain);
+		kfree(rfail);
+	}
+	return nr_cqes;
 }
 
 /*
- * STROM_IOCTL__STAT_INFO - Run-time statistics support
+ * ioctl(2) handler for STROM_IOCTL__RING_ENTER
  */
 static int
-ioctl_stat_info_command(StromCmd__StatInfo __user *uarg)
+ioctl_ring_enter(StromCmd__RingEnter __user *uarg,
+				 struct file *ioctl_filp)
 {
-	StromCmd__StatInfo	karg;
+	strom_file_state *fstate = ioctl_filp->private_data;
+	StromRing__Header *ring = fstate->ring;
+	StromCmd__RingEnter karg;
+	StromRing__Sqe	sqe;
+	strom_ring_failure *rfail = NULL;
+	unsigned int	head, tail;
+	unsigned long	flags;
+	int				retval = 0;
+	int				rc;
+	DEFINE_WAIT(__wait);
 
-	if (copy_from_user(&karg, uarg, sizeof(StromCmd__StatInfo)))
-		return -EFAULT;
-	if (karg.version != 1)
+	if (!ring)
 		return -EINVAL;
-	if (!stat_info)
-		return -ENODATA;
+	if (copy_from_user(&karg, uarg, sizeof(StromCmd__RingEnter)))
+		return -EFAULT;
+	karg.nr_submitted = 0;
 
-	karg.tsc			= rdtsc();
-	karg.nr_ioctl_memcpy_submit = atomic64_read(&stat_nr_ioctl_memcpy_submit);
-	karg.clk_ioctl_memcpy_submit =atomic64_read(&stat_clk_ioctl_memcpy_submit);
-	karg.nr_ioctl_memcpy_wait = atomic64_read(&stat_nr_ioctl_memcpy_wait);
-	karg.clk_ioctl_memcpy_wait = atomic64_read(&stat_clk_ioctl_memcpy_wait);
-	karg.nr_ssd2gpu		= atomic64_read(&stat_nr_ssd2gpu);
-	karg.clk_ssd2gpu	= atomic64_read(&stat_clk_ssd2gpu);
-	karg.nr_setup_prps	= atomic64_read(&stat_nr_setup_prps);
-	karg.clk_setup_prps	= atomic64_read(&stat_clk_setup_prps);
-	karg.nr_submit_dma	= atomic64_read(&stat_nr_submit_dma);
-	karg.clk_submit_dma	= atomic64_read(&stat_clk_submit_dma);
-	karg.nr_wait_dtask	= atomic64_read(&stat_nr_wait_dtask);
-	karg.clk_wait_dtask	= atomic64_read(&stat_clk_wait_dtask);
-	karg.nr_wrong_wakeup = atomic64_read(&stat_nr_wrong_wakeup);
-	karg.total_dma_length = atomic64_read(&stat_total_dma_length);
-	karg.cur_dma_count	= atomic64_read(&stat_cur_dma_count);
-	karg.max_dma_count	= atomic64_xchg(&stat_max_dma_count, 0UL);
-	if ((karg.flags & NVME_STROM_STATFLAGS__DEBUG) != 0)
+	strom_ring_flush_overflow(fstate);
+
+	mutex_lock(&fstate->ring_mutex);
+	head = fstate->sq_head;
+	tail = ACCESS_ONCE(ring->sq_tail);
+	smp_rmb();
+	while (karg.nr_submitted < karg.to_submit && head != tail)
 	{
-		karg.nr_debug1	= atomic64_read(&stat_nr_debug1);
-		karg.clk_debug1	= atomic64_read(&stat_clk_debug1);
-		karg.nr_debug2	= atomic64_read(&stat_nr_debug2);
-		karg.clk_debug2	= atomic64_read(&stat_clk_debug2);
-		karg.nr_debug3	= atomic64_read(&stat_nr_debug3);
-		karg.clk_debug3	= atomic64_read(&stat_clk_debug3);
-		karg.nr_debug4	= atomic64_read(&stat_nr_debug4);
-		karg.clk_debug4	= atomic64_read(&stat_clk_debug4);
+		/*
+		 * CQE of the failure may be deferred, so its record is allocated
+		 * prior to the execution; SQE is never left unconsumed once executed.
+		 */
+		if (!rfail)
+		{
+			rfail = kmalloc(sizeof(strom_ring_failure), GFP_KERNEL);
+			if (!rfail)
+			{
+				retval = -ENOMEM;
+				break;
+			}
+		}
+		/* SQE is copied first, because application can overwrite it */
+		memcpy(&sqe, &fstate->sqes[head & (fstate->sq_entries - 1)],
+			   sizeof(StromRing__Sqe));
+		switch (sqe.opcode)
+		{
+			case STROM_IOCTL__MEMCPY_SSD2GPU:
+				rc = ioctl_memcpy_ssd2gpu(sqe.cmd,
+										  sizeof(StromCmd__MemCopySsdToGpu),
+										  ioctl_filp, &sqe);
+				break;
+			case STROM_IOCTL__MEMCPY_SSD2RAM:
+				rc = ioctl_memcpy_ssd2ram(sqe.cmd,
+										  sizeof(StromCmd__MemCopySsdToRam),
+										  ioctl_filp, &sqe);
+				break;
+			case STROM_IOCTL__MEMCPY_SSD2RAM_VEC:
+				rc = ioctl_memcpy_ssd2ram_vec(sqe.cmd, ioctl_filp, &sqe);
+				break;
+			default:
+				rc = -EINVAL;
+				break;
+		}
+		/* submission failure is also reported by CQE, or deferred */
+		if (rc)
+		{
+			spin_lock_irqsave(&fstate->lock, flags);
+			if (list_empty(&fstate->cq_failures) &&
+				__strom_ring_post_cqe(fstate, sqe.user_data, 0, rc))
+				rc = 0;
+			else
+			{
+				rfail->user_data = sqe.user_data;
+				rfail->status = rc;
+				list_add_tail(&rfail->chain, &fstate->cq_failures);
+				rfail = NULL;
+				fstate->ring->cq_overflow++;
+			}
+			spin_unlock_irqrestore(&fstate->lock, flags);
+		}
+		head++;
+		karg.nr_submitted++;
 	}
-	if (copy_to_user(uarg, &karg, sizeof(StromCmd__StatInfo)))
-		return -EFAULT;
-
-	return 0;
-}
+	kfree(rfail);
+	/* SQEs must be consumed prior to the head */
+	smp_mb();
+	fstate->sq_head = head;
+	ACCESS_ONCE(ring->sq_head) = head;
+	mutex_unlock(&fstate->ring_mutex);
+
+	if (karg.nr_submitted > 0)
+		wake_up_interruptible(&fstate->waitq);
+	else if (retval)
+		return retval;
 
-/* ================================================================
- *
- * file_operations of '/proc/nvme-strom' entry
- *
- * ================================================================
- */
-static const char  *strom_proc_signature =		\
-	"version: " NVME_STROM_VERSION "\n"			\
-	"target: " UTS_RELEASE "\n"					\
-	"build: " NVME_STROM_BUILD_TIMESTAMP "\n";
+	/*
+	 * wait for the completions, if required. Deferred CQEs are flushed
+	 * in TASK_RUNNING, because it acquires locks and releases DMA tasks.
+	 */
+	if (karg.min_complete > 0)
+	{
+		if (karg.min_complete > fstate->cq_entries)
+			retval = -EINVAL;
+		else
+		{
+			for (;;)
+			{
+				if (strom_ring_flush_overflow(fstate) >= karg.min_complete)
+					break;
+				prepare_to_wait(&fstate->waitq, &__wait, TASK_INTERRUPTIBLE);
+				/* recheck, not to miss the wakeup by the completion */
+				if (ACCESS_ONCE(fstate->cq_tail) -
+					ACCESS_ONCE(ring->cq_head) >= karg.min_complete)
+				{
+					finish_wait(&fstate->waitq, &__wait);
+					continue;
+				}
+				if (signal_pending(current))
+				{
+					retval = -ERESTARTSYS;
+					break;
+				}
+				schedule();
+				finish_wait(&fstate->waitq, &__wait);
+			}
+			finish_wait(&fstate->waitq, &__wait);
+		}
+	}
 
-static int
-strom_proc_open(struct inode *inode, struct file *filp)
-{
-	return 0;
+	if (copy_to_user(&uarg->nr_submitted, &karg.nr_submitted,
+					 sizeof(unsigned int)))
+		return -EFAULT;
+	return retval;
 }
 
-static ssize_t
-strom_proc_read(struct file *filp, char __user *buf, size_t len, loff_t *pos)
+static int
+strom_proc_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	size_t		sig_len = strlen(strom_proc_signature);
-
-	if (*pos >= sig_len)
-		return 0;
-	if (*pos + len >= sig_len)
-		len = sig_len - *pos;
-	if (copy_to_user(buf, strom_proc_signature + *pos, len))
-		return -EFAULT;
-	*pos += len;
+	strom_file_state *fstate = filp->private_data;
 
-	return len;
+	if (!fstate->ring)
+		return -EINVAL;
+	if (vma->vm_pgoff != 0 ||
+		vma->vm_end - vma->vm_start > fstate->ring_sz)
+		return -EINVAL;
+	return remap_vmalloc_range(vma, fstate->ring, 0);
 }
 
 static int
 strom_proc_release(struct inode *inode, struct file *filp)
 {
+	strom_file_state *fstate = filp->private_data;
+	strom_dma_task *dtask;
+	hugepage_dma_buffer *hd_buf;
 	int			i;
 
-	for (i=0; i < STROM_DMA_TASK_NSLOTS; i++)
+	/*
+	 * No DMA tasks are running here, because they hold reference to the
+	 * file handle. Unread events are discarded first.
+	 */
+	while (!list_empty(&fstate->events))
 	{
-		spinlock_t		   *lock = &strom_dma_task_locks[i];
-		struct list_head   *slot = &failed_dma_task_slots[i];
+		dtask = list_first_entry(&fstate->events,
+								 strom_dma_task, ev_chain);
+		list_del_init(&dtask->ev_chain);
+		if (dtask->dma_status && !dtask->reaped)
+			prNotice("Unreferenced asynchronous SSD2GPU DMA error "
+					 "(dma_task_id: %lu, status=%ld)",
+					 dtask->dma_task_id, dtask->dma_status);
+		strom_consume_dma_event(dtask);
+	}
+	while (!list_empty(&fstate->cq_overflow))
+	{
+		dtask = list_first_entry(&fstate->cq_overflow,
+								 strom_dma_task, ev_chain);
+		list_del_init(&dtask->ev_chain);
+		strom_consume_dma_event(dtask);
+	}
+	while (!list_empty(&fstate->cq_failures))
+	{
+		strom_ring_failure *rfail
+			= list_first_entry(&fstate->cq_failures,
+							   strom_ring_failure, chain);
+		list_del(&rfail->chain);
+		kfree(rfail);
+	}
+
+	/* reap the tasks not reported to anybody */
+	for (i=1; ; i++)
+	{
+		spinlock_t		   *lock;
 		unsigned long		flags;
-		strom_dma_task	   *dtask;
-		strom_dma_task	   *dnext;
+		unsigned long		dma_task_id;
+		bool				release_dtask = false;
 
+		rcu_read_lock();
+		dtask = idr_get_next(&strom_dma_task_idr, &i);
+		if (!dtask)
+		{
+			rcu_read_unlock();
+			break;
+		}
+		/* dtask is valid by the RCU grace period */
+		dma_task_id = dtask->dma_task_id;
+		lock = &strom_dma_task_locks[dtask->hindex];
 		spin_lock_irqsave(lock, flags);
-		list_for_each_entry_safe(dtask, dnext, slot, chain)
+		if (idr_find(&strom_dma_task_idr, i) == dtask &&
+			dtask->fstate == fstate &&
+			dtask->completed &&
+			!dtask->reaped)
 		{
-			if (dtask->ioctl_filp == filp)
-			{
+			if (dtask->dma_status)
 				prNotice("Unreferenced asynchronous SSD2GPU DMA error "
 						 "(dma_task_id: %lu, status=%ld)",
-						 dtask->dma_task_id, dtask->dma_status);
-				list_del_rcu(&dtask->chain);
-				kfree(dtask);
-			}
+						 dma_task_id, dtask->dma_status);
+			__strom_untrack_dma_task(dtask);
+			dtask->reaped = true;
+			dtask->fstate = NULL;
+			/* waiters from other file handle will release it */
+			release_dtask = __strom_dma_task_releasable(dtask);
 		}
 		spin_unlock_irqrestore(lock, flags);
+		rcu_read_unlock();
+
+		if (release_dtask)
+			strom_free_dma_task(dtask);
+	}
+	if (fstate->reg_files)
+	{
+		for (i=0; i < STROM_MAX_REGISTERED_FILES; i++)
+		{
+			strom_source_file *sfile = fstate->reg_files[i];
+
+			if (sfile)
+			{
+				fput(sfile->filp);
+				kfree(sfile);
+			}
+		}
+		kfree(fstate->reg_files);
 	}
+	idr_for_each_entry(&fstate->hd_buf_idr, hd_buf, i)
+		put_hugepage_dma_buffer(hd_buf);
+	idr_destroy(&fstate->hd_buf_idr);
+	if (fstate->ring)
+		vfree(fstate->ring);
+	kfree(fstate);
+
 	return 0;
 }
 
@@ -2197,11 +5518,16 @@ strom_proc_ioctl(struct file *ioctl_filp,
 			break;
 
 		case STROM_IOCTL__ALLOC_DMA_BUFFER:
-			retval = -ENOTSUPP;
+			retval = ioctl_alloc_dma_buffer((void __user *) arg);
 			break;
 
+		case STROM_IOCTL__MEMCPY_SSD2GPU_V1:
 		case STROM_IOCTL__MEMCPY_SSD2GPU:
-			retval = ioctl_memcpy_ssd2gpu((void __user *) arg, ioctl_filp);
+			retval = ioctl_memcpy_ssd2gpu((void __user *) arg,
+										  cmd == STROM_IOCTL__MEMCPY_SSD2GPU
+										  ? sizeof(StromCmd__MemCopySsdToGpu)
+										  : STROM_CMD__MEMCPY_SSD2GPU_V1_SZ,
+										  ioctl_filp, NULL);
 			if (stat_info)
 			{
 				tv2 = rdtsc();
@@ -2211,8 +5537,25 @@ strom_proc_ioctl(struct file *ioctl_filp,
 			}
 			break;
 
+		case STROM_IOCTL__MEMCPY_SSD2RAM_V1:
 		case STROM_IOCTL__MEMCPY_SSD2RAM:
-			retval = ioctl_memcpy_ssd2ram((void __user *) arg, ioctl_filp);
+			retval = ioctl_memcpy_ssd2ram((void __user *) arg,
+										  cmd == STROM_IOCTL__MEMCPY_SSD2RAM
+										  ? sizeof(StromCmd__MemCopySsdToRam)
+										  : STROM_CMD__MEMCPY_SSD2RAM_V1_SZ,
+										  ioctl_filp, NULL);
+			if (stat_info)
+			{
+				tv2 = rdtsc();
+				atomic64_inc(&stat_nr_ioctl_memcpy_submit);
+				atomic64_add((u64)(tv2 > tv1 ? tv2 - tv1 : 0),
+							 &stat_clk_ioctl_memcpy_submit);
+			}
+			break;
+
+		case STROM_IOCTL__MEMCPY_SSD2RAM_VEC:
+			retval = ioctl_memcpy_ssd2ram_vec((void __user *) arg,
+											  ioctl_filp, NULL);
 			if (stat_info)
 			{
 				tv2 = rdtsc();
@@ -2222,8 +5565,24 @@ strom_proc_ioctl(struct file *ioctl_filp,
 			}
 			break;
 
+		case STROM_IOCTL__MEMCPY_WAIT_V1:
 		case STROM_IOCTL__MEMCPY_WAIT:
-			retval = ioctl_memcpy_wait((void __user *) arg, ioctl_filp);
+			retval = ioctl_memcpy_wait((void __user *) arg,
+									   cmd == STROM_IOCTL__MEMCPY_WAIT
+									   ? sizeof(StromCmd__MemCopyWait)
+									   : STROM_CMD__MEMCPY_WAIT_V1_SZ,
+									   ioctl_filp);
+			if (stat_info)
+			{
+				tv2 = rdtsc();
+				atomic64_inc(&stat_nr_ioctl_memcpy_wait);
+				atomic64_add((u64)(tv2 > tv1 ? tv2 - tv1 : 0),
+							 &stat_clk_ioctl_memcpy_wait);
+			}
+			break;
+
+		case STROM_IOCTL__MEMCPY_WAIT_MANY:
+			retval = ioctl_memcpy_wait_many((void __user *) arg, ioctl_filp);
 			if (stat_info)
 			{
 				tv2 = rdtsc();
@@ -2233,6 +5592,47 @@ strom_proc_ioctl(struct file *ioctl_filp,
 			}
 			break;
 
+		case STROM_IOCTL__MEMCPY_CANCEL:
+			retval = ioctl_memcpy_cancel((void __user *) arg, ioctl_filp);
+			break;
+
+		case STROM_IOCTL__ENABLE_EVENTS:
+			retval = ioctl_enable_events(ioctl_filp);
+			break;
+
+		case STROM_IOCTL__REGISTER_FILE:
+			retval = ioctl_register_file((void __user *) arg, ioctl_filp);
+			break;
+
+		case STROM_IOCTL__UNREGISTER_FILE:
+			retval = ioctl_unregister_file((void __user *) arg, ioctl_filp);
+			break;
+
+		case STROM_IOCTL__REGISTER_DMA_BUFFER:
+			retval = ioctl_register_dma_buffer((void __user *) arg,
+											   ioctl_filp);
+			break;
+
+		case STROM_IOCTL__UNREGISTER_DMA_BUFFER:
+			retval = ioctl_unregister_dma_buffer((void __user *) arg,
+												 ioctl_filp);
+			break;
+
+		case STROM_IOCTL__SETUP_RING:
+			retval = ioctl_setup_ring((void __user *) arg, ioctl_filp);
+			break;
+
+		case STROM_IOCTL__RING_ENTER:
+			retval = ioctl_ring_enter((void __user *) arg, ioctl_filp);
+			if (stat_info)
+			{
+				tv2 = rdtsc();
+				atomic64_inc(&stat_nr_ioctl_memcpy_submit);
+				atomic64_add((u64)(tv2 > tv1 ? tv2 - tv1 : 0),
+							 &stat_clk_ioctl_memcpy_submit);
+			}
+			break;
+
 		case STROM_IOCTL__STAT_INFO:
 			retval = ioctl_stat_info_command((void __user *) arg);
 			break;
@@ -2249,6 +5649,8 @@ static const struct file_operations nvme_strom_fops = {
 	.owner			= THIS_MODULE,
 	.open			= strom_proc_open,
 	.read			= strom_proc_read,
+	.poll			= strom_proc_poll,
+	.mmap			= strom_proc_mmap,
 	.release		= strom_proc_release,
 	.unlocked_ioctl	= strom_proc_ioctl,
 	.compat_ioctl	= strom_proc_ioctl,
@@ -2259,21 +5661,23 @@ int	__init nvme_strom_init(void)
 {
 	int			i, rc;
 
-	/* init strom_mgmem_mutex/slots */
+	/* init strom_mgmem_locks */
 	for (i=0; i < MAPPED_GPU_MEMORY_NSLOTS; i++)
 	{
 		spin_lock_init(&strom_mgmem_locks[i]);
-		INIT_LIST_HEAD(&strom_mgmem_slots[i]);
 	}
 
-	/* init strom_dma_task_locks/slots */
+	/* init strom_extent_locks/slots */
+	strom_init_extent_cache();
+
+	/* init slab caches and mempools */
+	rc = strom_init_mempools();
+	if (rc)
+		return rc;
+
+	/* init strom_dma_task_locks */
 	for (i=0; i < STROM_DMA_TASK_NSLOTS; i++)
-	{
 		spin_lock_init(&strom_dma_task_locks[i]);
-		INIT_LIST_HEAD(&strom_dma_task_slots[i]);
-		INIT_LIST_HEAD(&failed_dma_task_slots[i]);
-		init_waitqueue_head(&strom_dma_task_waitq[i]);
-	}
 	/* solve mandatory symbols */
 	rc = strom_init_extra_symbols();
 	if (rc)
@@ -2282,6 +5686,10 @@ int	__init nvme_strom_init(void)
 	rc = strom_init_prps_item_buffer();
 	if (rc)
 		goto error_2;
+	/* scratch pages to read through the gap between extents */
+	rc = strom_init_scratch_pages();
+	if (rc)
+		goto error_3;
 	/* make "/proc/nvme-strom" entry */
 	nvme_strom_proc = proc_create("nvme-strom",
 								  0444,
@@ -2290,24 +5698,34 @@ int	__init nvme_strom_init(void)
 	if (!nvme_strom_proc)
 	{
 		rc = -ENOMEM;
-		goto error_3;
+		goto error_4;
 	}
 	prNotice("/proc/nvme-strom entry was registered");
 
 	return 0;
 
+error_4:
+	strom_exit_scratch_pages();
 error_3:
 	strom_exit_prps_item_buffer();
 error_2:
 	strom_exit_extra_symbols();
 error_1:
+	strom_exit_mempools();
 	return rc;
 }
 module_init(nvme_strom_init);
 
 void __exit nvme_strom_exit(void)
 {
+	/* wait for the deferred release of pinned DMA buffers */
+	flush_scheduled_work();
+	strom_exit_scratch_pages();
 	strom_exit_prps_item_buffer();
+	strom_exit_extent_cache();
+	strom_exit_mempools();
+	idr_destroy(&strom_dma_task_idr);
+	idr_destroy(&strom_mgmem_idr);
 	strom_exit_extra_symbols();
 	proc_remove(nvme_strom_proc);
 	prNotice("/proc/nvme-strom entry was unregistered");
@@ -9,6 +9,7 @@
 #ifndef NVME_STROM_H
 #define NVME_STROM_H
 #ifndef __KERNEL__
+#include <stddef.h>
 #include <stdint.h>
 #define __user
 #endif
@@ -21,12 +22,38 @@ enum {
 	STROM_IOCTL__LIST_GPU_MEMORY	= _IO('S',0x83),
 	STROM_IOCTL__INFO_GPU_MEMORY	= _IO('S',0x84),
 	STROM_IOCTL__ALLOC_DMA_BUFFER	= _IO('S',0x85),
-	STROM_IOCTL__MEMCPY_SSD2GPU		= _IO('S',0x90),
-	STROM_IOCTL__MEMCPY_SSD2RAM		= _IO('S',0x91),
-	STROM_IOCTL__MEMCPY_WAIT		= _IO('S',0x92),
+	STROM_IOCTL__MEMCPY_SSD2GPU_V1	= _IO('S',0x90),
+	STROM_IOCTL__MEMCPY_SSD2RAM_V1	= _IO('S',0x91),
+	STROM_IOCTL__MEMCPY_WAIT_V1		= _IO('S',0x92),
+	STROM_IOCTL__MEMCPY_WAIT_MANY	= _IO('S',0x93),
+	STROM_IOCTL__ENABLE_EVENTS		= _IO('S',0x94),
+	STROM_IOCTL__SETUP_RING			= _IO('S',0x95),
+	STROM_IOCTL__RING_ENTER			= _IO('S',0x96),
+	STROM_IOCTL__MEMCPY_SSD2RAM_VEC	= _IO('S',0x97),
+	STROM_IOCTL__REGISTER_FILE		= _IO('S',0x98),
 	STROM_IOCTL__STAT_INFO			= _IO('S',0x99),
+	STROM_IOCTL__UNREGISTER_FILE	= _IO('S',0x9a),
+	STROM_IOCTL__REGISTER_DMA_BUFFER = _IO('S',0x9b),
+	STROM_IOCTL__UNREGISTER_DMA_BUFFER = _IO('S',0x9c),
+	STROM_IOCTL__MEMCPY_CANCEL		= _IO('S',0x9d),
+	STROM_IOCTL__MEMCPY_SSD2GPU		= _IO('S',0x9e),
+	STROM_IOCTL__MEMCPY_SSD2RAM		= _IO('S',0x9f),
+	STROM_IOCTL__MEMCPY_WAIT		= _IO('S',0xa0),
 };
 
+/*
+ * STROM_IOCTL__MEMCPY_*_V1 are the original forms of the commands, for the
+ * binaries built prior to the extension of arguments. _IO() does not encode
+ * the argument size, so kernel reads only the leading fields below (the
+ * original layout), and considers the extended fields as zero.
+ */
+#define STROM_CMD__MEMCPY_SSD2GPU_V1_SZ		\
+	offsetof(StromCmd__MemCopySsdToGpu, flags)
+#define STROM_CMD__MEMCPY_SSD2RAM_V1_SZ		\
+	offsetof(StromCmd__MemCopySsdToRam, flags)
+#define STROM_CMD__MEMCPY_WAIT_V1_SZ		\
+	offsetof(StromCmd__MemCopyWait, timeout_ms)
+
 /* path of ioctl(2) entrypoint */
 #define NVME_STROM_IOCTL_PATHNAME		"/proc/nvme-strom"
 
@@ -42,6 +69,42 @@ typedef struct StromCmd__CheckFile
 	int				support_dma64;
 } StromCmd__CheckFile;
 
+/*
+ * STROM_IOCTL__REGISTER_FILE / STROM_IOCTL__UNREGISTER_FILE
+ *
+ * It validates the source file once, then keeps it on the file handle of
+ * the ioctl(2). MEMCPY commands with NVME_STROM_MEMCPY_FLAGS__REGISTERED_FILE
+ * refer to the registered file by @file_index, instead of file descriptor.
+ * Registration is released on UNREGISTER_FILE or close of the file handle.
+ */
+typedef struct StromCmd__RegisterFile
+{
+	int				fdesc;		/* in: file descriptor to be registered
+								 *     (ignored on UNREGISTER_FILE) */
+	int				file_index;	/* out: index of the registered file
+								 * in: index to be released on
+								 *     UNREGISTER_FILE */
+} StromCmd__RegisterFile;
+
+/*
+ * STROM_IOCTL__REGISTER_DMA_BUFFER / STROM_IOCTL__UNREGISTER_DMA_BUFFER
+ *
+ * It pins the huge-pages of the host DMA buffer once, then keeps them on
+ * the file handle of the ioctl(2). The buffer must be either of hugetlb or
+ * mapped from STROM_IOCTL__ALLOC_DMA_BUFFER; EINVAL for the normal pages. SSD2RAM commands with
+ * NVME_STROM_MEMCPY_FLAGS__REGISTERED_BUFFER refer to the registered buffer
+ * by @dest_handle, without page table walks. Registration is released on
+ * UNREGISTER_DMA_BUFFER or close of the file handle.
+ */
+typedef struct StromCmd__RegisterDmaBuffer
+{
+	void __user	   *uaddr;		/* in: head of the huge-page DMA buffer */
+	size_t			length;		/* in: length of the DMA buffer */
+	unsigned long	handle;		/* out: handle of the registered buffer
+								 * in: handle to be released on
+								 *     UNREGISTER_DMA_BUFFER */
+} StromCmd__RegisterDmaBuffer;
+
 /* STROM_IOCTL__MAP_GPU_MEMORY */
 typedef struct StromCmd__MapGpuMemory
 {
@@ -80,6 +143,48 @@ typedef struct StromCmd__InfoGpuMemory
 	uint64_t		paddrs[1];	/* out: array of physical addresses */
 } StromCmd__InfoGpuMemory;
 
+/* flags for STROM_IOCTL__MEMCPY_SSD2GPU/SSD2RAM */
+#define NVME_STROM_MEMCPY_FLAGS__SORT_BY_LBA	0x0001	/* submit chunks in
+														 * order of LBA */
+#define NVME_STROM_MEMCPY_FLAGS__REGISTERED_FILE 0x0002	/* file_desc is an
+														 * index of the
+														 * registered file */
+#define NVME_STROM_MEMCPY_FLAGS__REGISTERED_BUFFER 0x0004 /* dest_uaddr is in
+														 * the registered
+														 * DMA buffer of
+														 * dest_handle */
+#define NVME_STROM_MEMCPY_FLAGS__PROGRESS_MAP	0x0008	/* SSD2RAM reports the
+														 * landed chunks on
+														 * progress_map */
+#define NVME_STROM_MEMCPY_FLAGS__DOORBELL		0x0010	/* write doorbell_value
+														 * to doorbell on
+														 * completion */
+
+/*
+ * Progress map of SSD2RAM
+ *
+ * If NVME_STROM_MEMCPY_FLAGS__PROGRESS_MAP is given, kernel sets bit (i % 64)
+ * of progress_map[i / 64] once the i-th chunk of the destination buffer
+ * gets landed, prior to completion of the whole DMA task. So, application
+ * can process the landed chunks while the rest of DMA is still in flight.
+ * Application must clear the bitmap (one bit per chunk) prior to the ioctl,
+ * and must keep it until completion of the DMA task. It has to be 8 bytes
+ * aligned, and up to NVME_STROM_PROGRESS_MAP_MAX_CHUNKS bits.
+ */
+#define NVME_STROM_PROGRESS_MAP_MAX_CHUNKS	(4096 * 8)
+
+/*
+ * Doorbell mode
+ *
+ * If NVME_STROM_MEMCPY_FLAGS__DOORBELL is given, kernel writes @doorbell_value
+ * to the 64bit word at @doorbell on completion of the DMA task, so consumers
+ * can detect the completion by plain load, without system calls. The word
+ * is written after the task gets completed, regardless of its status;
+ * STROM_IOCTL__MEMCPY_WAIT with negative timeout_ms fetches the status
+ * without sleep. The word has to be 8 bytes aligned, on private anonymous
+ * memory, and must be kept until completion of the DMA task.
+ */
+
 /* STROM_IOCTL__MEMCPY_SSD2GPU */
 typedef struct StromCmd__MemCopySsdToGpu
 {
@@ -95,19 +200,93 @@ typedef struct StromCmd__MemCopySsdToGpu
 	unsigned int	chunk_sz;	/* in: chunk-size (BLCKSZ in PostgreSQL) */
 	unsigned int	relseg_sz;	/* in: # of chunks per file. (RELSEG_SIZE
 								 *     in PostgreSQL). 0 means no boundary. */
-	uint32_t __user *chunk_ids;	/* in: array of BlockNumber in PostgreSQL */
+	uint32_t __user *chunk_ids;	/* in: array of BlockNumber in PostgreSQL
+								 * out: chunk_ids in order of the destination
+								 *      (SSD2GPU chunks from the head, then
+								 *       RAM2GPU chunks from the tail) */
 	char __user	   *wb_buffer;	/* in: write-back buffer in user space;
 								 * consumed from the tail, and must be at least
 								 * chunk_sz * nr_chunks bytes. */
+	unsigned int	flags;		/* in: NVME_STROM_MEMCPY_FLAGS__* */
+	uint64_t __user *doorbell;	/* in: word to be written on completion,
+								 *     if DOORBELL */
+	uint64_t		doorbell_value; /* in: value to be written on @doorbell */
 } StromCmd__MemCopySsdToGpu;
 
-/* STROM_IOCTL__MEMCPY_WAIT */
+/*
+ * STROM_IOCTL__MEMCPY_WAIT
+ *
+ * It waits for completion of the DMA task, then reaps its status. Once
+ * reaped, the ID is no longer valid. If the status is delivered as an event
+ * or a CQE, it is not reaped here, and EBUSY is returned on completion. It returns ENOENT for unknown or
+ * already reaped tasks, and EPERM for tasks submitted via other file handle.
+ */
 typedef struct StromCmd__MemCopyWait
 {
 	unsigned long	dma_task_id;/* in: ID of the DMA task to wait */
 	long			status;		/* out: status of the DMA task */
+	int				timeout_ms;	/* in: timeout in milliseconds. 0 means no
+								 *     timeout, negative means no wait.
+								 *     ETIMEDOUT or EAGAIN is returned if
+								 *     the task is still running. */
 } StromCmd__MemCopyWait;
 
+/*
+ * STROM_IOCTL__MEMCPY_CANCEL
+ *
+ * It stops submission of the remaining chunks of the DMA task. Kernel writes
+ * @dma_task_id of the MEMCPY_* argument prior to the submission, so another
+ * thread can cancel the task while the submitter is still running; then the
+ * submitter returns ECANCELED once the NVMe commands in flight are drained.
+ * Elsewhere, NVMe commands in flight are not aborted, so the destination
+ * buffer may still be written until completion. The task has to be waited
+ * for, then MEMCPY_WAIT returns ECANCELED unless it failed by other errors.
+ * It returns ENOENT if the task is already reaped.
+ */
+typedef struct StromCmd__MemCopyCancel
+{
+	unsigned long	dma_task_id;/* in: ID of the DMA task to cancel */
+} StromCmd__MemCopyCancel;
+
+/* STROM_IOCTL__MEMCPY_WAIT_MANY */
+#define NVME_STROM_WAIT_MANY__ANY		0	/* wait for any of the tasks */
+#define NVME_STROM_WAIT_MANY__ALL		1	/* wait for all the tasks */
+#define NVME_STROM_WAIT_MANY__AT_LEAST	2	/* wait for @min_tasks tasks */
+#define NVME_STROM_WAIT_MANY_MAX_TASKS	4096	/* max @nr_tasks per call */
+
+typedef struct StromCmd__MemCopyWaitMany
+{
+	unsigned int	nr_tasks;	/* in: length of the arrays below */
+	unsigned int	mode;		/* in: one of NVME_STROM_WAIT_MANY__* */
+	unsigned int	min_tasks;	/* in: # of tasks to wait for, if AT_LEAST */
+	int				timeout_ms;	/* in: timeout in milliseconds. 0 means no
+								 *     timeout, negative means no wait.
+								 *     ETIMEDOUT or EAGAIN is returned if
+								 *     not satisfied. */
+	unsigned int	nr_completed; /* out: # of completed tasks */
+	unsigned long __user *dma_task_ids;	/* in: IDs of the DMA tasks */
+	long __user	   *status;		/* out: status of the completed tasks */
+	uint8_t __user *completed;	/* out: non-zero, if the task is completed.
+								 *      Completed tasks are released, so
+								 *      don't wait for them again. */
+} StromCmd__MemCopyWaitMany;
+
+/*
+ * STROM_IOCTL__ENABLE_EVENTS (no argument)
+ *
+ * Once enabled, the DMA tasks submitted via this file handle report their
+ * completion as the event record below, readable by read(2) and pollable by
+ * poll(2)/epoll(7). It cannot be disabled. The result of the task is
+ * reported only by the event; MEMCPY_WAIT on the completed task returns
+ * EBUSY (WAIT_MANY reports -EBUSY as its status) until the event is read,
+ * then ENOENT.
+ */
+typedef struct StromEvent__DmaTaskDone
+{
+	unsigned long	dma_task_id;/* ID of the completed DMA task */
+	long			status;		/* status of the DMA task */
+} StromEvent__DmaTaskDone;
+
 /* STROM_IOCTL__MEMCPY_SSD2RAM */
 typedef struct StromCmd__MemCopySsdToRam
 {
@@ -126,14 +305,145 @@ typedef struct StromCmd__MemCopySsdToRam
 	unsigned int	relseg_sz;	/* in: # of chunks per file. (RELSEG_SIZE
 								 *     in PostgreSQL). 0 means no boundary. */
 	uint32_t __user *chunk_ids;	/* in: # of chunks per file (RELSEG_SIZE in
-								 *     PostgreSQL). 0 means no boundary. */
+								 *     PostgreSQL). 0 means no boundary.
+								 * out: chunk_ids in order of the destination,
+								 *      only if SORT_BY_LBA is given. SSD2RAM
+								 *      chunks are located from the head, then
+								 *      RAM2RAM chunks from the tail. */
+	unsigned int	flags;		/* in: NVME_STROM_MEMCPY_FLAGS__* */
+	unsigned long	dest_handle;/* in: handle of the registered DMA buffer,
+								 *     if REGISTERED_BUFFER */
+	uint64_t __user *progress_map; /* in: bitmap of the landed chunks,
+								 *     if PROGRESS_MAP */
+	uint64_t __user *doorbell;	/* in: word to be written on completion,
+								 *     if DOORBELL */
+	uint64_t		doorbell_value; /* in: value to be written on @doorbell */
 } StromCmd__MemCopySsdToRam;
 
-/* STROM_IOCTL__ALLOC_DMA_BUFFER */
+/*
+ * STROM_IOCTL__MEMCPY_SSD2RAM_VEC
+ *
+ * A vectored version of STROM_IOCTL__MEMCPY_SSD2RAM; chunks of multiple
+ * source files are loaded under a single DMA task. Destination of the
+ * segments are consecutive from @dest_uaddr in order of @segs, and each
+ * segment is laid out as STROM_IOCTL__MEMCPY_SSD2RAM doing.
+ */
+#define NVME_STROM_MEMCPY_VEC_MAX_SEGS	1024
+
+typedef struct StromCmd__MemCopySsdToRamSeg
+{
+	int				file_desc;	/* in: file descriptor of the source file */
+	unsigned int	nr_chunks;	/* in: number of chunks */
+	uint32_t __user *chunk_ids;	/* in/out: same as MEMCPY_SSD2RAM */
+	unsigned int	nr_ram2ram;	/* out: # of RAM2RAM chunks */
+	unsigned int	nr_ssd2ram;	/* out: # of SSD2RAM chunks */
+} StromCmd__MemCopySsdToRamSeg;
+
+typedef struct StromCmd__MemCopySsdToRamVec
+{
+	unsigned long	dma_task_id;/* out: ID of the DMA task */
+	unsigned int	nr_ram2ram;	/* out: # of RAM2RAM chunks in total */
+	unsigned int	nr_ssd2ram;	/* out: # of SSD2RAM chunks in total */
+	unsigned int	nr_dma_submit; /* out: # of SSD2RAM DMA submit */
+	unsigned int	nr_dma_blocks; /* out: # of SSD2RAM DMA blocks */
+	void __user	   *dest_uaddr;	/* in: head of the destination buffer */
+	unsigned int	chunk_sz;	/* in: chunk-size (BLCKSZ in PostgreSQL) */
+	unsigned int	relseg_sz;	/* in: # of chunks per file. (RELSEG_SIZE
+								 *     in PostgreSQL). 0 means no boundary. */
+	unsigned int	flags;		/* in: NVME_STROM_MEMCPY_FLAGS__* */
+	unsigned long	dest_handle;/* in: handle of the registered DMA buffer,
+								 *     if REGISTERED_BUFFER */
+	unsigned int	nr_segs;	/* in: length of @segs */
+	StromCmd__MemCopySsdToRamSeg __user *segs; /* in/out: source segments */
+	uint64_t __user *progress_map; /* in: bitmap of the landed chunks over
+								 *     all the segments, if PROGRESS_MAP */
+	uint64_t __user *doorbell;	/* in: word to be written on completion,
+								 *     if DOORBELL */
+	uint64_t		doorbell_value; /* in: value to be written on @doorbell */
+} StromCmd__MemCopySsdToRamVec;
+
+/*
+ * STROM_IOCTL__SETUP_RING
+ *
+ * It sets up a pair of submission (SQ) and completion (CQ) rings on the
+ * file handle, then application maps them by mmap(2) on the file handle
+ * with offset 0 and @ring_sz. Application puts SQEs then advances sq_tail,
+ * and kernel consumes them on STROM_IOCTL__RING_ENTER. Kernel puts a CQE
+ * for each submitted SQE on completion of the DMA task, or submission
+ * failure, then advances cq_tail. Application consumes them and advances
+ * cq_head. A ring can be set up only once per file handle.
+ */
+typedef struct StromCmd__SetupRing
+{
+	unsigned int	sq_entries;	/* in: # of SQ entries
+								 * out: rounded up to power of 2 */
+	unsigned int	cq_entries;	/* in: # of CQ entries, or 0 for twice of
+								 *     sq_entries.
+								 * out: rounded up to power of 2 */
+	unsigned int	sq_offset;	/* out: offset of the SQE array */
+	unsigned int	cq_offset;	/* out: offset of the CQE array */
+	size_t			ring_sz;	/* out: length of the ring to be mapped */
+} StromCmd__SetupRing;
+
+/* header of the ring, at the head of the mapped area */
+typedef struct StromRing__Header
+{
+	volatile unsigned int sq_head;	/* updated by kernel */
+	volatile unsigned int sq_tail;	/* updated by application */
+	unsigned int	sq_mask;
+	unsigned int	sq_entries;
+	volatile unsigned int cq_head;	/* updated by application */
+	volatile unsigned int cq_tail;	/* updated by kernel */
+	unsigned int	cq_mask;
+	unsigned int	cq_entries;
+	volatile unsigned int cq_overflow; /* # of CQEs deferred by CQ full */
+} StromRing__Header;
+
+/* submission queue entry */
+typedef struct StromRing__Sqe
+{
+	unsigned int	opcode;		/* STROM_IOCTL__MEMCPY_SSD2GPU,
+								 * STROM_IOCTL__MEMCPY_SSD2RAM or
+								 * STROM_IOCTL__MEMCPY_SSD2RAM_VEC */
+	unsigned int	__padding;
+	unsigned long	user_data;	/* copied to the CQE as is */
+	void __user	   *cmd;		/* StromCmd__MemCopySsdTo* according to
+								 * @opcode; it is written back as ioctl(2)
+								 * doing */
+} StromRing__Sqe;
+
+/* completion queue entry */
+typedef struct StromRing__Cqe
+{
+	unsigned long	user_data;	/* user_data of the SQE */
+	unsigned long	dma_task_id;/* ID of the DMA task, or 0 if submission
+								 * failed */
+	long			status;		/* status of the DMA task, or negative
+								 * errno on submission failure */
+} StromRing__Cqe;
+
+/* STROM_IOCTL__RING_ENTER */
+typedef struct StromCmd__RingEnter
+{
+	unsigned int	to_submit;	/* in: max # of SQEs to be consumed */
+	unsigned int	min_complete; /* in: wait until CQ has this number of
+								 *     entries at least */
+	unsigned int	nr_submitted; /* out: # of consumed SQEs */
+} StromCmd__RingEnter;
+
+/*
+ * STROM_IOCTL__ALLOC_DMA_BUFFER
+ *
+ * It allocates physically continuous 2MB chunks, then returns an anonymous
+ * file descriptor to be mapped by mmap(2) with MAP_SHARED. The mapped area
+ * can be used as destination of SSD2RAM without huge-page reservation.
+ * It requires CAP_IPC_LOCK, because the chunks are never swapped out.
+ */
 typedef struct StromCmd__AllocDMABuffer
 {
-	size_t			length;		/* in: required length of DMA buffer */
-	int				node_id;	/* in: numa-id to be located */
+	size_t			length;		/* in: required length of DMA buffer; it
+								 *     is rounded up to 2MB boundary */
+	int				node_id;	/* in: numa-id to be located, or -1 */
 	int				dmabuf_fdesc; /* out: FD of anon file descriptor */
 } StromCmd__AllocDMABuffer;
 
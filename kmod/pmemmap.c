@@ -32,8 +32,7 @@
 
 struct mapped_gpu_memory
 {
-	struct list_head	chain;		/* chain to the strom_mgmem_slots[] */
-	int					hindex;		/* index of the hash slot */
+	int					hindex;		/* index of the lock slot */
 	int					refcnt;		/* number of the concurrent tasks */
 	kuid_t				owner;		/* effective user-id who mapped this
 									 * device memory */
@@ -75,10 +74,17 @@ typedef struct mapped_gpu_memory	mapped_gpu_memory;
 #define MAPPED_GPU_MEMORY_NSLOTS_BITS	6
 #define MAPPED_GPU_MEMORY_NSLOTS		(1UL << MAPPED_GPU_MEMORY_NSLOTS_BITS)
 static spinlock_t		strom_mgmem_locks[MAPPED_GPU_MEMORY_NSLOTS];
-static struct list_head	strom_mgmem_slots[MAPPED_GPU_MEMORY_NSLOTS];
+/*
+ * strom_mgmem_idr - handle to mapped_gpu_memory. Entry is detached under
+ * the lock slot, thus, mapped_gpu_memory found under the lock slot is valid
+ * until the lock is released. strom_mgmem_idr_lock is acquired after the
+ * lock slot, if both.
+ */
+static DEFINE_SPINLOCK(strom_mgmem_idr_lock);
+static DEFINE_IDR(strom_mgmem_idr);
 
 /*
- * strom_mapped_gpu_memory_index - index of strom_mgmem_mutex/slots
+ * strom_mapped_gpu_memory_index - index of strom_mgmem_locks
  */
 static inline int
 strom_mapped_gpu_memory_index(unsigned long handle)
@@ -86,6 +92,46 @@ strom_mapped_gpu_memory_index(unsigned long handle)
 	return hash_long(handle, MAPPED_GPU_MEMORY_NSLOTS_BITS);
 }
 
+/*
+ * __strom_lookup_mapped_gpu_memory - lookup the mapped_gpu_memory by the
+ * handle. Caller must hold the lock slot.
+ */
+static mapped_gpu_memory *
+__strom_lookup_mapped_gpu_memory(unsigned long handle, int index)
+{
+	mapped_gpu_memory  *mgmem;
+
+	if (handle == 0 || handle > INT_MAX)
+		return NULL;
+	rcu_read_lock();
+	mgmem = idr_find(&strom_mgmem_idr, (int)handle);
+	rcu_read_unlock();
+	/*
+	 * NOTE: I'm not 100% certain whether UID is the right check to
+	 * determine availability of the virtual address of GPU device.
+	 * So, this behavior may be changed in the later version.
+	 */
+	if (!mgmem || !uid_eq(mgmem->owner, current_euid()))
+		return NULL;
+	Assert(mgmem->hindex == index);
+	return mgmem;
+}
+
+/*
+ * __strom_untrack_mapped_gpu_memory - detach the mapped_gpu_memory from
+ * the IDR, if still tracked. Caller must hold the lock slot.
+ */
+static void
+__strom_untrack_mapped_gpu_memory(mapped_gpu_memory *mgmem)
+{
+	int		handle = (int)mgmem->handle;
+
+	spin_lock(&strom_mgmem_idr_lock);
+	if (idr_find(&strom_mgmem_idr, handle) == mgmem)
+		idr_remove(&strom_mgmem_idr, handle);
+	spin_unlock(&strom_mgmem_idr_lock);
+}
+
 /*
  * strom_get_mapped_gpu_memory
  */
@@ -94,25 +140,17 @@ strom_get_mapped_gpu_memory(unsigned long handle)
 {
 	int					index = strom_mapped_gpu_memory_index(handle);
 	spinlock_t		   *lock = &strom_mgmem_locks[index];
-	struct list_head   *slot = &strom_mgmem_slots[index];
 	unsigned long		flags;
 	mapped_gpu_memory  *mgmem;
 
 	spin_lock_irqsave(lock, flags);
-	list_for_each_entry(mgmem, slot, chain)
+	mgmem = __strom_lookup_mapped_gpu_memory(handle, index);
+	if (mgmem)
 	{
-		if (mgmem->handle == handle &&
-			uid_eq(mgmem->owner, current_euid()))
-		{
-			/* sanity checks */
-			Assert((unsigned long)mgmem == handle);
-			Assert(mgmem->hindex == index);
-
-			mgmem->refcnt++;
-			spin_unlock_irqrestore(lock, flags);
+		mgmem->refcnt++;
+		spin_unlock_irqrestore(lock, flags);
 
-			return mgmem;
-		}
+		return mgmem;
 	}
 	spin_unlock_irqrestore(lock, flags);
 
@@ -155,19 +193,12 @@ callback_release_mapped_gpu_memory(void *private)
 	unsigned long		flags;
 	int					rc;
 
-	/* sanity check */
-	Assert((unsigned long)mgmem == handle);
-
 	spin_lock_irqsave(lock, flags);
 	/*
-	 * Detach this mapped GPU memory from the global list first, if
-	 * application didn't unmap explicitly.
+	 * Detach this mapped GPU memory from the IDR first, if application
+	 * didn't unmap explicitly.
 	 */
-	if (mgmem->chain.next || mgmem->chain.prev)
-	{
-		list_del(&mgmem->chain);
-		memset(&mgmem->chain, 0, sizeof(struct list_head));
-	}
+	__strom_untrack_mapped_gpu_memory(mgmem);
 
 	/*
 	 * wait for completion of the concurrent DMA tasks, if any tasks
@@ -202,7 +233,7 @@ callback_release_mapped_gpu_memory(void *private)
 				handle, rc);
 	kfree(mgmem);
 
-	prNotice("P2P GPU Memory (handle=%p) was released", (void *)handle);
+	prNotice("P2P GPU Memory (handle=%lu) was released", handle);
 
 	module_put(THIS_MODULE);
 }
@@ -233,11 +264,22 @@ ioctl_map_gpu_memory(StromCmd__MapGpuMemory __user *uarg)
 	if (!mgmem)
 		return -ENOMEM;
 
+	/* reserve a handle; not visible until mapping gets completed */
+	idr_preload(GFP_KERNEL);
+	spin_lock_irqsave(&strom_mgmem_idr_lock, flags);
+	rc = idr_alloc_cyclic(&strom_mgmem_idr, NULL, 1, 0, GFP_NOWAIT);
+	spin_unlock_irqrestore(&strom_mgmem_idr_lock, flags);
+	idr_preload_end();
+	if (rc < 0)
+	{
+		kfree(mgmem);
+		return rc;
+	}
+	handle = rc;
+
 	map_address = karg.vaddress & GPU_BOUND_MASK;
 	map_offset  = karg.vaddress & GPU_BOUND_OFFSET;
-	handle = (unsigned long) mgmem;
 
-	INIT_LIST_HEAD(&mgmem->chain);
 	mgmem->hindex		= strom_mapped_gpu_memory_index(handle);
 	mgmem->refcnt		= 0;
 	mgmem->owner		= current_euid();
@@ -305,9 +347,9 @@ ioctl_map_gpu_memory(StromCmd__MapGpuMemory __user *uarg)
 		goto error_2;
 	}
 
-	prNotice("P2P GPU Memory (handle=%p) mapped "
+	prNotice("P2P GPU Memory (handle=%lu) mapped "
 			 "(version=%u, page_size=%zu, entries=%u)",
-			 (void *)mgmem->handle,
+			 mgmem->handle,
 			 mgmem->page_table->version,
 			 mgmem->gpu_page_sz,
 			 mgmem->page_table->entries);
@@ -329,7 +371,9 @@ ioctl_map_gpu_memory(StromCmd__MapGpuMemory __user *uarg)
 
 	/* attach this mapped_gpu_memory */
 	spin_lock_irqsave(&strom_mgmem_locks[mgmem->hindex], flags);
-	list_add(&mgmem->chain, &strom_mgmem_slots[mgmem->hindex]);
+	spin_lock(&strom_mgmem_idr_lock);
+	idr_replace(&strom_mgmem_idr, mgmem, (int)handle);
+	spin_unlock(&strom_mgmem_idr_lock);
 	spin_unlock_irqrestore(&strom_mgmem_locks[mgmem->hindex], flags);
 
 	return 0;
@@ -337,6 +381,9 @@ ioctl_map_gpu_memory(StromCmd__MapGpuMemory __user *uarg)
 error_2:
 	__nvidia_p2p_put_pages(0, 0, mgmem->map_address, mgmem->page_table);
 error_1:
+	spin_lock_irqsave(&strom_mgmem_idr_lock, flags);
+	idr_remove(&strom_mgmem_idr, (int)handle);
+	spin_unlock_irqrestore(&strom_mgmem_idr_lock, flags);
 	kfree(mgmem);
 
 	return rc;
@@ -353,7 +400,6 @@ ioctl_unmap_gpu_memory(StromCmd__UnmapGpuMemory __user *uarg)
 	StromCmd__UnmapGpuMemory karg;
 	mapped_gpu_memory  *mgmem;
 	spinlock_t		   *lock;
-	struct list_head   *slot;
 	unsigned long		flags;
 	int					i, rc;
 
@@ -362,30 +408,20 @@ ioctl_unmap_gpu_memory(StromCmd__UnmapGpuMemory __user *uarg)
 
 	i = strom_mapped_gpu_memory_index(karg.handle);
 	lock = &strom_mgmem_locks[i];
-	slot = &strom_mgmem_slots[i];
 
 	spin_lock_irqsave(lock, flags);
-	list_for_each_entry(mgmem, slot, chain)
+	mgmem = __strom_lookup_mapped_gpu_memory(karg.handle, i);
+	if (mgmem)
 	{
-		/*
-		 * NOTE: I'm not 100% certain whether UID is the right check to
-		 * determine availability of the virtual address of GPU device.
-		 * So, this behavior may be changed in the later version.
-		 */
-		if (mgmem->handle == karg.handle &&
-			uid_eq(mgmem->owner, current_euid()))
-		{
-			list_del(&mgmem->chain);
-			memset(&mgmem->chain, 0, sizeof(struct list_head));
-			spin_unlock_irqrestore(lock, flags);
-
-			rc = __nvidia_p2p_put_pages(0, 0,
-										mgmem->map_address,
-										mgmem->page_table);
-			if (rc)
-				prError("failed on nvidia_p2p_put_pages: %d", rc);
-			return rc;
-		}
+		__strom_untrack_mapped_gpu_memory(mgmem);
+		spin_unlock_irqrestore(lock, flags);
+
+		rc = __nvidia_p2p_put_pages(0, 0,
+									mgmem->map_address,
+									mgmem->page_table);
+		if (rc)
+			prError("failed on nvidia_p2p_put_pages: %d", rc);
+		return rc;
 	}
 	spin_unlock_irqrestore(lock, flags);
 
@@ -402,10 +438,8 @@ static int
 ioctl_list_gpu_memory(StromCmd__ListGpuMemory __user *uarg)
 {
 	StromCmd__ListGpuMemory karg;
-	spinlock_t		   *lock;
-	struct list_head   *slot;
-	unsigned long		flags;
 	mapped_gpu_memory  *mgmem;
+	unsigned long		handle;
 	int					i, j;
 	int					retval = 0;
 
@@ -414,24 +448,24 @@ ioctl_list_gpu_memory(StromCmd__ListGpuMemory __user *uarg)
 		return -EFAULT;
 
 	karg.nitems = 0;
-	for (i=0; i < MAPPED_GPU_MEMORY_NSLOTS; i++)
+	for (i=1; ; i++)
 	{
-		lock = &strom_mgmem_locks[i];
-		slot = &strom_mgmem_slots[i];
+		/* handle is equivalent to the ID, no need to touch mgmem */
+		rcu_read_lock();
+		mgmem = idr_get_next(&strom_mgmem_idr, &i);
+		rcu_read_unlock();
+		if (!mgmem)
+			break;
+		handle = i;
 
-		spin_lock_irqsave(lock, flags);
-		list_for_each_entry(mgmem, slot, chain)
+		j = karg.nitems++;
+		if (j < karg.nrooms)
 		{
-			j = karg.nitems++;
-			if (j < karg.nrooms)
-			{
-				if (put_user(mgmem->handle, &uarg->handles[j]))
-					retval = -EFAULT;
-			}
-			else
-				retval = -ENOBUFS;
+			if (put_user(handle, &uarg->handles[j]))
+				retval = -EFAULT;
 		}
-		spin_unlock_irqrestore(lock, flags);
+		else
+			retval = -ENOBUFS;
 	}
 	/* write back */
 	if (copy_to_user(uarg, &karg,
@@ -502,9 +536,13 @@ ioctl_info_gpu_memory(StromCmd__InfoGpuMemory __user *uarg)
  */
 struct hugepage_dma_buffer
 {
+	unsigned long	uaddr;		/* head of userspace DMA buffer */
 	unsigned long	uoffset;	/* offset of userspace DMA buffer */
 	unsigned long	ulength;	/* length of userspace DMA buffer */
 	atomic_t		refcnt;
+	struct work_struct drop_work; /* deferred release of pinned pages */
+	unsigned int	page_shift;	/* size of the pages in hpages[]; either of
+								 * 1GB/2MB huge-page or PAGE_SIZE */
 	unsigned int	nr_hpages;
 	struct page	   *hpages[1];
 };
@@ -537,7 +575,70 @@ __huge_pte_offset(struct mm_struct *mm, unsigned long addr)
 }
 
 static hugepage_dma_buffer *
-create_hugepage_dma_buffer(void __user *__uaddr, size_t ulength)
+__alloc_hugepage_dma_buffer(unsigned int nr_hpages)
+{
+	size_t		length = offsetof(hugepage_dma_buffer, hpages[nr_hpages]);
+
+	if (length <= PAGE_SIZE)
+		return kzalloc(length, GFP_KERNEL);
+	return vzalloc(length);
+}
+
+static void
+__free_hugepage_dma_buffer(hugepage_dma_buffer *hd_buf)
+{
+	if (is_vmalloc_addr(hd_buf))
+		vfree(hd_buf);
+	else
+		kfree(hd_buf);
+}
+
+/*
+ * create_pinned_dma_buffer - pin the normal pages by get_user_pages, for
+ * the destination buffer not backed by pre-faulted hugetlb.
+ */
+static hugepage_dma_buffer *
+create_pinned_dma_buffer(unsigned long uaddr, size_t ulength)
+{
+	hugepage_dma_buffer	   *hd_buf;
+	unsigned long			ustart = uaddr & PAGE_MASK;
+	unsigned long			uend = PAGE_ALIGN(uaddr + ulength);
+	unsigned int			nr_pages = (uend - ustart) >> PAGE_SHIFT;
+	int						rc;
+
+	hd_buf = __alloc_hugepage_dma_buffer(nr_pages);
+	if (!hd_buf)
+		return ERR_PTR(-ENOMEM);
+	hd_buf->uaddr = uaddr;
+	hd_buf->uoffset = (uaddr - ustart);
+	hd_buf->ulength = ulength;
+	atomic_set(&hd_buf->refcnt, 1);
+	hd_buf->page_shift = PAGE_SHIFT;
+
+	rc = get_user_pages_fast(ustart, nr_pages, 1, hd_buf->hpages);
+	if (rc < 0 || rc < nr_pages)
+	{
+		prError("failed on get_user_pages_fast(0x%p, %u) = %d",
+				(void *)ustart, nr_pages, rc);
+		while (rc > 0)
+			put_page(hd_buf->hpages[--rc]);
+		__free_hugepage_dma_buffer(hd_buf);
+		return ERR_PTR(rc < 0 ? rc : -EFAULT);
+	}
+	hd_buf->nr_hpages = nr_pages;
+
+	return hd_buf;
+}
+
+/*
+ * create_hugepage_dma_buffer - pin the huge-pages of the destination buffer.
+ * If @allow_pinned, the normal pages are also pinned by get_user_pages, for
+ * the transient use by a DMA task; long-lived registration is not charged
+ * to RLIMIT_MEMLOCK, so it accepts only hugetlb.
+ */
+static hugepage_dma_buffer *
+create_hugepage_dma_buffer(void __user *__uaddr, size_t ulength,
+						   bool allow_pinned)
 {
 	struct mm_struct       *mm = current->mm;
 	struct vm_area_struct  *vma;
@@ -546,12 +647,15 @@ create_hugepage_dma_buffer(void __user *__uaddr, size_t ulength)
 	unsigned long			uaddr = (unsigned long)__uaddr;
 	unsigned long			ustart, uend;
 	unsigned long			curr;
+	unsigned long			hpage_sz;
 	unsigned int			i, nr_hpages;
+	unsigned int			page_shift;
 
 	/*
 	 * Lookup DMA destination buffer; which should be huge-pages.
 	 * We can also assume huge-pages are prefault and locked unless
-	 * VM_NORESERVE is not supplied explicitly.
+	 * VM_NORESERVE is not supplied explicitly. Elsewhere, pages are
+	 * pinned by get_user_pages, and DMA is built per page.
 	 */
 	down_read(&mm->mmap_sem);
 	vma = find_vma(mm, uaddr);
@@ -566,33 +670,46 @@ create_hugepage_dma_buffer(void __user *__uaddr, size_t ulength)
 	if (!is_vm_hugetlb_page(vma) ||
 		(vma->vm_flags & VM_NORESERVE) != 0)
 	{
+		/*
+		 * DMA writes the pages behind the page cache, so the fallback is
+		 * restricted to the anonymous memory.
+		 */
+		if ((vma->vm_flags & (VM_IO | VM_PFNMAP)) != 0 || vma->vm_file)
+		{
+			up_read(&mm->mmap_sem);
+			prError("uaddr(0x%p-0x%p) is not an anonymous normal memory",
+					(void *)(uaddr),
+					(void *)(uaddr + ulength));
+			return ERR_PTR(-EINVAL);
+		}
 		up_read(&mm->mmap_sem);
-		prError("uaddr(0x%p-0x%p) in vma(0x%p-0x%p) is not DMA buffer",
-				(void *)(uaddr),
-				(void *)(uaddr + ulength),
-				(void *)(vma->vm_start),
-				(void *)(vma->vm_end));
-		return ERR_PTR(-EINVAL);
+		if (!allow_pinned)
+			return ERR_PTR(-EINVAL);
+		return create_pinned_dma_buffer(uaddr, ulength);
 	}
-	ustart = uaddr & HPAGE_MASK;
-	uend = (uaddr + ulength + HPAGE_SIZE - 1) & HPAGE_MASK;
-	nr_hpages = (uend - ustart) / HPAGE_SIZE;
-
-	hd_buf = kzalloc(offsetof(hugepage_dma_buffer,
-							  hpages[nr_hpages]), GFP_KERNEL);
+	/* either of 2MB or 1GB huge-page */
+	page_shift = huge_page_shift(hstate_vma(vma));
+	hpage_sz = (1UL << page_shift);
+	ustart = uaddr & ~(hpage_sz - 1);
+	uend = (uaddr + ulength + hpage_sz - 1) & ~(hpage_sz - 1);
+	nr_hpages = (uend - ustart) >> page_shift;
+
+	hd_buf = __alloc_hugepage_dma_buffer(nr_hpages);
 	if (!hd_buf)
 	{
 		up_read(&mm->mmap_sem);
 		return ERR_PTR(-ENOMEM);
 	}
-	Assert(uaddr >= ustart && (uaddr - ustart) < HPAGE_SIZE);
+	Assert(uaddr >= ustart && (uaddr - ustart) < hpage_sz);
+	hd_buf->uaddr = uaddr;
 	hd_buf->uoffset = (uaddr - ustart);
 	hd_buf->ulength = ulength;
 	atomic_set(&hd_buf->refcnt, 1);
+	hd_buf->page_shift = page_shift;
 	hd_buf->nr_hpages = nr_hpages;
 
 	/* see follow_huge_addr */
-	for (i=0, curr = ustart; i < nr_hpages; i++, curr += HPAGE_SIZE)
+	for (i=0, curr = ustart; i < nr_hpages; i++, curr += hpage_sz)
 	{
 		pte_t  *pte = __huge_pte_offset(mm, curr);
 
@@ -615,7 +732,7 @@ create_hugepage_dma_buffer(void __user *__uaddr, size_t ulength)
 page_not_found:
 	while (i > 0)
 		put_page(hd_buf->hpages[--i]);
-	kfree(hd_buf);
+	__free_hugepage_dma_buffer(hd_buf);
 	up_read(&mm->mmap_sem);
 	return ERR_PTR(-EINVAL);
 }
@@ -626,8 +743,20 @@ drop_hugepage_dma_buffer(hugepage_dma_buffer *hd_buf)
 	int		i;
 
 	for (i=0; i < hd_buf->nr_hpages; i++)
+	{
+		/* pages pinned by get_user_pages were written by DMA */
+		if (hd_buf->page_shift == PAGE_SHIFT)
+			set_page_dirty_lock(hd_buf->hpages[i]);
 		put_page(hd_buf->hpages[i]);
-	kfree(hd_buf);
+	}
+	__free_hugepage_dma_buffer(hd_buf);
+}
+
+static void
+drop_hugepage_dma_buffer_work(struct work_struct *work)
+{
+	drop_hugepage_dma_buffer(container_of(work, hugepage_dma_buffer,
+										  drop_work));
 }
 
 static inline hugepage_dma_buffer *
@@ -644,5 +773,231 @@ static inline void
 put_hugepage_dma_buffer(hugepage_dma_buffer *hd_buf)
 {
 	if (atomic_dec_and_test(&hd_buf->refcnt))
-		drop_hugepage_dma_buffer(hd_buf);
+	{
+		/*
+		 * set_page_dirty_lock() may sleep, but the last reference is often
+		 * released on completion of the DMA task in the interrupt context.
+		 */
+		if (hd_buf->page_shift == PAGE_SHIFT)
+		{
+			INIT_WORK(&hd_buf->drop_work, drop_hugepage_dma_buffer_work);
+			schedule_work(&hd_buf->drop_work);
+		}
+		else
+			drop_hugepage_dma_buffer(hd_buf);
+	}
+}
+
+/* ================================================================
+ *
+ * Routines to manage DMA buffer allocated by the kernel module
+ *
+ * ================================================================
+ */
+
+/*
+ * DMA buffer allocated by STROM_IOCTL__ALLOC_DMA_BUFFER consists of
+ * physically continuous 2MB chunks on the required NUMA node, then
+ * it is mapped to userspace through an anonymous file descriptor.
+ * hugepage_dma_buffer is reused to track the chunks, so its physical
+ * layout is already known when SSD2RAM DMA refers to the buffer.
+ */
+#define STROM_DMA_BUFFER_MAX_HPAGES		(1UL << 16)		/* 128GB */
+
+static int
+strom_dma_buffer_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	hugepage_dma_buffer *hd_buf = filp->private_data;
+	unsigned long	offset = (vma->vm_pgoff << PAGE_SHIFT);
+	unsigned long	uaddr = vma->vm_start;
+	unsigned long	length;
+	int				rc;
+
+	if (offset + (vma->vm_end - vma->vm_start) >
+		((unsigned long)hd_buf->nr_hpages << HPAGE_SHIFT))
+		return -EINVAL;
+
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	while (uaddr < vma->vm_end)
+	{
+		struct page	   *hpage = hd_buf->hpages[offset >> HPAGE_SHIFT];
+
+		length = Min(vma->vm_end - uaddr,
+					 HPAGE_SIZE - (offset & (HPAGE_SIZE - 1)));
+		rc = remap_pfn_range(vma, uaddr,
+							 page_to_pfn(hpage) +
+							 ((offset & (HPAGE_SIZE - 1)) >> PAGE_SHIFT),
+							 length,
+							 vma->vm_page_prot);
+		if (rc)
+			return rc;
+		uaddr += length;
+		offset += length;
+	}
+	return 0;
+}
+
+static int
+strom_dma_buffer_release(struct inode *inode, struct file *filp)
+{
+	put_hugepage_dma_buffer(filp->private_data);
+	return 0;
+}
+
+static const struct file_operations strom_dma_buffer_fops = {
+	.owner			= THIS_MODULE,
+	.mmap			= strom_dma_buffer_mmap,
+	.release		= strom_dma_buffer_release,
+};
+
+/*
+ * find_module_dma_buffer - lookup the DMA buffer allocated by the kernel
+ * module, which maps the supplied user address range. It returns NULL if
+ * it is not mapped from the module, or the buffer with a new reference and
+ * the offset of @uaddr from its head.
+ */
+static hugepage_dma_buffer *
+find_module_dma_buffer(void __user *__uaddr, size_t ulength,
+					   unsigned long *p_offset)
+{
+	struct mm_struct	   *mm = current->mm;
+	struct vm_area_struct  *vma;
+	hugepage_dma_buffer	   *hd_buf = NULL;
+	unsigned long			uaddr = (unsigned long)__uaddr;
+
+	down_read(&mm->mmap_sem);
+	vma = find_vma(mm, uaddr);
+	if (vma &&
+		vma->vm_file &&
+		vma->vm_file->f_op == &strom_dma_buffer_fops &&
+		uaddr >= vma->vm_start &&
+		uaddr + ulength <= vma->vm_end)
+	{
+		hd_buf = get_hugepage_dma_buffer(vma->vm_file->private_data);
+		*p_offset = (uaddr - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
+	}
+	up_read(&mm->mmap_sem);
+
+	return hd_buf;
+}
+
+/*
+ * slice_module_dma_buffer - make a DMA buffer which refers to the huge-pages
+ * of the buffer allocated by the module, for the user address range at
+ * @offset from its head.
+ */
+static hugepage_dma_buffer *
+slice_module_dma_buffer(hugepage_dma_buffer *mod_buf,
+						void __user *__uaddr, size_t ulength,
+						unsigned long offset)
+{
+	hugepage_dma_buffer *hd_buf;
+	unsigned long	head = (offset >> HPAGE_SHIFT);
+	unsigned long	tail = ((offset + ulength - 1) >> HPAGE_SHIFT);
+	unsigned int	i, nr_hpages = tail - head + 1;
+
+	Assert(tail < mod_buf->nr_hpages);
+	hd_buf = __alloc_hugepage_dma_buffer(nr_hpages);
+	if (!hd_buf)
+		return ERR_PTR(-ENOMEM);
+	hd_buf->uaddr = (unsigned long)__uaddr;
+	hd_buf->uoffset = (offset & (HPAGE_SIZE - 1));
+	hd_buf->ulength = ulength;
+	atomic_set(&hd_buf->refcnt, 1);
+	hd_buf->page_shift = HPAGE_SHIFT;
+	hd_buf->nr_hpages = nr_hpages;
+	for (i=0; i < nr_hpages; i++)
+	{
+		get_page(mod_buf->hpages[head + i]);
+		hd_buf->hpages[i] = mod_buf->hpages[head + i];
+	}
+	return hd_buf;
+}
+
+/*
+ * ioctl_alloc_dma_buffer
+ *
+ * ioctl(2) handler for STROM_IOCTL__ALLOC_DMA_BUFFER
+ */
+static int
+ioctl_alloc_dma_buffer(StromCmd__AllocDMABuffer __user *uarg)
+{
+	StromCmd__AllocDMABuffer karg;
+	hugepage_dma_buffer *hd_buf;
+	gfp_t			gfp_mask = (GFP_KERNEL | __GFP_ZERO |
+								__GFP_COMP | __GFP_NOWARN);
+	unsigned int	i, nr_hpages;
+	int				fdesc;
+
+	/*
+	 * The chunks are never swapped out, like mlock(2), but not charged to
+	 * RLIMIT_MEMLOCK of the caller, so only privileged users can allocate.
+	 */
+	if (!capable(CAP_IPC_LOCK))
+		return -EPERM;
+	if (copy_from_user(&karg, uarg, sizeof(StromCmd__AllocDMABuffer)))
+		return -EFAULT;
+	if (karg.length == 0)
+		return -EINVAL;
+	if (karg.node_id >= 0 &&
+		(karg.node_id >= nr_node_ids || !node_online(karg.node_id)))
+		return -EINVAL;
+	nr_hpages = (karg.length + HPAGE_SIZE - 1) >> HPAGE_SHIFT;
+	if (nr_hpages > STROM_DMA_BUFFER_MAX_HPAGES)
+		return -E2BIG;
+
+	hd_buf = __alloc_hugepage_dma_buffer(nr_hpages);
+	if (!hd_buf)
+		return -ENOMEM;
+	hd_buf->uaddr = 0;			/* not mapped yet */
+	hd_buf->uoffset = 0;
+	hd_buf->ulength = (unsigned long)nr_hpages << HPAGE_SHIFT;
+	atomic_set(&hd_buf->refcnt, 1);
+	hd_buf->page_shift = HPAGE_SHIFT;
+	hd_buf->nr_hpages = 0;
+
+	/* stick to the required NUMA node, if any */
+	if (karg.node_id >= 0)
+		gfp_mask |= __GFP_THISNODE;
+	for (i=0; i < nr_hpages; i++)
+	{
+		struct page	   *hpage;
+
+		/* allocation of the large buffer may take a while */
+		if (fatal_signal_pending(current))
+		{
+			put_hugepage_dma_buffer(hd_buf);
+			return -EINTR;
+		}
+		cond_resched();
+
+		hpage = alloc_pages_node(karg.node_id < 0
+								 ? numa_node_id()
+								 : karg.node_id,
+								 gfp_mask,
+								 HPAGE_SHIFT - PAGE_SHIFT);
+		if (!hpage)
+		{
+			put_hugepage_dma_buffer(hd_buf);
+			return -ENOMEM;
+		}
+		hd_buf->hpages[hd_buf->nr_hpages++] = hpage;
+	}
+
+	fdesc = anon_inode_getfd("[nvme-strom dmabuf]",
+							 &strom_dma_buffer_fops,
+							 hd_buf, O_RDWR | O_CLOEXEC);
+	if (fdesc < 0)
+	{
+		put_hugepage_dma_buffer(hd_buf);
+		return fdesc;
+	}
+
+	karg.dmabuf_fdesc = fdesc;
+	if (copy_to_user(uarg, &karg, sizeof(StromCmd__AllocDMABuffer)))
+	{
+		/* file descriptor is already installed; closed by application */
+		return -EFAULT;
+	}
+	return 0;
 }
@@ -64,6 +64,7 @@ typedef struct
 	pg_crc32			crc;			/* stable field */
 	pid_t				pid;
 	ResourceOwner		owner;
+	unsigned long		dma_task_id;	/* DMA task in progress, or ~0UL */
 } NVMEStromDMAChunk;
 
 /*
@@ -106,6 +107,8 @@ static int					nvme_last_numa_node_id;
 static shmem_startup_hook_type shmem_startup_next;
 static NVMEStromDMABuffer  *nvmestrom_dma_buffers[MAX_NUMNODES];
 static NVMEStromDMABuffer  *nvmestrom_dma_buffer_rr;
+static unsigned long		nvmestrom_dma_buffer_handles[MAX_NUMNODES];
+static pid_t				nvmestrom_dma_buffer_handles_pid = 0;
 #define DMACHUNKS_TRACKER_HASHSZ		47
 static dlist_head			dma_chunks_tracker_list[DMACHUNKS_TRACKER_HASHSZ];
 
@@ -191,6 +194,8 @@ typedef struct NVMEStromState {
  */
 static void *NVMEStromAllocDMABuffer(int node_id, bool is_try_alloc);
 static void  NVMEStromFreeDMABuffer(void *buffer);
+static void  NVMEStromTrackDMATask(void *buffer, unsigned long dma_task_id);
+static unsigned long NVMEStromLookupDMABufferHandle(void *buffer);
 
 /*
  * nvme_strom_ioctl - entrypoint of NVME-Strom
@@ -199,10 +204,21 @@ static int
 nvme_strom_ioctl(int cmd, const void *arg)
 {
 	static int		fdesc_nvme_strom = -1;
+	static pid_t	fdesc_nvme_strom_pid = 0;
 
+	/*
+	 * DMA tasks and registered buffers belong to the file handle, so child
+	 * process must not share the one inherited from the parent.
+	 */
+	if (fdesc_nvme_strom >= 0 && fdesc_nvme_strom_pid != MyProcPid)
+	{
+		close(fdesc_nvme_strom);
+		fdesc_nvme_strom = -1;
+	}
 	if (fdesc_nvme_strom < 0)
 	{
 		fdesc_nvme_strom = open(NVME_STROM_IOCTL_PATHNAME, O_RDONLY);
+		fdesc_nvme_strom_pid = MyProcPid;
 		if (fdesc_nvme_strom < 0)
 		{
 			if (errno != ENOENT)
@@ -828,9 +844,14 @@ nvmestrom_load_chunk(NVMEStromState *nss,
 		cmd.chunk_sz = BLCKSZ;
 		cmd.relseg_sz = RELSEG_SIZE;
 		cmd.chunk_ids = dtask->chunk_ids;
+		cmd.flags = 0;
+		cmd.dest_handle = NVMEStromLookupDMABufferHandle(dtask->chunk_buf);
+		if (cmd.dest_handle != 0)
+			cmd.flags |= NVME_STROM_MEMCPY_FLAGS__REGISTERED_BUFFER;
 		if (nvme_strom_ioctl(STROM_IOCTL__MEMCPY_SSD2RAM, &cmd))
 			elog(ERROR, "failed on ioctl(STROM_IOCTL__MEMCPY_SSD2RAM) : %m");
 		dtask->dma_task_id = cmd.dma_task_id;
+		NVMEStromTrackDMATask(dtask->chunk_buf, cmd.dma_task_id);
 #if PG_VERSION_NUM >= 100000
 		pg_atomic_fetch_add_u64(&nsp_desc->nr_ram2ram, cmd.nr_ram2ram);
 		pg_atomic_fetch_add_u64(&nsp_desc->nr_ssd2ram, cmd.nr_ssd2ram);
@@ -921,8 +942,12 @@ nvmestrom_next_chunk(NVMEStromState *nss)
 		StromCmd__MemCopyWait cmd;
 
 		cmd.dma_task_id = dtask->dma_task_id;
+		cmd.timeout_ms = 0;		/* no timeout */
 		if (nvme_strom_ioctl(STROM_IOCTL__MEMCPY_WAIT, &cmd) == 0)
+		{
 			dtask->dma_task_id = ~0UL;
+			NVMEStromTrackDMATask(dtask->chunk_buf, ~0UL);
+		}
 		else if (errno == EINTR)
 			CHECK_FOR_INTERRUPTS();
 		else
@@ -1026,6 +1051,73 @@ ExecNVMEStrom(CustomScanState *node)
 					(ExecScanRecheckMtd) ExecNVMEStromRecheck);
 }
 
+/*
+ * nvmestrom_reap_dma_tasks - cancel the DMA tasks, then reap them. Cancel
+ * does not abort the DMA in flight, so the tasks have to be reaped prior to
+ * release of the DMA buffer. Otherwise, they are kept by the kernel module
+ * until the file handle gets closed. It returns true if all of them were
+ * reaped, or already reaped by others.
+ */
+static bool
+nvmestrom_reap_dma_tasks(unsigned long *dma_task_ids, int nr_tasks)
+{
+	long	   *dma_status;
+	uint8_t	   *dma_completed;
+	bool		result = true;
+	int			i, j, k;
+
+	/* tasks already reaped are not waited for */
+	for (i=0, k=0; i < nr_tasks; i++)
+	{
+		StromCmd__MemCopyCancel cmd;
+
+		cmd.dma_task_id = dma_task_ids[i];
+		if (nvme_strom_ioctl(STROM_IOCTL__MEMCPY_CANCEL, &cmd) == 0)
+			dma_task_ids[k++] = dma_task_ids[i];
+		else if (errno != ENOENT)
+			elog(DEBUG1, "failed on ioctl(STROM_IOCTL__MEMCPY_CANCEL) : %m");
+	}
+	nr_tasks = k;
+	if (nr_tasks == 0)
+		return true;
+
+	i = Min(nr_tasks, NVME_STROM_WAIT_MANY_MAX_TASKS);
+	dma_status = palloc(sizeof(long) * i);
+	dma_completed = palloc(sizeof(uint8_t) * i);
+	while (nr_tasks > 0)
+	{
+		StromCmd__MemCopyWaitMany cmd;
+
+		memset(&cmd, 0, sizeof(StromCmd__MemCopyWaitMany));
+		cmd.nr_tasks = Min(nr_tasks, NVME_STROM_WAIT_MANY_MAX_TASKS);
+		cmd.mode = NVME_STROM_WAIT_MANY__ALL;
+		cmd.timeout_ms = 0;		/* no timeout */
+		cmd.dma_task_ids = dma_task_ids;
+		cmd.status = dma_status;
+		cmd.completed = dma_completed;
+		memset(dma_completed, 0, sizeof(uint8_t) * cmd.nr_tasks);
+		if (nvme_strom_ioctl(STROM_IOCTL__MEMCPY_WAIT_MANY, &cmd) != 0 &&
+			errno != EINTR)
+		{
+			elog(WARNING, "failed on ioctl(STROM_IOCTL__MEMCPY_WAIT_MANY) : %m");
+			result = false;
+			break;
+		}
+		/* remove the reaped tasks; all of them unless EINTR */
+		for (j=0, k=0; j < nr_tasks; j++)
+		{
+			if (j < cmd.nr_tasks && dma_completed[j])
+				continue;
+			dma_task_ids[k++] = dma_task_ids[j];
+		}
+		nr_tasks = k;
+	}
+	pfree(dma_completed);
+	pfree(dma_status);
+
+	return result;
+}
+
 /*
  * ExecEndNVMEStrom
  */
@@ -1033,6 +1125,33 @@ static void
 ExecEndNVMEStrom(CustomScanState *node)
 {
 	NVMEStromState *nss = (NVMEStromState *) node;
+	unsigned long *dma_task_ids;
+	int			nr_tasks = 0;
+	long		i;
+
+	/* cancel DMA tasks in progress, if scan is terminated earlier */
+	dma_task_ids = palloc(sizeof(unsigned long) * nss->num_chunks);
+	for (i = nss->dma_rindex; i < nss->dma_windex; i++)
+	{
+		NVMEStromDMATask *dtask = &nss->dma_tasks[i % nss->num_chunks];
+
+		if (dtask->dma_task_id != ~0UL)
+			dma_task_ids[nr_tasks++] = dtask->dma_task_id;
+	}
+	if (nvmestrom_reap_dma_tasks(dma_task_ids, nr_tasks))
+	{
+		/* elsewhere, NVMEStromCleanupDMABuffer shall retry */
+		for (i = nss->dma_rindex; i < nss->dma_windex; i++)
+		{
+			NVMEStromDMATask *dtask = &nss->dma_tasks[i % nss->num_chunks];
+
+			if (dtask->dma_task_id == ~0UL)
+				continue;
+			NVMEStromTrackDMATask(dtask->chunk_buf, ~0UL);
+			dtask->dma_task_id = ~0UL;
+		}
+	}
+	pfree(dma_task_ids);
 
 	unbind_process_numa_node();
 	if (nss->worker_snapshot)
@@ -1253,6 +1372,7 @@ dchunk_found:
 	Assert(dchunk->pid == 0 && dchunk->owner == NULL);
 	dchunk->pid = MyProcPid;
 	dchunk->owner = CurrentResourceOwner;
+	dchunk->dma_task_id = ~0UL;
 	index = dchunk->crc % DMACHUNKS_TRACKER_HASHSZ;
 	dlist_push_tail(&dma_chunks_tracker_list[index], &dchunk->chain);
 
@@ -1260,10 +1380,10 @@ dchunk_found:
 }
 
 /*
- * NVMEStromFreeDMABuffer
+ * NVMEStromLookupDMAChunk - lookup the DMA chunk acquired by this process
  */
-static void
-NVMEStromFreeDMABuffer(void *buffer)
+static NVMEStromDMAChunk *
+NVMEStromLookupDMAChunk(void *buffer)
 {
 	pg_crc32		crc;
 	dlist_head	   *trackers;
@@ -1279,24 +1399,132 @@ NVMEStromFreeDMABuffer(void *buffer)
 			= dlist_container(NVMEStromDMAChunk, chain, iter.cur);
 
 		if (dchunk->buffer == buffer)
-		{
-			NVMEStromDMABuffer *dmabuf = dchunk->dmabuf;
+			return dchunk;
+	}
+	elog(ERROR, "DMA buffer %p is not found or already released", buffer);
+	return NULL;	/* keep compiler quiet */
+}
 
-			dlist_delete(&dchunk->chain);
-			Assert(dchunk->pid == MyProcPid);
-			dchunk->pid = 0;
-			dchunk->owner = NULL;
+/*
+ * NVMEStromTrackDMATask - remember the DMA task which writes the chunk, to
+ * be reaped prior to release of the chunk on abort.
+ */
+static void
+NVMEStromTrackDMATask(void *buffer, unsigned long dma_task_id)
+{
+	NVMEStromDMAChunk  *dchunk = NVMEStromLookupDMAChunk(buffer);
 
-			SpinLockAcquire(&dmabuf->lock);
-			dlist_push_head(&dmabuf->free_list, &dchunk->chain);
-			SpinLockRelease(&dmabuf->lock);
+	Assert(dchunk->pid == MyProcPid);
+	dchunk->dma_task_id = dma_task_id;
+}
 
-			if (sem_post(&dmabuf->sem) != 0)
-				elog(FATAL, "failed on sem_post: %m");
-			return;		/* OK, correctly released */
+/*
+ * NVMEStromFreeDMABuffer
+ */
+static void
+NVMEStromFreeDMABuffer(void *buffer)
+{
+	NVMEStromDMAChunk  *dchunk = NVMEStromLookupDMAChunk(buffer);
+	NVMEStromDMABuffer *dmabuf = dchunk->dmabuf;
+
+	dlist_delete(&dchunk->chain);
+	Assert(dchunk->pid == MyProcPid);
+	Assert(dchunk->dma_task_id == ~0UL);
+	dchunk->pid = 0;
+	dchunk->owner = NULL;
+
+	SpinLockAcquire(&dmabuf->lock);
+	dlist_push_head(&dmabuf->free_list, &dchunk->chain);
+	SpinLockRelease(&dmabuf->lock);
+
+	if (sem_post(&dmabuf->sem) != 0)
+		elog(FATAL, "failed on sem_post: %m");
+}
+
+/*
+ * NVMEStromUnregisterDMABuffers - release the registration of DMA buffers on
+ * detach of the segments, i.e, process exit.
+ */
+static void
+NVMEStromUnregisterDMABuffers(int code, Datum arg)
+{
+	int			i;
+
+	if (nvmestrom_dma_buffer_handles_pid != MyProcPid)
+		return;
+	for (i=0; i < MAX_NUMNODES; i++)
+	{
+		StromCmd__RegisterDmaBuffer cmd;
+		unsigned long	handle = nvmestrom_dma_buffer_handles[i];
+
+		if (handle == 0 || handle == ~0UL)
+			continue;
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.handle = handle;
+		if (nvme_strom_ioctl(STROM_IOCTL__UNREGISTER_DMA_BUFFER, &cmd) != 0)
+			elog(DEBUG1, "failed on ioctl(STROM_IOCTL__UNREGISTER_DMA_BUFFER) : %m");
+		nvmestrom_dma_buffer_handles[i] = 0;
+	}
+}
+
+/*
+ * NVMEStromLookupDMABufferHandle
+ *
+ * It returns handle of the DMA buffer registered on the kernel module, which
+ * contains the supplied chunk. DMA buffer of the NUMA node is registered on
+ * the first call in this process. 0 means no registered buffer.
+ */
+static unsigned long
+NVMEStromLookupDMABufferHandle(void *buffer)
+{
+	size_t		chunk_sz = ((size_t)nvmestrom_chunk_size_kb << 10);
+	int			i;
+
+	/*
+	 * registration is valid only on the process which made it; child
+	 * process opens its own file handle, then registers the buffer again.
+	 */
+	if (nvmestrom_dma_buffer_handles_pid != MyProcPid)
+	{
+		memset(nvmestrom_dma_buffer_handles, 0,
+			   sizeof(nvmestrom_dma_buffer_handles));
+		nvmestrom_dma_buffer_handles_pid = MyProcPid;
+		before_shmem_exit(NVMEStromUnregisterDMABuffers, 0);
+	}
+
+	for (i=0; i < MAX_NUMNODES; i++)
+	{
+		NVMEStromDMABuffer *dmabuf = nvmestrom_dma_buffers[i];
+		char	   *hpages;
+		size_t		length;
+
+		if (!dmabuf)
+			continue;
+		hpages = dmabuf->dma_chunks[0].buffer;
+		length = (size_t)dmabuf->nr_chunks * chunk_sz;
+		if ((char *)buffer < hpages || (char *)buffer >= hpages + length)
+			continue;
+
+		if (nvmestrom_dma_buffer_handles[i] == 0)
+		{
+			StromCmd__RegisterDmaBuffer cmd;
+
+			memset(&cmd, 0, sizeof(cmd));
+			cmd.uaddr = hpages;
+			cmd.length = length;
+			if (nvme_strom_ioctl(STROM_IOCTL__REGISTER_DMA_BUFFER, &cmd) == 0)
+				nvmestrom_dma_buffer_handles[i] = cmd.handle;
+			else
+			{
+				elog(DEBUG1, "failed on ioctl(STROM_IOCTL__REGISTER_DMA_BUFFER) : %m");
+				nvmestrom_dma_buffer_handles[i] = ~0UL;
+			}
 		}
+		if (nvmestrom_dma_buffer_handles[i] != ~0UL)
+			return nvmestrom_dma_buffer_handles[i];
+		break;
 	}
-	elog(ERROR, "DMA buffer %p is not found or already released", buffer);
+	return 0;
 }
 
 /*
@@ -1309,12 +1537,46 @@ NVMEStromCleanupDMABuffer(ResourceReleasePhase phase,
 						  void *arg)
 {
 	dlist_mutable_iter iter;
+	dlist_iter	citer;
+	unsigned long *dma_task_ids = NULL;
+	int			nr_tasks = 0;
 	int			i;
 	bool		found = false;
 
 	if (phase != RESOURCE_RELEASE_BEFORE_LOCKS)
 		return;
 
+	/*
+	 * DMA tasks may still write the chunks, if scan is aborted. So, they
+	 * have to be cancelled and reaped prior to the release of the chunks.
+	 */
+	for (i=0; i < DMACHUNKS_TRACKER_HASHSZ; i++)
+	{
+		dlist_foreach(citer, &dma_chunks_tracker_list[i])
+		{
+			NVMEStromDMAChunk  *dchunk = (NVMEStromDMAChunk *)
+				dlist_container(NVMEStromDMAChunk, chain, citer.cur);
+
+			if (dchunk->owner != CurrentResourceOwner ||
+				dchunk->dma_task_id == ~0UL)
+				continue;
+			if (!dma_task_ids)
+				dma_task_ids = palloc(sizeof(unsigned long) *
+									  nvmestrom_async_depth);
+			else if (nr_tasks % nvmestrom_async_depth == 0)
+				dma_task_ids = repalloc(dma_task_ids,
+										sizeof(unsigned long) *
+										(nr_tasks + nvmestrom_async_depth));
+			dma_task_ids[nr_tasks++] = dchunk->dma_task_id;
+		}
+	}
+	if (dma_task_ids)
+	{
+		if (!nvmestrom_reap_dma_tasks(dma_task_ids, nr_tasks))
+			elog(WARNING, "DMA tasks are not reaped, may write the released DMA buffer");
+		pfree(dma_task_ids);
+	}
+
 	for (i=0; i < DMACHUNKS_TRACKER_HASHSZ; i++)
 	{
 		dlist_foreach_modify(iter, &dma_chunks_tracker_list[i])
@@ -1334,6 +1596,7 @@ NVMEStromCleanupDMABuffer(ResourceReleasePhase phase,
 				dlist_delete(&dchunk->chain);
 				dchunk->pid = 0;
 				dchunk->owner = NULL;
+				dchunk->dma_task_id = ~0UL;
 				/* back to the free list */
 				SpinLockAcquire(&dmabuf->lock);
 				dlist_push_head(&dmabuf->free_list, &dchunk->chain);
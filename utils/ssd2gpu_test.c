@@ -310,6 +310,7 @@ exec_test_by_strom(void *private)
 		uarg.relseg_sz	= 0;
 		uarg.chunk_ids	= wcontext->chunk_ids;
 		uarg.wb_buffer	= wcontext->src_buffer;
+		uarg.flags		= 0;
 		chunk_base		= next_fpos / BLCKSZ;
 		for (i=0; i < nr_chunks; i++)
 			uarg.chunk_ids[nr_chunks - (i+1)] = chunk_base + i;
@@ -28,6 +28,9 @@ static size_t		source_fpos = 0;
 static int			numa_node_id = -1;
 static int			proc_node_id = -1;		/* process's NUMA-Id */
 static int			enable_checks = 0;
+static int			use_module_buffer = 0;	/* ALLOC_DMA_BUFFER */
+static int			use_progress_map = 0;	/* MEMCPY_FLAGS__PROGRESS_MAP */
+static int			use_doorbell = 0;		/* MEMCPY_FLAGS__DOORBELL */
 static int			num_processes = 0;		/* single process in default */
 static size_t		buffer_size = (32UL << 20);		/* 32MB in default */
 static long			total_memcpy_wait = 0;	/* in ms */
@@ -123,6 +126,26 @@ alloc_dma_buffer(int node_id)
 {
 	void	   *buffer;
 
+	if (use_module_buffer)
+	{
+		StromCmd__AllocDMABuffer cmd;
+
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.length	= buffer_size;
+		cmd.node_id	= node_id;
+		if (nvme_strom_ioctl(STROM_IOCTL__ALLOC_DMA_BUFFER, &cmd))
+			ELOG(errno, "failed on ioctl(STROM_IOCTL__ALLOC_DMA_BUFFER)");
+		buffer = mmap(NULL, buffer_size,
+					  PROT_READ | PROT_WRITE,
+					  MAP_SHARED,
+					  cmd.dmabuf_fdesc, 0);
+		if (buffer == MAP_FAILED)
+			ELOG(errno, "failed on mmap(2): %m");
+		close(cmd.dmabuf_fdesc);
+		printf("mmap(2) = %p (node-id: %d)\n", buffer, node_id);
+		return buffer;
+	}
+
 	buffer = mmap(NULL, buffer_size,
 				  PROT_READ | PROT_WRITE,
 				  MAP_PRIVATE |
@@ -136,18 +159,153 @@ alloc_dma_buffer(int node_id)
 	return buffer;
 }
 
+#define PROGRESS_MAP_WORDS(nr_chunks)	(((nr_chunks) + 63) / 64)
+
+/*
+ * check_progress_map - all the chunks must be landed on completion
+ */
+static void
+check_progress_map(unsigned long dma_task_id,
+				   uint64_t *map, unsigned int nr_chunks)
+{
+	int		j;
+
+	for (j=0; j < nr_chunks; j++)
+	{
+		if ((map[j / 64] & (1UL << (j % 64))) == 0)
+			ELOG(EIO, "DMA task (id=%lu) completed, but chunk %d "
+				 "is not marked on the progress map", dma_task_id, j);
+	}
+}
+
+/*
+ * wait_dma_tasks - wait for completion of the DMA tasks, then release the
+ * slot of the completed ones. It returns number of the released slots.
+ */
+static int
+wait_dma_tasks(unsigned long *dma_tasks, long *dma_status,
+			   uint8_t *dma_completed, int n_units, unsigned int mode,
+			   uint64_t *progress_maps, unsigned int map_nwords,
+			   unsigned int *dma_nchunks)
+{
+	StromCmd__MemCopyWaitMany cmd;
+	unsigned long *task_ids;
+	int		   *units;
+	int			i, j, nr_tasks = 0, count = 0;
+
+	/* only running tasks can be waited for */
+	task_ids = malloc(sizeof(unsigned long) * n_units);
+	units = malloc(sizeof(int) * n_units);
+	if (!task_ids || !units)
+		ELOG(errno, "out of memory");
+	for (i=0; i < n_units; i++)
+	{
+		if (dma_tasks[i] == 0)
+			continue;
+		task_ids[nr_tasks] = dma_tasks[i];
+		units[nr_tasks] = i;
+		nr_tasks++;
+	}
+	if (nr_tasks == 0)
+		goto out;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.nr_tasks	= nr_tasks;
+	cmd.mode		= mode;
+	cmd.timeout_ms	= 0;	/* no timeout */
+	cmd.dma_task_ids = task_ids;
+	cmd.status		= dma_status;
+	cmd.completed	= dma_completed;
+	if (nvme_strom_ioctl(STROM_IOCTL__MEMCPY_WAIT_MANY, &cmd))
+		ELOG(errno, "failed on ioctl(STROM_IOCTL__MEMCPY_WAIT_MANY)");
+
+	for (j=0; j < nr_tasks; j++)
+	{
+		if (!dma_completed[j])
+			continue;
+		i = units[j];
+		if (dma_status[j] != 0)
+			ELOG(EIO, "DMA task (id=%lu) failed: status=%ld",
+				 dma_tasks[i], dma_status[j]);
+		/*
+		 * TODO: data corruption check here
+		 */
+		if (progress_maps)
+			check_progress_map(dma_tasks[i],
+							   progress_maps + i * map_nwords,
+							   dma_nchunks[i]);
+		dma_tasks[i] = 0;
+		count++;
+	}
+out:
+	free(units);
+	free(task_ids);
+	return count;
+}
+
+/*
+ * spin_dma_tasks - spin on the doorbells until any or all of the DMA tasks
+ * get completed, without system calls unless completed. It returns number
+ * of the released slots.
+ */
+static int
+spin_dma_tasks(unsigned long *dma_tasks, volatile uint64_t *doorbells,
+			   uint64_t *dma_seqnos, int n_units, unsigned int mode,
+			   uint64_t *progress_maps, unsigned int map_nwords,
+			   unsigned int *dma_nchunks)
+{
+	StromCmd__MemCopyWait cmd;
+	int			i, nr_running = 0, count = 0;
+
+	for (i=0; i < n_units; i++)
+	{
+		if (dma_tasks[i] != 0)
+			nr_running++;
+	}
+
+	while (mode == NVME_STROM_WAIT_MANY__ANY ? count == 0
+		   : count < nr_running)
+	{
+		for (i=0; i < n_units; i++)
+		{
+			if (dma_tasks[i] == 0 || doorbells[i] != dma_seqnos[i])
+				continue;
+			/* fetch the status of the completed task; never sleeps */
+			memset(&cmd, 0, sizeof(cmd));
+			cmd.dma_task_id	= dma_tasks[i];
+			cmd.timeout_ms	= -1;
+			if (nvme_strom_ioctl(STROM_IOCTL__MEMCPY_WAIT, &cmd))
+				ELOG(errno, "DMA task (id=%lu) failed: status=%ld",
+					 dma_tasks[i], cmd.status);
+			if (progress_maps)
+				check_progress_map(dma_tasks[i],
+								   progress_maps + i * map_nwords,
+								   dma_nchunks[i]);
+			dma_tasks[i] = 0;
+			count++;
+		}
+	}
+	return count;
+}
+
 static void *
 ssd2ram_worker(void *__args__)
 {
 	StromCmd__MemCopySsdToRam cmd;
 	char	   *dma_buffer;
 	unsigned long *dma_tasks;
+	long	   *dma_status;
+	uint8_t	   *dma_completed;
 	uint32_t   *chunk_ids;
+	uint64_t   *progress_maps = NULL;
+	uint64_t   *doorbells = NULL;
+	uint64_t   *dma_seqnos;
+	unsigned int *dma_nchunks;
 	size_t		unitsz = (32UL << 20);	/* 32MB unit size */
 	int			n_units = (buffer_size / unitsz);
-	int			rindex = 0;		/* read index */
-	int			windex = 0;		/* wait index */
-	int			i;
+	unsigned int map_nwords = PROGRESS_MAP_WORDS(unitsz / BLCKSZ);
+	int			nr_running = 0;
+	int			i, k;
 	long		memcpy_wait = 0;
 	long		nr_ram2ram = 0;
 	long		nr_ssd2ram = 0;
@@ -155,9 +313,26 @@ ssd2ram_worker(void *__args__)
 	long		nr_dma_blocks = 0;
 	struct timeval tv1, tv2;
 
-	dma_tasks = malloc(sizeof(unsigned long) * n_units);
-	if (!dma_tasks)
+	dma_tasks = calloc(n_units, sizeof(unsigned long));
+	dma_status = calloc(n_units, sizeof(long));
+	dma_completed = calloc(n_units, sizeof(uint8_t));
+	dma_nchunks = calloc(n_units, sizeof(unsigned int));
+	dma_seqnos = calloc(n_units, sizeof(uint64_t));
+	if (!dma_tasks || !dma_status || !dma_completed ||
+		!dma_nchunks || !dma_seqnos)
 		ELOG(errno, "out of memory");
+	if (use_doorbell)
+	{
+		doorbells = calloc(n_units, sizeof(uint64_t));
+		if (!doorbells)
+			ELOG(errno, "out of memory");
+	}
+	if (use_progress_map)
+	{
+		progress_maps = calloc(n_units * map_nwords, sizeof(uint64_t));
+		if (!progress_maps)
+			ELOG(errno, "out of memory");
+	}
 	chunk_ids = malloc(sizeof(uint32_t) * (unitsz / BLCKSZ));
 	if (!chunk_ids)
 		ELOG(errno, "out of memory");
@@ -171,29 +346,40 @@ ssd2ram_worker(void *__args__)
 
 		if (fpos >= source_fstat.st_size)
 			break;
-		/* wait until DMA buffer getting available */
-		i = rindex++ % n_units;
-		if (i == windex)
+		/* wait until any of DMA buffer getting available */
+		if (nr_running == n_units)
 		{
-			StromCmd__MemCopyWait	__cmd;
-
 			gettimeofday(&tv1, NULL);
-			memset(&__cmd, 0, sizeof(__cmd));
-			__cmd.dma_task_id	= dma_tasks[windex++ % n_units];
-			if (nvme_strom_ioctl(STROM_IOCTL__MEMCPY_WAIT, &__cmd))
-				ELOG(errno, "failed on ioctl(STROM_IOCTL__MEMCPY_WAIT)");
+			if (doorbells)
+				nr_running -= spin_dma_tasks(dma_tasks,
+											 doorbells,
+											 dma_seqnos,
+											 n_units,
+											 NVME_STROM_WAIT_MANY__ANY,
+											 progress_maps,
+											 map_nwords,
+											 dma_nchunks);
+			else
+				nr_running -= wait_dma_tasks(dma_tasks,
+											 dma_status,
+											 dma_completed,
+											 n_units,
+											 NVME_STROM_WAIT_MANY__ANY,
+											 progress_maps,
+											 map_nwords,
+											 dma_nchunks);
 			gettimeofday(&tv2, NULL);
 
 			memcpy_wait += ((tv2.tv_sec * 1000 + tv2.tv_usec / 1000) -
 							(tv1.tv_sec * 1000 + tv1.tv_usec / 1000));
-			/*
-			 * TODO: data corruption check here
-			 */
 		}
+		for (k=0; k < n_units && dma_tasks[k] != 0; k++);
+		if (k == n_units)
+			ELOG(EINVAL, "Bug? no available DMA buffer");
 
 		/* setup MEMCPY_SSD2RAM command */
 		memset(&cmd, 0, sizeof(cmd));
-		cmd.dest_uaddr	= dma_buffer + i * unitsz;
+		cmd.dest_uaddr	= dma_buffer + k * unitsz;
 		cmd.file_desc	= source_fdesc;
 		if (fpos + unitsz <= source_fstat.st_size)
 			cmd.nr_chunks = (unitsz / BLCKSZ);
@@ -205,16 +391,59 @@ ssd2ram_worker(void *__args__)
 
 		for (i=0; i < cmd.nr_chunks; i++)
 			cmd.chunk_ids[cmd.nr_chunks - (i+1)] = fpos / BLCKSZ + i;
+		if (progress_maps)
+		{
+			cmd.flags	|= NVME_STROM_MEMCPY_FLAGS__PROGRESS_MAP;
+			cmd.progress_map = progress_maps + k * map_nwords;
+			memset(cmd.progress_map, 0, sizeof(uint64_t) * map_nwords);
+		}
+		/* sequence number of the unit; never zero */
+		dma_seqnos[k]	= fpos / unitsz + 1;
+		if (doorbells)
+		{
+			cmd.flags	|= NVME_STROM_MEMCPY_FLAGS__DOORBELL;
+			cmd.doorbell = &doorbells[k];
+			cmd.doorbell_value = dma_seqnos[k];
+		}
 
 		if (nvme_strom_ioctl(STROM_IOCTL__MEMCPY_SSD2RAM, &cmd))
 			ELOG(errno, "failed on ioctl(STROM_IOCTL__MEMCPY_SSD2RAM)");
 
-		dma_tasks[i]	= cmd.dma_task_id;
+		dma_tasks[k]	= cmd.dma_task_id;
+		dma_nchunks[k]	= cmd.nr_chunks;
+		nr_running++;
 		nr_ram2ram		+= cmd.nr_ram2ram;
 		nr_ssd2ram		+= cmd.nr_ssd2ram;
 		nr_dma_submit	+= cmd.nr_dma_submit;
 		nr_dma_blocks	+= cmd.nr_dma_blocks;
 	}
+	/* wait for completion of the remaining DMA tasks */
+	if (nr_running > 0)
+	{
+		gettimeofday(&tv1, NULL);
+		if (doorbells)
+			spin_dma_tasks(dma_tasks,
+						   doorbells,
+						   dma_seqnos,
+						   n_units,
+						   NVME_STROM_WAIT_MANY__ALL,
+						   progress_maps,
+						   map_nwords,
+						   dma_nchunks);
+		else
+			wait_dma_tasks(dma_tasks,
+						   dma_status,
+						   dma_completed,
+						   n_units,
+						   NVME_STROM_WAIT_MANY__ALL,
+						   progress_maps,
+						   map_nwords,
+						   dma_nchunks);
+		gettimeofday(&tv2, NULL);
+
+		memcpy_wait += ((tv2.tv_sec * 1000 + tv2.tv_usec / 1000) -
+						(tv1.tv_sec * 1000 + tv1.tv_usec / 1000));
+	}
 	/* collect statistics */
 	__sync_fetch_and_add(&total_memcpy_wait, memcpy_wait);
 	__sync_fetch_and_add(&total_nr_ram2ram, nr_ram2ram);
@@ -285,6 +514,9 @@ usage(const char *argv0)
 	fprintf(stderr,
 			"usage: %s [OPTIONS] <filename>\n"
 			"  -c : check SSD2RAM capability of the file\n"
+			"  -d : spin on the doorbell words, instead of sleep\n"
+			"  -g : check the progress map of the landed chunks\n"
+			"  -m : use DMA buffer allocated by the kernel module\n"
 			"  -n <num worker threads>\n"
 			"  -p <numa node-id of process>\n"
 			"  -s <buffer size in MB>\n",
@@ -298,13 +530,22 @@ main(int argc, char *argv[])
 	struct timeval	tv1, tv2;
 	int				c, i;
 
-	while ((c = getopt(argc, argv, "cn:p:s:h")) >= 0)
+	while ((c = getopt(argc, argv, "cdgmn:p:s:h")) >= 0)
 	{
 		switch (c)
 		{
 			case 'c':
 				enable_checks = 1;
 				break;
+			case 'd':
+				use_doorbell = 1;
+				break;
+			case 'g':
+				use_progress_map = 1;
+				break;
+			case 'm':
+				use_module_buffer = 1;
+				break;
 			case 'n':
 				num_processes = atoi(optarg);
 				break;
@@ -20,7 +20,6 @@
 #include <sys/types.h>
 #include "../kmod/nvme_strom.h"
 
-#define offsetof(type, field)	((long) &((type *)0)->field)
 #define Max(a,b)				((a) > (b) ? (a) : (b))
 #define Min(a,b)				((a) < (b) ? (a) : (b))
 #define BLCKSZ					(8192)		/* usual PostgreSQL config */